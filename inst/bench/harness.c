@@ -0,0 +1,200 @@
+/* Benchmark harness for the engine and WAV I/O without an audio device
+
+   It embeds R (which must be built with --enable-R-shlib) and links the
+   package sources directly, the engine renders into memory instead of
+   a device (device-free sink):
+     cc -O2 `R CMD config --cppflags` -I../../src -o harness harness.c \
+        ../../src/engine.c ../../src/filter.c ../../src/fft.c ../../src/file.c \
+        `R CMD config --ldflags` -lm
+     R_HOME=`R RHOME` ./harness [seconds] > harness.tsv
+
+   Output is tab-separated with the columns
+     benchmark, case, param, value, unit
+   (the same layout as bench.R) so that runs can be compared by joining
+   on the first three columns. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <Rembedded.h>
+#include "engine.h"
+
+SEXP load_wave_file(SEXP src);
+SEXP save_wave_file(SEXP where, SEXP what, SEXP sDither);
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + ((double) ts.tv_nsec) * 1e-9;
+}
+
+static void result(const char *bench, const char *cs, const char *param, double value, const char *unit) {
+	printf("%s\t%s\t%s\t%.6g\t%s\n", bench, cs, param, value, unit);
+}
+
+/* stereo test signal, either as doubles or as 16-bit integers */
+static SEXP test_signal(int frames, int integer) {
+	SEXP x = Rf_protect(Rf_allocMatrix(integer ? INTSXP : REALSXP, 2, frames));
+	int i;
+	for (i = 0; i < 2 * frames; i++) {
+		double v = 0.5 * sin(0.01 * (double) (i / 2)) + 0.01 * (double) ((i * 7919) % 13 - 6) / 6.0;
+		if (integer)
+			INTEGER(x)[i] = (int) (v * 32767.0);
+		else
+			REAL(x)[i] = v;
+	}
+	Rf_unprotect(1);
+	return x;
+}
+
+/* conversion throughput of the render path for each source type,
+   output format and dither mode */
+static void bench_convert(double secs) {
+	const int frames = 1 << 20;
+	const char *dn[] = { "none", "tpdf", "shaped" };
+	short *s16 = (short*) malloc(sizeof(short) * 2 * frames);
+	float *f32 = (float*) malloc(sizeof(float) * 2 * frames);
+	int integer, mode;
+	for (integer = 0; integer < 2; integer++) {
+		SEXP x = Rf_protect(test_signal(frames, integer));
+		const char *src = integer ? "int" : "double";
+		char cs[64];
+		for (mode = DITHER_NONE; mode <= DITHER_SHAPED + 1; mode++) {
+			audio_engine_t *e = audio_engine_new(x, 44100.0, 2, APFLAG_LOOP);
+			double t0 = now(), t;
+			long n = 0;
+			if (mode <= DITHER_SHAPED)
+				audio_engine_set_dither(e, mode);
+			do {
+				if (mode <= DITHER_SHAPED)
+					n += audio_engine_render_s16(e, s16, frames);
+				else
+					n += audio_engine_render_f32(e, f32, frames);
+			} while ((t = now() - t0) < secs);
+			if (mode <= DITHER_SHAPED)
+				snprintf(cs, sizeof(cs), "%s->s16/%s", src, dn[mode]);
+			else
+				snprintf(cs, sizeof(cs), "%s->f32", src);
+			result("convert", cs, "stereo", (double) n * 2.0 / t * 1e-6, "Msamples/s");
+			audio_engine_free(e);
+		}
+		Rf_unprotect(1);
+	}
+	free(s16);
+	free(f32);
+}
+
+static int cmp_double(const void *a, const void *b) {
+	double x = *(const double*) a, y = *(const double*) b;
+	return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+/* CPU time per callback for a range of buffer sizes, the share of the
+   callback period spent rendering is the relevant number for glitches */
+static void bench_callback(int with_filters) {
+	const int sizes[] = { 64, 128, 256, 512, 1024, 2048, 4096 };
+	const int calls = 2000;
+	const double rate = 44100.0;
+	double *times = (double*) malloc(sizeof(double) * calls);
+	short *out = (short*) malloc(sizeof(short) * 2 * 4096);
+	SEXP x = Rf_protect(test_signal(44100, 0));
+	const char *cs = with_filters ? "double->s16+filters" : "double->s16";
+	unsigned int k;
+	for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+		audio_engine_t *e = audio_engine_new(x, (float) rate, 2, APFLAG_LOOP);
+		double sum = 0.0, period = (double) sizes[k] / rate;
+		char param[32];
+		int i;
+		if (with_filters) {
+			/* one lowpass and one peaking biquad, typical EQ use */
+			SEXP spec = Rf_protect(Rf_allocVector(VECSXP, 2)), names;
+			const char *nm[] = { "type", "kind", "freq", "Q", "gain" };
+			const char *kinds[] = { "lowpass", "peak" };
+			int j, l;
+			for (j = 0; j < 2; j++) {
+				SEXP f = Rf_allocVector(VECSXP, 5);
+				SET_VECTOR_ELT(spec, j, f);
+				names = Rf_allocVector(STRSXP, 5);
+				Rf_setAttrib(f, R_NamesSymbol, names);
+				for (l = 0; l < 5; l++)
+					SET_STRING_ELT(names, l, Rf_mkChar(nm[l]));
+				SET_VECTOR_ELT(f, 0, Rf_mkString("biquad"));
+				SET_VECTOR_ELT(f, 1, Rf_mkString(kinds[j]));
+				SET_VECTOR_ELT(f, 2, Rf_ScalarReal(j ? 1000.0 : 8000.0));
+				SET_VECTOR_ELT(f, 3, Rf_ScalarReal(0.707));
+				SET_VECTOR_ELT(f, 4, Rf_ScalarReal(j ? 6.0 : 0.0));
+			}
+			audio_engine_set_filters(e, filter_chain_create(spec, (float) rate, 2));
+			Rf_unprotect(1);
+		}
+		for (i = 0; i < calls; i++) {
+			double t0 = now();
+			audio_engine_render_s16(e, out, sizes[k]);
+			times[i] = now() - t0;
+			sum += times[i];
+		}
+		qsort(times, calls, sizeof(double), cmp_double);
+		snprintf(param, sizeof(param), "%d", sizes[k]);
+		result("callback", cs, param, sum / (double) calls * 1e6, "us_mean");
+		result("callback", cs, param, times[calls * 99 / 100] * 1e6, "us_p99");
+		result("callback", cs, param, times[calls - 1] * 1e6, "us_max");
+		result("callback", cs, param, sum / (double) calls / period * 100.0, "pct_of_period");
+		audio_engine_free(e);
+	}
+	Rf_unprotect(1);
+	free(times);
+	free(out);
+}
+
+/* WAV save/load in MB/s of file size */
+static void bench_wave(void) {
+	const int lens[] = { 1, 10, 60 }; /* seconds of stereo 44.1kHz */
+	const int bits[] = { 8, 16, 32 };
+	char path[] = "/tmp/audio-bench-XXXXXX";
+	int fd = mkstemp(path), i, j;
+	SEXP sPath, sDither;
+	if (fd == -1) {
+		fprintf(stderr, "cannot create temporary file\n");
+		return;
+	}
+	close(fd);
+	sPath = Rf_protect(Rf_mkString(path));
+	sDither = Rf_protect(Rf_ScalarInteger(DITHER_NONE));
+	for (i = 0; i < 3; i++) {
+		SEXP x = Rf_protect(test_signal(lens[i] * 44100, 0));
+		Rf_setAttrib(x, Rf_install("rate"), Rf_ScalarInteger(44100));
+		for (j = 0; j < 3; j++) {
+			double mb = (double) lens[i] * 44100.0 * 2.0 * (double) (bits[j] / 8) / 1048576.0, t0, t1, t2;
+			char cs[16], param[16];
+			Rf_setAttrib(x, Rf_install("bits"), Rf_ScalarInteger(bits[j]));
+			t0 = now();
+			save_wave_file(sPath, x, sDither);
+			t1 = now();
+			load_wave_file(sPath);
+			t2 = now();
+			snprintf(cs, sizeof(cs), "%dbit", bits[j]);
+			snprintf(param, sizeof(param), "%ds", lens[i]);
+			result("wave.save", cs, param, mb / (t1 - t0), "MB/s");
+			result("wave.load", cs, param, mb / (t2 - t1), "MB/s");
+		}
+		Rf_unprotect(1);
+	}
+	Rf_unprotect(2);
+	unlink(path);
+}
+
+int main(int ac, char **av) {
+	char *rargv[] = { "harness", "--vanilla", "--silent", "--no-save" };
+	double secs = (ac > 1) ? atof(av[1]) : 0.5;
+	Rf_initEmbeddedR(4, rargv);
+	printf("benchmark\tcase\tparam\tvalue\tunit\n");
+	bench_convert(secs);
+	bench_callback(0);
+	bench_callback(1);
+	bench_wave();
+	Rf_endEmbeddedR(0);
+	return 0;
+}
@@ -0,0 +1,532 @@
+/* Audio driver for R using ALSA (Linux)
+   audio R package
+   Copyright(c) 2026 Simon Urbanek
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation
+   files (the "Software"), to deal in the Software without
+   restriction, including without limitation the rights to use, copy,
+   modify, merge, publish, distribute, sublicense, and/or sell copies
+   of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   * The above copyright notice and this permission notice shall be
+     included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND ON
+   INFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR
+   ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+   CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+   WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+   The text above constitutes the entire license; however, the
+   PortAudio community also makes the following non-binding requests:
+
+   * Any person wishing to distribute modifications to the Software is
+     requested to send the modifications to the original developer so
+     that they can be incorporated into the canonical version. It is
+     also requested that these non-binding requests be included along
+     with the license above.
+
+ */
+
+#include "driver.h"
+#if HAS_ALSA
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/select.h>
+#include "engine.h"
+
+#include <alsa/asoundlib.h>
+
+/* ALSA has no callbacks, each instance runs a thread which waits for
+   the device and renders directly into the mmap()ed hardware ring (or
+   into a scratch buffer if the PCM doesn't support mmap access) */
+
+#define kDefaultPeriodSize 1024
+#define kDefaultPeriods    4
+
+#define BOOL int
+#ifndef YES
+#define YES 1
+#define NO  0
+#endif
+
+#define SAMPLE_SIZE(P) (((P)->format == AFMT_F32) ? sizeof(float) : sizeof(short))
+#define ALSA_FORMAT(F) (((F) == AFMT_F32) ? SND_PCM_FORMAT_FLOAT : SND_PCM_FORMAT_S16)
+
+typedef struct alsa_info {
+	/* the following entries must be present since alsa_info_t inherits from audio_instance_t */
+	audio_driver_t *driver;  /* must point to the driver that created this */
+	int kind;                /* must be either AI_PLAYER or AI_RECORDER */
+	SEXP source;
+	audio_engine_t *engine;
+	/* private entries */
+	snd_pcm_t *pcm;
+	float sample_rate;
+	int format;              /* AFMT_S16 or AFMT_F32 */
+	BOOL mmap;               /* the PCM accepted mmap access */
+	snd_pcm_uframes_t period, buffer; /* in frames, as granted by the device */
+	void *scratch;           /* one period for read/write access */
+	pthread_t thread;
+	BOOL running;            /* (R) the thread has been created */
+	BOOL quit;               /* (R) ask the thread to exit */
+	BOOL done;               /* (audio) end of the source or target reached */
+} alsa_info_t;
+
+/* audio thread: recover from xruns and suspends, returns a negative
+   value if the stream is unusable */
+static int alsa_recover(alsa_info_t *p, int err) {
+	if (err == -EPIPE) {
+		if (p->kind == AI_PLAYER)
+			audio_engine_xrun(p->engine, 1, 0);
+		else
+			audio_engine_xrun(p->engine, 0, 1);
+		err = snd_pcm_prepare(p->pcm);
+	} else if (err == -ESTRPIPE) {
+		struct timeval tv;
+		while ((err = snd_pcm_resume(p->pcm)) == -EAGAIN) {
+			tv.tv_sec = 0;
+			tv.tv_usec = 10000;
+			select(0, 0, 0, 0, &tv);
+		}
+		if (err < 0)
+			err = snd_pcm_prepare(p->pcm);
+	}
+	/* capture has to be restarted explicitly */
+	if (err >= 0 && p->kind == AI_RECORDER)
+		err = snd_pcm_start(p->pcm);
+	return err;
+}
+
+/* audio thread: device time of the next frame to be played or of the
+   oldest frame waiting to be read */
+static double alsa_stream_time(alsa_info_t *p) {
+	snd_pcm_sframes_t delay = 0;
+	if (snd_pcm_state(p->pcm) != SND_PCM_STATE_RUNNING || snd_pcm_delay(p->pcm, &delay) < 0)
+		return NAN;
+	return audio_engine_clock() + ((p->kind == AI_PLAYER) ? 1.0 : -1.0) * ((double) delay) / p->sample_rate;
+}
+
+/* audio thread: interleaved frames at offset in the mmap()ed ring */
+static void *area_ptr(const snd_pcm_channel_area_t *areas, snd_pcm_uframes_t offset) {
+	return ((char*) areas[0].addr) + (areas[0].first + offset * areas[0].step) / 8;
+}
+
+static void *alsa_play_thread(void *arg) {
+	alsa_info_t *p = (alsa_info_t*) arg;
+	audio_engine_t *e = p->engine;
+	while (!AE_LOAD(p->quit)) {
+		snd_pcm_sframes_t avail = snd_pcm_avail_update(p->pcm);
+		unsigned int total = 0;
+		BOOL eos = NO;
+		double start;
+		int err;
+		if (avail < 0) {
+			if (alsa_recover(p, (int) avail) < 0) break;
+			continue;
+		}
+		if ((snd_pcm_uframes_t) avail < p->period) {
+			/* the stream starts by itself once the ring is full */
+			if ((err = snd_pcm_wait(p->pcm, 100)) < 0 && alsa_recover(p, err) < 0) break;
+			continue;
+		}
+		start = audio_engine_clock();
+		audio_engine_timestamp(e, alsa_stream_time(p));
+		while (avail > 0 && !eos) {
+			const snd_pcm_channel_area_t *areas;
+			snd_pcm_uframes_t offset = 0, n = (snd_pcm_uframes_t) avail;
+			snd_pcm_sframes_t res;
+			unsigned int rem;
+			void *buf = p->scratch;
+			if (p->mmap) {
+				if ((err = snd_pcm_mmap_begin(p->pcm, &areas, &offset, &n)) < 0) break;
+				buf = area_ptr(areas, offset);
+			} else if (n > p->period)
+				n = p->period;
+			if (p->format == AFMT_F32)
+				rem = audio_engine_render_f32(e, (float*) buf, (unsigned int) n);
+			else
+				rem = audio_engine_render_s16(e, (short*) buf, (unsigned int) n);
+			if (rem < n) {
+				memset(((char*) buf) + rem * e->chs * SAMPLE_SIZE(p), 0, (n - rem) * e->chs * SAMPLE_SIZE(p));
+				if (rem == 0) eos = YES;
+			}
+			res = p->mmap ? snd_pcm_mmap_commit(p->pcm, offset, n) : snd_pcm_writei(p->pcm, buf, n);
+			if (res < 0 || (snd_pcm_uframes_t) res != n) {
+				alsa_recover(p, (res < 0) ? (int) res : -EPIPE);
+				break;
+			}
+			avail -= n;
+			total += n;
+		}
+		audio_engine_callback_done(e, start, total);
+		if (eos) {
+			/* play what is in the ring (this also starts streams
+			   shorter than the ring) */
+			snd_pcm_drain(p->pcm);
+			break;
+		}
+	}
+	AE_STORE(p->done, YES);
+	return 0;
+}
+
+/* audio thread: convert interleaved samples and pass them to the
+   engine in blocks, the recorder doesn't use the engine's scratch
+   buffer otherwise */
+static void alsa_capture(alsa_info_t *p, const void *buf, unsigned int frames) {
+	audio_engine_t *e = p->engine;
+	unsigned int i = 0, n = frames * e->chs;
+	while (i < n) {
+		unsigned int k = 0;
+		if (p->format == AFMT_F32) {
+			const float *src = (const float*) buf;
+			while (k < AE_BLOCK * e->chs && i < n)
+				e->buf[k++] = (double) src[i++];
+		} else {
+			const short *src = (const short*) buf;
+			while (k < AE_BLOCK * e->chs && i < n)
+				e->buf[k++] = ((double) src[i++]) / 32768.0;
+		}
+		audio_engine_capture(e, e->buf, k / e->chs);
+	}
+}
+
+static void *alsa_record_thread(void *arg) {
+	alsa_info_t *p = (alsa_info_t*) arg;
+	audio_engine_t *e = p->engine;
+	int err;
+	if ((err = snd_pcm_start(p->pcm)) < 0 && alsa_recover(p, err) < 0) {
+		AE_STORE(p->done, YES);
+		return 0;
+	}
+	while (!AE_LOAD(p->quit)) {
+		snd_pcm_sframes_t avail = snd_pcm_avail_update(p->pcm);
+		unsigned int total = 0;
+		double start;
+		if (avail < 0) {
+			if (alsa_recover(p, (int) avail) < 0) break;
+			continue;
+		}
+		if ((snd_pcm_uframes_t) avail < p->period) {
+			if ((err = snd_pcm_wait(p->pcm, 100)) < 0 && alsa_recover(p, err) < 0) break;
+			continue;
+		}
+		start = audio_engine_clock();
+		audio_engine_timestamp(e, alsa_stream_time(p));
+		while (avail > 0) {
+			const snd_pcm_channel_area_t *areas;
+			snd_pcm_uframes_t offset = 0, n = (snd_pcm_uframes_t) avail;
+			snd_pcm_sframes_t res;
+			if (p->mmap) {
+				if ((err = snd_pcm_mmap_begin(p->pcm, &areas, &offset, &n)) < 0) break;
+				alsa_capture(p, area_ptr(areas, offset), (unsigned int) n);
+				res = snd_pcm_mmap_commit(p->pcm, offset, n);
+			} else {
+				if (n > p->period) n = p->period;
+				if ((res = snd_pcm_readi(p->pcm, p->scratch, n)) > 0)
+					alsa_capture(p, p->scratch, (unsigned int) res);
+			}
+			if (res < 0 || (snd_pcm_uframes_t) res != n) {
+				alsa_recover(p, (res < 0) ? (int) res : -EPIPE);
+				break;
+			}
+			avail -= n;
+			total += n;
+		}
+		audio_engine_callback_done(e, start, total);
+		/* the recording is complete when the target is full */
+		if (AE_LOAD(e->position) >= e->length || e->stopped) {
+			snd_pcm_drop(p->pcm);
+			break;
+		}
+	}
+	AE_STORE(p->done, YES);
+	return 0;
+}
+
+/* (R) integer option or the default if unset */
+static int int_option(const char *name, int def) {
+	SEXP o = Rf_GetOption1(Rf_install(name));
+	int v;
+	if (o == R_NilValue || LENGTH(o) < 1 || (v = Rf_asInteger(o)) == R_NaInt)
+		return def;
+	return v;
+}
+
+/* configure the hardware parameters, mmap access is preferred */
+static int alsa_setup(alsa_info_t *p, int format, int chs, int buffer) {
+	snd_pcm_hw_params_t *hw;
+	snd_pcm_sw_params_t *sw;
+	unsigned int rate = (unsigned int) (p->sample_rate + 0.5);
+	snd_pcm_uframes_t period = (buffer > 0) ? buffer : kDefaultPeriodSize, size;
+	int err, dir = 0, periods = int_option("audio.alsa.periods", kDefaultPeriods);
+	if (periods < 2) periods = 2;
+	if ((err = snd_pcm_hw_params_malloc(&hw)) < 0)
+		return err;
+	if ((err = snd_pcm_hw_params_any(p->pcm, hw)) < 0) {
+		snd_pcm_hw_params_free(hw);
+		return err;
+	}
+	p->mmap = (snd_pcm_hw_params_set_access(p->pcm, hw, SND_PCM_ACCESS_MMAP_INTERLEAVED) >= 0);
+	if ((!p->mmap && (err = snd_pcm_hw_params_set_access(p->pcm, hw, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) ||
+		(err = snd_pcm_hw_params_set_format(p->pcm, hw, ALSA_FORMAT(format))) < 0 ||
+		(err = snd_pcm_hw_params_set_channels(p->pcm, hw, chs)) < 0 ||
+		(err = snd_pcm_hw_params_set_rate_near(p->pcm, hw, &rate, &dir)) < 0 ||
+		(err = snd_pcm_hw_params_set_period_size_near(p->pcm, hw, &period, &dir)) < 0) {
+		snd_pcm_hw_params_free(hw);
+		return err;
+	}
+	size = period * periods;
+	if ((err = snd_pcm_hw_params_set_buffer_size_near(p->pcm, hw, &size)) < 0 ||
+		(err = snd_pcm_hw_params(p->pcm, hw)) < 0) {
+		snd_pcm_hw_params_free(hw);
+		return err;
+	}
+	snd_pcm_hw_params_get_period_size(hw, &p->period, &dir);
+	snd_pcm_hw_params_get_buffer_size(hw, &p->buffer);
+	snd_pcm_hw_params_free(hw);
+	/* a different rate would change the pitch, use a plug: device for
+	   resampling */
+	if (rate != (unsigned int) (p->sample_rate + 0.5))
+		return -EINVAL;
+	p->format = format;
+	if ((err = snd_pcm_sw_params_malloc(&sw)) < 0)
+		return err;
+	/* playback starts once the ring is full, capture is started by the thread */
+	if ((err = snd_pcm_sw_params_current(p->pcm, sw)) >= 0 &&
+		(err = snd_pcm_sw_params_set_start_threshold(p->pcm, sw, (p->kind == AI_PLAYER) ? p->buffer : p->buffer + 1)) >= 0 &&
+		(err = snd_pcm_sw_params_set_avail_min(p->pcm, sw, p->period)) >= 0)
+		err = snd_pcm_sw_params(p->pcm, sw);
+	snd_pcm_sw_params_free(sw);
+	return err;
+}
+
+static void alsa_dispose(void *usr);
+
+/* the device list is built by alsa_devices() from the PCM hints */
+typedef struct alsa_device {
+	char *name;
+	int out, in;
+} alsa_device_t;
+
+static alsa_device_t *alsa_device_list;
+static int alsa_ndevices;
+
+static audio_instance_t *alsa_open(const audio_config_t *cfg) {
+	alsa_info_t *p;
+	audio_engine_t *engine;
+	const char *name = "default";
+	SEXP sDev = Rf_GetOption1(Rf_install("audio.alsa.device"));
+	float rate = (cfg->rate > 0.0) ? cfg->rate : 44100.0;
+	int err, chs;
+	if (cfg->device >= 0 && cfg->device < alsa_ndevices)
+		name = alsa_device_list[cfg->device].name;
+	else if (TYPEOF(sDev) == STRSXP && LENGTH(sDev) > 0)
+		name = CHAR(STRING_ELT(sDev, 0));
+	/* the engine raises R errors, so it is created before anything
+	   that would have to be released */
+	if (cfg->kind == AI_PLAYER)
+		engine = audio_engine_new(cfg->source, rate, 0, cfg->flags);
+	else
+		engine = audio_engine_new(cfg->target, rate, cfg->channels, cfg->flags);
+	if (!(p = (alsa_info_t*) calloc(1, sizeof(alsa_info_t)))) {
+		audio_engine_free(engine);
+		Rf_error("out of memory");
+	}
+	p->kind = cfg->kind;
+	p->sample_rate = rate;
+	p->engine = engine;
+	p->source = (cfg->kind == AI_PLAYER) ? cfg->source : cfg->target;
+	R_PreserveObject(p->source);
+	chs = p->engine->chs;
+	if ((err = snd_pcm_open(&p->pcm, name, (cfg->kind == AI_PLAYER) ? SND_PCM_STREAM_PLAYBACK : SND_PCM_STREAM_CAPTURE, 0)) < 0) {
+		p->pcm = 0;
+		alsa_dispose(p);
+		Rf_error("cannot open ALSA device '%s': %s", name, snd_strerror(err));
+	}
+	/* negotiate the format now rather than failing in start: use the
+	   requested one if the device takes it, otherwise the other one */
+	if ((err = alsa_setup(p, cfg->format, chs, cfg->buffer)) < 0)
+		err = alsa_setup(p, (cfg->format == AFMT_F32) ? AFMT_S16 : AFMT_F32, chs, cfg->buffer);
+	if (err < 0) {
+		alsa_dispose(p);
+		Rf_error("the ALSA device '%s' doesn't support the requested parameters (%d channel(s) at %g Hz): %s",
+				 name, chs, (double) cfg->rate, (err == -EINVAL) ? "invalid argument or unsupported rate" : snd_strerror(err));
+	}
+	if (!p->mmap && !(p->scratch = malloc(p->period * chs * SAMPLE_SIZE(p)))) {
+		alsa_dispose(p);
+		Rf_error("out of memory");
+	}
+	return (audio_instance_t*) p;
+}
+
+static int alsa_caps(audio_caps_t *caps) {
+	caps->flags = ACAP_PLAY | ACAP_RECORD | ACAP_DEVICES | ACAP_ENGINE;
+	caps->formats = AFMT_S16 | AFMT_F32;
+	caps->native_format = AFMT_S16;
+	caps->max_in = AE_MAX_CHANNELS;
+	caps->max_out = AE_MAX_CHANNELS;
+	caps->min_rate = 1000.0;
+	caps->max_rate = 384000.0;
+	caps->default_rate = 44100.0;
+	caps->min_buffer = 16;
+	caps->max_buffer = 65536;
+	return 1;
+}
+
+/* ALSA only reports the direction of PCMs without opening them, so the
+   channel counts are upper bounds */
+static int alsa_devices(void) {
+	void **hints, **h;
+	int i, n = 0;
+	for (i = 0; i < alsa_ndevices; i++)
+		free(alsa_device_list[i].name);
+	free(alsa_device_list);
+	alsa_device_list = 0;
+	alsa_ndevices = 0;
+	if (snd_device_name_hint(-1, "pcm", &hints) < 0)
+		return 0;
+	for (h = hints; *h; h++) n++;
+	if ((alsa_device_list = (alsa_device_t*) calloc(n + 1, sizeof(alsa_device_t)))) {
+		for (h = hints; *h; h++) {
+			char *name = snd_device_name_get_hint(*h, "NAME"), *io;
+			if (!name) continue;
+			io = snd_device_name_get_hint(*h, "IOID"); /* NULL means both */
+			alsa_device_list[alsa_ndevices].name = name;
+			alsa_device_list[alsa_ndevices].out = (!io || !strcmp(io, "Output")) ? AE_MAX_CHANNELS : 0;
+			alsa_device_list[alsa_ndevices].in = (!io || !strcmp(io, "Input")) ? AE_MAX_CHANNELS : 0;
+			alsa_ndevices++;
+			free(io);
+		}
+	}
+	snd_device_name_free_hint(hints);
+	return alsa_ndevices;
+}
+
+static int alsa_device_info(int index, audio_device_info_t *di) {
+	if (index < 0 || index >= alsa_ndevices) return 0;
+	di->name = alsa_device_list[index].name;
+	di->host_api = "ALSA";
+	di->max_out = alsa_device_list[index].out;
+	di->max_in = alsa_device_list[index].in;
+	di->is_default_out = di->is_default_in = !strcmp(di->name, "default");
+	return 1;
+}
+
+static int alsa_start(void *usr) {
+	alsa_info_t *p = (alsa_info_t*) usr;
+	int err;
+	if (p->running) {
+		AE_STORE(p->quit, YES);
+		pthread_join(p->thread, 0);
+		p->running = NO;
+	}
+	p->done = p->quit = NO;
+	if ((err = snd_pcm_prepare(p->pcm)) < 0)
+		Rf_error("cannot prepare ALSA device: %s", snd_strerror(err));
+	if (pthread_create(&p->thread, 0, (p->kind == AI_PLAYER) ? alsa_play_thread : alsa_record_thread, p))
+		Rf_error("cannot create audio thread");
+	p->running = YES;
+	return YES;
+}
+
+/* pause and resume are executed by the audio thread, the stream keeps
+   running with silence so R never has to wait for the ring to drain */
+static int alsa_pause(void *usr) {
+	alsa_info_t *p = (alsa_info_t*) usr;
+	return audio_engine_post(p->engine, AE_CMD_PAUSE, 0, 0, 0, 0, 0.0);
+}
+
+static int alsa_resume(void *usr) {
+	alsa_info_t *p = (alsa_info_t*) usr;
+	/* a completed stream has to be restarted */
+	if (AE_LOAD(p->done) && !alsa_start(p))
+		return 0;
+	return audio_engine_post(p->engine, AE_CMD_RESUME, 0, 0, 0, 0, 0.0);
+}
+
+static int alsa_rewind(void *usr) {
+	alsa_info_t *p = (alsa_info_t*) usr;
+	audio_engine_rewind(p->engine);
+	return 1;
+}
+
+/* helper function - precise sleep */
+static void millisleep(double tout) {
+	struct timeval tv;
+	tv.tv_sec  = (unsigned int) tout;
+	tv.tv_usec = (unsigned int)((tout - ((double)tv.tv_sec)) * 1000000.0);
+	select(0, 0, 0, 0, &tv);
+}
+
+static int alsa_wait(void *usr, double timeout) {
+	alsa_info_t *p = (alsa_info_t*) usr;
+	if (timeout < 0) timeout = 9999999.0; /* really a dummy high number */
+	while (p == NULL || !AE_LOAD(p->done)) {
+		/* use 100ms slices */
+		double slice = (timeout > 0.1) ? 0.1 : timeout;
+		if (slice <= 0.0) break;
+		millisleep(slice);
+		if (p) audio_engine_service(p->engine); /* refill function sources */
+		R_CheckUserInterrupt(); /* FIXME: we should adjust for time spent processing events */
+		timeout -= slice;
+	}
+	return (p && AE_LOAD(p->done)) ? WAIT_DONE : WAIT_TIMEOUT;
+}
+
+static int alsa_close(void *usr) {
+	alsa_info_t *p = (alsa_info_t*) usr;
+	if (p->running) {
+		AE_STORE(p->quit, YES);
+		pthread_join(p->thread, 0);
+		p->running = NO;
+	}
+	if (p->pcm) {
+		snd_pcm_drop(p->pcm);
+		snd_pcm_close(p->pcm);
+		p->pcm = 0;
+	}
+	return 1;
+}
+
+static void alsa_dispose(void *usr) {
+	alsa_info_t *p = (alsa_info_t*) usr;
+	alsa_close(p);
+	audio_engine_free(p->engine);
+	R_ReleaseObject(p->source);
+	free(p->scratch);
+	free(usr);
+}
+
+/* define the audio driver */
+audio_driver_t alsa_audio_driver = {
+	sizeof(audio_driver_t),
+
+	"alsa",
+	"ALSA driver",
+	"Copyright(c) 2026 Simon Urbanek",
+
+	0, /* only the v2 open entry is used */
+	0,
+	alsa_start,
+	alsa_pause,
+	alsa_resume,
+	alsa_rewind,
+	alsa_wait,
+	alsa_close,
+	alsa_dispose,
+
+	alsa_caps,
+	alsa_devices,
+	alsa_device_info,
+	alsa_open
+};
+
+#endif
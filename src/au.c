@@ -35,8 +35,10 @@
 #include "driver.h"
 
 #if HAS_AU
+#include "engine.h"
 #include <AudioUnit/AudioUnit.h>
 #include <sys/select.h> /* for select in millisleep */
+#include <math.h>
 
 #define kNumberOutputBuffers 3
 #define kOutputBufferSize 4096
@@ -62,6 +64,7 @@ typedef struct au_instance {
 	audio_driver_t *driver;  /* must point to the driver that created this */
 	int kind;                /* must be either AI_PLAYER or AI_RECORDER */
 	SEXP source;
+	audio_engine_t *engine;
 	/* private entries */
 	AudioUnit outUnit;
 	AudioDeviceID inDev;
@@ -71,37 +74,14 @@ typedef struct au_instance {
 #endif
 	float sample_rate;
 	double srFrac, srRun;
-	BOOL stereo, loop, done;
-	unsigned int position, length;
+	BOOL stereo, done;
 } au_instance_t;
 	
 /* fill a buffer and return the number of frames filled */
 static int primeBuffer(au_instance_t *ap, void *outputBuffer, unsigned int framesPerBuffer)
 {
-	if (ap->position == ap->length && ap->loop)
-		ap->position = 0;
-	unsigned int index = ap->position;
-	unsigned int rem = ap->length - index;
-	unsigned int spf = ap->stereo ? 2 : 1;
-	if (rem > framesPerBuffer) rem = framesPerBuffer;
-	//printf("position=%d, length=%d, (LEN=%d), rem=%d, cap=%d, spf=%d\n", ap->position, ap->length, LENGTH(ap->source), rem, framesPerBuffer, spf);
-	index *= spf;
-	// there is a small caveat - if a zero-size buffer comes along it will stop the playback since rem will be forced to 0 - but then that should not happen ...
-	if (rem > 0) {
-		unsigned int samples = rem * spf; // samples (i.e. SInt16s)
-		SInt16 *iBuf = (SInt16*) outputBuffer;
-		SInt16 *sentinel = iBuf + samples;
-		if (TYPEOF(ap->source) == INTSXP) {
-			int *iSrc = INTEGER(ap->source) + index;
-			while (iBuf < sentinel)
-				*(iBuf++) = (SInt16) *(iSrc++);
-		} else if (TYPEOF(ap->source) == REALSXP) {
-			double *iSrc = REAL(ap->source) + index;
-			while (iBuf < sentinel)
-				*(iBuf++) = (SInt16) (32767.0 * (*(iSrc++)));
-		} // FIXME: support functions as sources...
-		ap->position += rem;
-	} else {
+	unsigned int rem = audio_engine_render_s16(ap->engine, (SInt16*) outputBuffer, framesPerBuffer);
+	if (rem == 0) {
 		// printf(" rem ==0 -> stop queue\n");
 		ap->done = YES;
 		return 0;
@@ -112,8 +92,12 @@ static int primeBuffer(au_instance_t *ap, void *outputBuffer, unsigned int frame
 static OSStatus outputRenderProc(void *inRefCon, AudioUnitRenderActionFlags *inActionFlags, const AudioTimeStamp *inTimeStamp, UInt32 inBusNumber, UInt32 inNumFrames, AudioBufferList *ioData)
 {
 	au_instance_t *p = (au_instance_t*) inRefCon;
+	double start = audio_engine_clock();
+	audio_engine_timestamp(p->engine, (inTimeStamp && (inTimeStamp->mFlags & kAudioTimeStampSampleTimeValid)) ?
+						   inTimeStamp->mSampleTime / p->sample_rate : NAN);
 	/* printf("outputRenderProc, (bufs=%d, buf[0].chs=%d), buf=%p, size=%d\n", ioData->mNumberBuffers, ioData->mBuffers[0].mNumberChannels, ioData->mBuffers[0].mData, ioData->mBuffers[0].mDataByteSize); */
 	int res = primeBuffer(p, ioData->mBuffers[0].mData, ioData->mBuffers[0].mDataByteSize / (p->stereo ? 4 : 2));
+	audio_engine_callback_done(p->engine, start, inNumFrames);
 	/* printf(" - primed: %d samples (%d bytes)\n", res, res * (p->stereo ? 4 : 2)); */
 	if (res < 0) res = 0;
 	ioData->mBuffers[0].mDataByteSize = res * (p->stereo ? 4 : 2);
@@ -124,24 +108,20 @@ static OSStatus outputRenderProc(void *inRefCon, AudioUnitRenderActionFlags *inA
 	return noErr;
 }
 
-static au_instance_t *audiounits_create_player(SEXP source, float rate, int flags) {
-	ComponentDescription desc = { kAudioUnitType_Output, kAudioUnitSubType_DefaultOutput, kAudioUnitManufacturer_Apple, 0, 0 };
+/* dev is 0 for the default output which follows system changes, a
+   specific device requires the HAL output unit */
+static au_instance_t *audiounits_open_player(SEXP source, float rate, int flags, AudioDeviceID dev) {
+	ComponentDescription desc = { kAudioUnitType_Output, dev ? kAudioUnitSubType_HALOutput : kAudioUnitSubType_DefaultOutput, kAudioUnitManufacturer_Apple, 0, 0 };
 	Component comp; 
 	OSStatus err;
 	
+	audio_engine_t *engine = audio_engine_new(source, rate, 0, flags);
 	au_instance_t *ap = (au_instance_t*) calloc(sizeof(au_instance_t), 1);
 	ap->source = source;
+	ap->engine = engine;
 	ap->sample_rate = rate;
 	ap->done = NO;
-	ap->position = 0;
-	ap->length = LENGTH(source);
-	ap->stereo = NO;
-	{ /* if the source is a matrix with 2 rows then we'll use stereo */
-		SEXP dim = Rf_getAttrib(source, R_DimSymbol);
-		if (TYPEOF(dim) == INTSXP && LENGTH(dim) > 0 && INTEGER(dim)[0] == 2)
-			ap->stereo = YES;
-	}
-	ap->loop = (flags & APFLAG_LOOP) ? YES : NO;
+	ap->stereo = (engine->chs == 2) ? YES : NO;
 	memset(&ap->fmtOut, 0, sizeof(ap->fmtOut));
 	ap->fmtOut.mSampleRate = ap->sample_rate;
 	ap->fmtOut.mFormatID = kAudioFormatLinearPCM;
@@ -153,11 +133,14 @@ static au_instance_t *audiounits_create_player(SEXP source, float rate, int flag
 	ap->fmtOut.mFramesPerPacket = 1;
 	ap->fmtOut.mBytesPerPacket = ap->fmtOut.mBytesPerFrame = ap->fmtOut.mFramesPerPacket * ap->fmtOut.mChannelsPerFrame * 2;
 	ap->fmtOut.mBitsPerChannel = 16;
-	if (ap->stereo) ap->length /= 2;
 	comp = FindNextComponent(NULL, &desc);
 	if (!comp) Rf_error("unable to find default audio output"); 
 	err = OpenAComponent(comp, &ap->outUnit);
 	if (err) Rf_error("unable to open default audio (%08x)", err);
+	if (dev && (err = AudioUnitSetProperty(ap->outUnit, kAudioOutputUnitProperty_CurrentDevice, kAudioUnitScope_Global, 0, &dev, sizeof(dev)))) {
+		CloseComponent(ap->outUnit);
+		Rf_error("unable to select the audio output device (%08x)", err);
+	}
 	err = AudioUnitInitialize(ap->outUnit);
 	if (err) {
 		CloseComponent(ap->outUnit);
@@ -167,6 +150,10 @@ static au_instance_t *audiounits_create_player(SEXP source, float rate, int flag
 	return ap;
 }
 
+static au_instance_t *audiounits_create_player(SEXP source, float rate, int flags) {
+	return audiounits_open_player(source, rate, flags, 0);
+}
+
 static int audiounits_pause(void *usr);
 
 static OSStatus inputRenderProc(AudioDeviceID inDevice, 
@@ -179,44 +166,60 @@ static OSStatus inputRenderProc(AudioDeviceID inDevice,
 	float *s = (float*) inInputData->mBuffers[0].mData;
 	unsigned int len = inInputData->mBuffers[0].mDataByteSize / sizeof(float), i = 0, ichs = inInputData->mBuffers[0].mNumberChannels;
 	au_instance_t *ap = (au_instance_t*) inClientData;
+	audio_engine_t *e = ap->engine;
+	double start = audio_engine_clock();
+	/* the input time stamp is in device frames which may run at a higher rate */
+	audio_engine_timestamp(e, (inInputTime && (inInputTime->mFlags & kAudioTimeStampSampleTimeValid) && ap->srFrac > 0.0) ?
+						   inInputTime->mSampleTime * ap->srFrac / ap->sample_rate : NAN);
 	/* Rprintf("inputRenderProc, (bufs=%d, buf[0].chs=%d), buf=%p, size=%d [%d samples]\n", inInputData->mNumberBuffers, inInputData->mBuffers[0].mNumberChannels, inInputData->mBuffers[0].mData, inInputData->mBuffers[0].mDataByteSize, len); */
+	/* a full target is only captured into again after a rewind */
+	audio_engine_sync(e);
 	if (TYPEOF(ap->source) == REALSXP) {
-		double *d = REAL(ap->source), srr = ap->srRun, srf = ap->srFrac;
-		unsigned int chs = ap->stereo ? 2 : 1;
+		double d[AE_BLOCK * 2], srr = ap->srRun, srf = ap->srFrac;
+		unsigned int chs = ap->stereo ? 2 : 1, k = 0;
 		/* FIXME: we're assuming that channels can only be 1 or 2 */
-		while (ap->position < ap->length && i < len) {
+		while (e->position < e->length && i < len) {
 			srr += srf;
 			if (srr >= 1.0) {
-				if (ichs > chs) d[ap->position++] = (s[i] + s[i + 1]) / 2; 
+				if (ichs > chs) d[k++] = (s[i] + s[i + 1]) / 2; 
 				else {
-					if (ichs < chs) d[ap->position++] = s[i];
-					d[ap->position++] = s[i];
+					if (ichs < chs) d[k++] = s[i];
+					d[k++] = s[i];
 				}
 				srr -= 1.0;
+				/* hand over full blocks to the engine */
+				if (k + 2 > AE_BLOCK * 2) {
+					audio_engine_capture(e, d, k / chs);
+					k = 0;
+				}
 			};
 			i++;
 		}
+		if (k >= chs)
+			audio_engine_capture(e, d, k / chs);
 		ap->srRun = srr;
 	}
+	/* the period in target frames (the device may run at a higher rate) */
+	audio_engine_callback_done(e, start, (unsigned int) (((double) (len / (ichs ? ichs : 1))) * ap->srFrac));
 	/* pause the unit when the recording is complete */
-	if (ap->position >= ap->length) {
+	if (e->position >= e->length) {
 		ap->done = YES;
 		audiounits_pause(ap);
 	}
 	return 0;
 }
 
-static au_instance_t *audiounits_create_recorder(SEXP source, float rate, int chs, int flags) {
+static au_instance_t *audiounits_open_recorder(SEXP source, float rate, int chs, int flags, AudioDeviceID dev) {
 	UInt32 propsize=0;
 	OSStatus err;
 	AudioObjectPropertyAddress aopAddress;
 
+	audio_engine_t *engine = audio_engine_new(source, rate, (chs == 2) ? 2 : 1, flags);
 	au_instance_t *ap = (au_instance_t*) calloc(sizeof(au_instance_t), 1);
 	ap->source = source;
+	ap->engine = engine;
 	ap->sample_rate = rate;
 	ap->done = NO;
-	ap->position = 0;
-	ap->length = LENGTH(source);
 	ap->stereo = (chs == 2) ? YES : NO;
 	
 	propsize = sizeof(ap->inDev);
@@ -224,9 +227,11 @@ static au_instance_t *audiounits_create_recorder(SEXP source, float rate, int ch
 		       kAudioObjectPropertyScopeGlobal,
 		       kAudioObjectPropertyElementMaster };
 
-	err = AudioObjectGetPropertyData(kAudioObjectSystemObject, &aopAddress, 0, NULL,
-					 &propsize, &ap->inDev);
+	err = dev ? 0 : AudioObjectGetPropertyData(kAudioObjectSystemObject, &aopAddress, 0, NULL,
+						   &propsize, &ap->inDev);
+	if (dev) ap->inDev = dev;
 	if (err) {
+		audio_engine_free(engine);
 		free(ap);
 		Rf_error("unable to find default audio input (%08x)", err);
 	}
@@ -236,6 +241,7 @@ static au_instance_t *audiounits_create_recorder(SEXP source, float rate, int ch
 	err = AudioObjectGetPropertyData(ap->inDev, &aopAddress, 0, NULL,
 					 &propsize, &ap->fmtIn);
 	if (err) {
+		audio_engine_free(engine);
 		free(ap);
 		Rf_error("unable to retrieve audio input format (%08x)", err);
 	}
@@ -252,6 +258,7 @@ static au_instance_t *audiounits_create_recorder(SEXP source, float rate, int ch
 	err = AudioDeviceAddIOProc(ap->inDev, inputRenderProc, ap);
 #endif
 	if (err) {
+		audio_engine_free(engine);
 		free(ap);
 		Rf_error("unable to register recording callback (%08x)", err);
 	}
@@ -268,6 +275,10 @@ static au_instance_t *audiounits_create_recorder(SEXP source, float rate, int ch
 	return ap;
 }
 
+static au_instance_t *audiounits_create_recorder(SEXP source, float rate, int chs, int flags) {
+	return audiounits_open_recorder(source, rate, chs, flags, 0);
+}
+
 static int audiounits_start(void *usr) {
 	au_instance_t *ap = (au_instance_t*) usr;
 	OSStatus err;
@@ -309,7 +320,7 @@ static int audiounits_pause(void *usr) {
 
 static int audiounits_rewind(void *usr) {
 	au_instance_t *p = (au_instance_t*) usr;
-	p->position = 0;
+	audio_engine_rewind(p->engine);
 	return 1;
 }
 
@@ -334,6 +345,7 @@ static int audiounits_wait(void *usr, double timeout) {
 		double slice = (timeout > 0.1) ? 0.1 : timeout;
 		if (slice <= 0.0) break;
 		millisleep(slice);
+		if (p) audio_engine_service(p->engine); /* refill function sources */
 		R_CheckUserInterrupt(); /* FIXME: we should adjust for time spent processing events */
 		timeout -= slice;
 	}
@@ -371,9 +383,108 @@ static void audiounits_dispose(void *usr) {
 		i++;
 	}
 #endif
+	audio_engine_free(p->engine);
 	free(usr);
 }
 
+/* both directions use 16-bit mono or stereo */
+static int audiounits_caps(audio_caps_t *caps) {
+	caps->flags = ACAP_PLAY | ACAP_RECORD | ACAP_DEVICES | ACAP_ENGINE;
+	caps->formats = caps->native_format = AFMT_S16;
+	caps->max_out = 2;
+	caps->max_in = 2;
+	caps->default_rate = 44100.0;
+	return 1;
+}
+
+/* device IDs from the last enumeration, the core indexes into them */
+static AudioDeviceID *au_devices;
+static int au_ndevices;
+
+static int audiounits_devices(void) {
+	AudioObjectPropertyAddress addr = { kAudioHardwarePropertyDevices, kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMaster };
+	UInt32 size = 0;
+	if (AudioObjectGetPropertyDataSize(kAudioObjectSystemObject, &addr, 0, NULL, &size) || !size)
+		return 0;
+	free(au_devices);
+	au_ndevices = 0;
+	if (!(au_devices = (AudioDeviceID*) malloc(size)))
+		return 0;
+	if (AudioObjectGetPropertyData(kAudioObjectSystemObject, &addr, 0, NULL, &size, au_devices))
+		return 0;
+	return (au_ndevices = (int) (size / sizeof(AudioDeviceID)));
+}
+
+/* total number of channels in the given scope */
+static int device_channels(AudioDeviceID dev, UInt32 scope) {
+	AudioObjectPropertyAddress addr = { kAudioDevicePropertyStreamConfiguration, scope, kAudioObjectPropertyElementMaster };
+	AudioBufferList *bl;
+	UInt32 size = 0, i;
+	int chs = 0;
+	if (AudioObjectGetPropertyDataSize(dev, &addr, 0, NULL, &size) || !size || !(bl = (AudioBufferList*) malloc(size)))
+		return 0;
+	if (!AudioObjectGetPropertyData(dev, &addr, 0, NULL, &size, bl))
+		for (i = 0; i < bl->mNumberBuffers; i++)
+			chs += bl->mBuffers[i].mNumberChannels;
+	free(bl);
+	return chs;
+}
+
+static AudioDeviceID default_device(UInt32 selector) {
+	AudioObjectPropertyAddress addr = { selector, kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMaster };
+	AudioDeviceID dev = 0;
+	UInt32 size = sizeof(dev);
+	if (AudioObjectGetPropertyData(kAudioObjectSystemObject, &addr, 0, NULL, &size, &dev))
+		return 0;
+	return dev;
+}
+
+static int audiounits_device_info(int index, audio_device_info_t *di) {
+	static char name[256];
+	AudioDeviceID dev;
+	AudioObjectPropertyAddress addr = { kAudioObjectPropertyName, kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMaster };
+	CFStringRef cfName = 0;
+	Float64 rate = 0.0;
+	UInt32 size = sizeof(cfName), latency = 0;
+	if (index < 0 || index >= au_ndevices) return 0;
+	dev = au_devices[index];
+	name[0] = 0;
+	if (!AudioObjectGetPropertyData(dev, &addr, 0, NULL, &size, &cfName) && cfName) {
+		CFStringGetCString(cfName, name, sizeof(name), kCFStringEncodingUTF8);
+		CFRelease(cfName);
+	}
+	di->name = name; /* the core copies the strings */
+	di->host_api = "Core Audio";
+	di->max_out = device_channels(dev, kAudioDevicePropertyScopeOutput);
+	di->max_in = device_channels(dev, kAudioDevicePropertyScopeInput);
+	addr.mSelector = kAudioDevicePropertyNominalSampleRate;
+	size = sizeof(rate);
+	if (!AudioObjectGetPropertyData(dev, &addr, 0, NULL, &size, &rate))
+		di->default_rate = rate;
+	/* latencies are reported in frames */
+	addr.mSelector = kAudioDevicePropertyLatency;
+	if (rate > 0.0) {
+		addr.mScope = kAudioDevicePropertyScopeOutput;
+		size = sizeof(latency);
+		if (di->max_out && !AudioObjectGetPropertyData(dev, &addr, 0, NULL, &size, &latency))
+			di->out_latency = ((double) latency) / rate;
+		addr.mScope = kAudioDevicePropertyScopeInput;
+		size = sizeof(latency);
+		if (di->max_in && !AudioObjectGetPropertyData(dev, &addr, 0, NULL, &size, &latency))
+			di->in_latency = ((double) latency) / rate;
+	}
+	di->is_default_out = (dev == default_device(kAudioHardwarePropertyDefaultOutputDevice));
+	di->is_default_in = (dev == default_device(kAudioHardwarePropertyDefaultInputDevice));
+	return 1;
+}
+
+static audio_instance_t *audiounits_open(const audio_config_t *cfg) {
+	AudioDeviceID dev = (cfg->device >= 0 && cfg->device < au_ndevices) ? au_devices[cfg->device] : 0;
+	if (cfg->kind == AI_RECORDER)
+		return (audio_instance_t*) audiounits_open_recorder(cfg->target, cfg->rate, cfg->channels, cfg->flags, dev);
+	return (audio_instance_t*) audiounits_open_player(cfg->source, cfg->rate, cfg->flags, dev);
+}
+
 /* define the audio driver */
 audio_driver_t audiounits_audio_driver = {
 	sizeof(audio_driver_t),
@@ -388,7 +499,11 @@ audio_driver_t audiounits_audio_driver = {
 	audiounits_rewind,
 	audiounits_wait,
 	audiounits_close,
-	audiounits_dispose
+	audiounits_dispose,
+	audiounits_caps,
+	audiounits_devices,
+	audiounits_device_info,
+	audiounits_open
 };
 
 #endif
@@ -0,0 +1,101 @@
+/* Dithered requantization of samples to integer formats
+   audio R package
+   Copyright(c) 2026 Simon Urbanek
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation
+   files (the "Software"), to deal in the Software without
+   restriction, including without limitation the rights to use, copy,
+   modify, merge, publish, distribute, sublicense, and/or sell copies
+   of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   * The above copyright notice and this permission notice shall be
+     included in all copies or substantial portions of the Software.
+ 
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND ON
+   INFRINGEMENT. 
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR
+   ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+   CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+   WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ 
+   The text above constitutes the entire license; however, the
+   PortAudio community also makes the following non-binding requests:
+
+   * Any person wishing to distribute modifications to the Software is
+     requested to send the modifications to the original developer so
+     that they can be incorporated into the canonical version. It is
+     also requested that these non-binding requests be included along
+     with the license above.
+
+ */
+
+#ifndef AUDIO_DITHER_H__
+#define AUDIO_DITHER_H__
+
+/* This header is self-contained (no R dependencies) so it can be used
+   both in the real-time callbacks and in the stand-alone benchmark. */
+
+#include <math.h>
+
+#define DITHER_NONE    0 /* plain truncation (legacy behavior) */
+#define DITHER_TPDF    1 /* triangular PDF dither, +/- 1 LSB */
+#define DITHER_SHAPED  2 /* TPDF dither with 2nd order error-feedback noise shaping */
+
+#define DITHER_MAX_CHANNELS 8
+
+typedef struct dither {
+	int mode;
+	unsigned int rng;   /* xorshift32 state, must never be 0 */
+	double e1[DITHER_MAX_CHANNELS], e2[DITHER_MAX_CHANNELS]; /* past quantization errors (in LSB) per channel */
+} dither_t;
+
+static inline void dither_init(dither_t *d, int mode, unsigned int seed) {
+	int i;
+	d->mode = mode;
+	d->rng = seed ? seed : 0x9e3779b9u;
+	for (i = 0; i < DITHER_MAX_CHANNELS; i++)
+		d->e1[i] = d->e2[i] = 0.0;
+}
+
+/* xorshift32 - one 32-bit draw yields both uniforms for the TPDF */
+static inline double dither_tpdf(dither_t *d) {
+	unsigned int x = d->rng;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	d->rng = x;
+	return ((double) (x & 0xffff) - (double) (x >> 16)) * (1.0 / 65536.0);
+}
+
+/* quantize v (nominally in [-1, 1]) to an integer in [lo, hi] using
+   `scale' LSBs per unit on channel c */
+static inline int dither_quantize(dither_t *d, double v, int c, double scale, double lo, double hi) {
+	double w = v * scale, y;
+	switch (d->mode) {
+	case DITHER_TPDF:
+		y = floor(w + dither_tpdf(d) + 0.5);
+		break;
+	case DITHER_SHAPED:
+	{
+		double e;
+		/* NTF = (1 - z^-1)^2 moves the noise out of the sensitive mid range */
+		w -= 2.0 * d->e1[c] - d->e2[c];
+		y = floor(w + dither_tpdf(d) + 0.5);
+		e = y - w;
+		/* keep the feedback loop stable when clipping */
+		e = (e > 1.0) ? 1.0 : ((e < -1.0) ? -1.0 : e);
+		d->e2[c] = d->e1[c];
+		d->e1[c] = e;
+		break;
+	}
+	default:
+		return (int) w; /* truncation */
+	}
+	return (int) ((y > hi) ? hi : ((y < lo) ? lo : y));
+}
+
+#endif
@@ -33,6 +33,11 @@
  */
 
 #include "driver.h"
+#include "engine.h"
+#include "flac.h"
+
+#include <math.h>
+#include <sys/time.h> /* gettimeofday, also in MinGW */
 
 #ifdef HAVE_DLFCN_H
 #include <dlfcn.h>
@@ -53,8 +58,14 @@
 
 static audio_driver_t *current_driver;
 
+/* registry of all drivers, registering a driver is cheap: the backend
+   is only initialized when the driver is used for the first time */
 typedef struct audio_driver_list {
 	audio_driver_t *driver;
+	void *module;     /* handle of drivers loaded from a module, NULL for built-in drivers */
+	char *path;       /* path of the module */
+	int ready;        /* the backend has been initialized */
+	int instances;    /* live instances, the module cannot be unloaded while there are any */
 	struct audio_driver_list *next;
 } audio_driver_list_t;
 
@@ -67,96 +78,244 @@ extern audio_driver_t portaudio_audio_driver;
 #if HAS_AU
 extern audio_driver_t audiounits_audio_driver;
 #endif
+#if HAS_ALSA
+extern audio_driver_t alsa_audio_driver;
+#endif
+#if HAS_JACK
+extern audio_driver_t jack_audio_driver;
+#endif
+#if HAS_PTHREAD
+extern audio_driver_t loopback_audio_driver;
+#endif
+
+static audio_driver_list_t *audio_drivers;
+static int builtins_registered;
+
+static audio_driver_list_t *driver_entry(audio_driver_t *d) {
+	audio_driver_list_t *l = audio_drivers;
+	while (l && l->driver != d) l = l->next;
+	return l;
+}
 
-static audio_driver_list_t audio_drivers;
+static audio_driver_list_t *driver_by_name(const char *name) {
+	audio_driver_list_t *l = audio_drivers;
+	while (l && !(l->driver->name && !strcmp(l->driver->name, name))) l = l->next;
+	return l;
+}
+
+/* append a driver to the registry (the order is the order of precedence) */
+static audio_driver_list_t *register_driver(audio_driver_t *driver, void *module, const char *path) {
+	audio_driver_list_t **l = &audio_drivers, *e = driver_entry(driver);
+	if (e) return e;
+	e = (audio_driver_list_t*) calloc(1, sizeof(audio_driver_list_t));
+	if (!e) Rf_error("out of memory");
+	if (path && !(e->path = strdup(path))) {
+		free(e);
+		Rf_error("out of memory");
+	}
+	e->driver = driver;
+	e->module = module;
+	while (*l) l = &(*l)->next;
+	*l = e;
+	return e;
+}
+
+/* initialize the backend of a driver on first use */
+static void driver_ready(audio_driver_t *d) {
+	audio_driver_list_t *e = driver_entry(d);
+	if (!e || e->ready) return;
+	if (AUDIO_DRIVER_IS_V3(d) && d->init && !d->init())
+		Rf_error("cannot initialize the audio driver '%s'", d->name);
+	e->ready = 1;
+}
 
-static void set_audio_driver(audio_driver_t *driver) {
-	if (audio_drivers.driver == NULL) {
-		current_driver = audio_drivers.driver = driver;
+static void driver_release(audio_driver_list_t *e) {
+	if (e->ready && AUDIO_DRIVER_IS_V3(e->driver) && e->driver->release)
+		e->driver->release();
+	e->ready = 0;
+}
+
+/* capabilities of a driver, version 1 drivers don't report any so
+   we describe what their entry points can do */
+static void driver_caps(audio_driver_t *d, audio_caps_t *caps) {
+	memset(caps, 0, sizeof(audio_caps_t));
+	if (AUDIO_DRIVER_IS_V2(d) && d->caps && d->caps(caps)) {
+		if (!caps->formats) caps->formats = AFMT_S16;
+		if (!(caps->formats & caps->native_format)) caps->native_format = AFMT_S16;
 		return;
-	} else {
-		audio_driver_list_t *l = &audio_drivers;
-		while (l) {
-			if (l->driver == driver) {
-				current_driver = driver;
-				return;
-			}
-			if (l->next == NULL) {
-				l->next = (audio_driver_list_t*) malloc(sizeof(audio_driver_list_t));
-				if (!l->next) Rf_error("out of memory");
-				current_driver = l->next->driver = driver;
-				l->next->next = 0;
-				return;
-			}
-			l = l->next;
-		}
-		/* we should never reach this line */
 	}
+	caps->flags = ACAP_PLAY | (d->create_recorder ? ACAP_RECORD : 0);
+	caps->formats = caps->native_format = AFMT_S16;
+}
+
+/* only drivers that declare ACAP_ENGINE create instances with the
+   engine entry, version 1 drivers use the original instance layout */
+static audio_engine_t *instance_engine(audio_instance_t *p) {
+	audio_caps_t caps;
+	if (!AUDIO_DRIVER_IS_V2(p->driver))
+		return 0;
+	driver_caps(p->driver, &caps);
+	return (caps.flags & ACAP_ENGINE) ? p->engine : 0;
+}
+
+/* probing devices can be slow (some host APIs open every device), so
+   the list is built once per driver and kept until a refresh is requested */
+typedef struct device_cache {
+	audio_driver_t *driver;
+	int n;
+	audio_device_info_t *info; /* strings are copies owned by the cache */
+	struct device_cache *next;
+} device_cache_t;
+
+static device_cache_t *device_caches;
+
+static void free_device_info(device_cache_t *c) {
+	int i;
+	for (i = 0; i < c->n; i++) {
+		free((char*) c->info[i].name);
+		free((char*) c->info[i].host_api);
+	}
+	free(c->info);
+	c->info = 0;
+	c->n = 0;
+}
+
+static device_cache_t *driver_devices(audio_driver_t *d, int refresh) {
+	device_cache_t *c = device_caches;
+	audio_caps_t caps;
+	int i, n;
+	while (c && c->driver != d) c = c->next;
+	if (c && !refresh)
+		return c;
+	if (!c) {
+		c = (device_cache_t*) calloc(1, sizeof(device_cache_t));
+		if (!c) Rf_error("out of memory");
+		c->driver = d;
+		c->next = device_caches;
+		device_caches = c;
+	} else
+		free_device_info(c);
+	driver_caps(d, &caps);
+	if (!(caps.flags & ACAP_DEVICES) || !d->devices || !d->device_info)
+		return c;
+	driver_ready(d);
+	if ((n = d->devices()) < 1)
+		return c;
+	c->info = (audio_device_info_t*) calloc(n, sizeof(audio_device_info_t));
+	if (!c->info) Rf_error("out of memory");
+	for (i = 0; i < n; i++) {
+		audio_device_info_t *di = &c->info[c->n++];
+		if (!d->device_info(i, di))
+			memset(di, 0, sizeof(audio_device_info_t));
+		di->name = strdup(di->name ? di->name : "");
+		di->host_api = strdup(di->host_api ? di->host_api : "");
+	}
+	return c;
+}
+
+/* device index from R: NULL/NA for the default, a 1-based index into
+   audio.devices() or a name (exact match first, then a substring of
+   the name) of a device with channels in the requested direction */
+static int device_arg(audio_driver_t *d, SEXP device, int output) {
+	device_cache_t *c;
+	int i, chs;
+	if (device == R_NilValue || (LENGTH(device) == 1 && TYPEOF(device) != STRSXP && ISNAN(Rf_asReal(device))))
+		return -1;
+	if (LENGTH(device) != 1)
+		Rf_error("invalid device specification");
+	c = driver_devices(d, 0);
+	if (!c->n)
+		Rf_error("the audio driver '%s' doesn't support device selection", d->name);
+	if (TYPEOF(device) == STRSXP) {
+		const char *name = CHAR(STRING_ELT(device, 0));
+		int pass;
+		for (pass = 0; pass < 2; pass++)
+			for (i = 0; i < c->n; i++)
+				if ((output ? c->info[i].max_out : c->info[i].max_in) > 0 &&
+					(pass ? (strstr(c->info[i].name, name) != 0) : !strcmp(c->info[i].name, name)))
+					return i;
+		Rf_error("no %s device matching '%s'", output ? "output" : "input", name);
+	}
+	i = Rf_asInteger(device);
+	if (i == R_NaInt || i < 1 || i > c->n)
+		Rf_error("invalid device index, must be between 1 and %d", c->n);
+	chs = output ? c->info[i - 1].max_out : c->info[i - 1].max_in;
+	if (chs < 1)
+		Rf_error("device %d (%s) has no %s channels", i, c->info[i - 1].name, output ? "output" : "input");
+	return i - 1;
 }
 
 /* if no drivers are available, must raise an Rf_error. */
 static void load_default_audio_driver(int silent)
 {
-	/* load the drivers in the order of precedence such that the first one is the default one */
+	if (!builtins_registered) {
+		/* register the drivers in the order of precedence such that the first one is the default one */
 #if HAS_WMM
-	set_audio_driver(&wmmaudio_audio_driver);
+		register_driver(&wmmaudio_audio_driver, 0, 0);
 #endif
 #if HAS_AU
-	set_audio_driver(&audiounits_audio_driver);
+		register_driver(&audiounits_audio_driver, 0, 0);
+#endif
+#if HAS_ALSA
+		register_driver(&alsa_audio_driver, 0, 0);
 #endif
 #if HAS_PA
-	set_audio_driver(&portaudio_audio_driver);
+		register_driver(&portaudio_audio_driver, 0, 0);
+#endif
+#if HAS_JACK
+		register_driver(&jack_audio_driver, 0, 0);
+#endif
+#if HAS_PTHREAD
+		/* never the default unless there is nothing else */
+		register_driver(&loopback_audio_driver, 0, 0);
 #endif
+		builtins_registered = 1;
+	}
 	/* pick the first one - it will be NULL if there are no drivers */
-	current_driver = audio_drivers.driver;
+	if (!current_driver && audio_drivers)
+		current_driver = audio_drivers->driver;
 	if (!silent && !current_driver)
 		Rf_error("no audio drivers are available");
 }
 
 static void audio_instance_destructor(SEXP instance) {
 	audio_instance_t *p = (audio_instance_t *) EXTPTR_PTR(instance);
+	audio_driver_list_t *e = driver_entry(p->driver);
 	p->driver->close(p);
 	p->driver->dispose(p); /* it's driver's responsibility to dispose p */
+	if (e) e->instances--;
 }
 
 SEXP audio_drivers_list(void) {
 	int n = 0;
-	SEXP res = Rf_allocVector(VECSXP, 3), sName, sDesc, /* sCopy, */ sCurr, sLN, sRN;
-	audio_driver_list_t *l = &audio_drivers;
-	if (!current_driver)
-		load_default_audio_driver(1);
+	SEXP res = Rf_allocVector(VECSXP, 4), sName, sDesc, /* sCopy, */ sCurr, sMod, sLN, sRN;
+	audio_driver_list_t *l;
+	load_default_audio_driver(1);
 	Rf_protect(res);
-	if (l->driver) {
-		while (l) {
-			n++;
-			l = l->next;
-		}
-	}
+	for (l = audio_drivers; l; l = l->next)
+		n++;
 	sName = Rf_allocVector(STRSXP, n); SET_VECTOR_ELT(res, 0, sName);
 	sDesc = Rf_allocVector(STRSXP, n); SET_VECTOR_ELT(res, 1, sDesc);
 	sCurr = Rf_allocVector(LGLSXP, n); SET_VECTOR_ELT(res, 2, sCurr);
-	/* sCopy = Rf_allocVector(STRSXP, n); SET_VECTOR_ELT(res, 3, sCopy); */
-	if (n) {
-		n = 0;
-		l = &audio_drivers;
-		while (l) {
-			const char *s = l->driver->name;
-			SET_STRING_ELT(sName, n, Rf_mkChar(s ? s : ""));
-			s = l->driver->descr;
-			SET_STRING_ELT(sDesc, n, Rf_mkChar(s ? s : ""));
-			s = l->driver->copyright;
-			/* SET_STRING_ELT(sCopy, n, Rf_mkChar(s ? s : "")); */
-			LOGICAL(sCurr)[n] = (l->driver == current_driver) ? 1 : 0;
-			l = l->next;
-			n++;
-		}
+	sMod  = Rf_allocVector(STRSXP, n); SET_VECTOR_ELT(res, 3, sMod);
+	/* sCopy = Rf_allocVector(STRSXP, n); SET_VECTOR_ELT(res, 4, sCopy); */
+	for (n = 0, l = audio_drivers; l; l = l->next, n++) {
+		const char *s = l->driver->name;
+		SET_STRING_ELT(sName, n, Rf_mkChar(s ? s : ""));
+		s = l->driver->descr;
+		SET_STRING_ELT(sDesc, n, Rf_mkChar(s ? s : ""));
+		s = l->driver->copyright;
+		/* SET_STRING_ELT(sCopy, n, Rf_mkChar(s ? s : "")); */
+		LOGICAL(sCurr)[n] = (l->driver == current_driver) ? 1 : 0;
+		SET_STRING_ELT(sMod, n, l->path ? Rf_mkChar(l->path) : NA_STRING);
 	}
-	sLN = Rf_allocVector(STRSXP, 3);
+	sLN = Rf_allocVector(STRSXP, 4);
 	Rf_setAttrib(res, R_NamesSymbol, sLN);
 	SET_STRING_ELT(sLN, 0, Rf_mkChar("name"));
 	SET_STRING_ELT(sLN, 1, Rf_mkChar("description"));
 	SET_STRING_ELT(sLN, 2, Rf_mkChar("current"));
-	/* SET_STRING_ELT(sLN, 3, Rf_mkChar("author")); */
+	SET_STRING_ELT(sLN, 3, Rf_mkChar("module"));
+	/* SET_STRING_ELT(sLN, 4, Rf_mkChar("author")); */
 	sRN = Rf_allocVector(INTSXP, 2);
 	INTEGER(sRN)[0] = R_NaInt;
 	INTEGER(sRN)[1] = -n;
@@ -172,8 +331,8 @@ SEXP audio_current_driver(void) {
 
 SEXP audio_use_driver(SEXP sName) {
 	if (sName == R_NilValue) { /* equivalent to saying 'load default driver' */
-		if (!current_driver) load_default_audio_driver(1);
-		current_driver = audio_drivers.driver;
+		load_default_audio_driver(1);
+		current_driver = audio_drivers ? audio_drivers->driver : 0;
 		if (!current_driver || !current_driver->name) {
 			Rf_warning("no audio drivers are available");
 			return R_NilValue;
@@ -184,16 +343,12 @@ SEXP audio_use_driver(SEXP sName) {
 		Rf_error("invalid audio driver name");
 	else {
 		const char *drv_name = CHAR(STRING_ELT(sName, 0));
-		audio_driver_list_t *l = &audio_drivers;
-		if (!current_driver)
-			load_default_audio_driver(1);
-		while (l && l->driver) {
-			if (l->driver->name && !strcmp(l->driver->name, drv_name)) {
-				current_driver = l->driver;
-				return sName;
-			}
-			l = l->next;
-		}			
+		audio_driver_list_t *e;
+		load_default_audio_driver(1);
+		if ((e = driver_by_name(drv_name))) {
+			current_driver = e->driver;
+			return sName;
+		}
 		Rf_warning("driver '%s' not found", drv_name);
 	}
 	return R_NilValue;
@@ -205,7 +360,10 @@ SEXP audio_load_driver(SEXP path) {
 		const char *cPath = CHAR(STRING_ELT(path, 0));
 		audio_driver_t *drv;
 		void *(*fn)(void);
-		void *ad, *dl = dlopen(cPath, RTLD_LAZY | RTLD_LOCAL); /* try local first */
+		void *ad, *dl;
+		/* built-in drivers come first so they keep their precedence */
+		load_default_audio_driver(1);
+		dl = dlopen(cPath, RTLD_LAZY | RTLD_LOCAL); /* try local first */
 		if (!dl) dl = dlopen(cPath, RTLD_LAZY | RTLD_GLOBAL); /* try global if local failed */
 		if (!dl) Rf_error("cannot load '%s' dynamically", cPath);
 		fn = (void *(*)(void)) dlsym(dl, "create_audio_driver");
@@ -219,11 +377,18 @@ SEXP audio_load_driver(SEXP path) {
 			dlclose(dl);
 			Rf_error("audio driver could not be initialized");
 		}
-		/* FIXME: we never unload the driver module ... */
 		drv = (audio_driver_t*) ad;
-		if (!drv) Rf_error("unable to initialize the audio driver");
-		if (drv->length != sizeof(audio_driver_t)) Rf_error("the driver is incompatible with this version of the audio package");
-		current_driver = drv;		
+		if (drv->length != AUDIO_DRIVER_V1_LENGTH && !AUDIO_DRIVER_IS_V2(drv)) {
+			dlclose(dl);
+			Rf_error("the driver is incompatible with this version of the audio package");
+		}
+		if (!drv->name || driver_by_name(drv->name)) {
+			dlclose(dl);
+			Rf_error("a driver named '%s' is already registered", drv->name ? drv->name : "");
+		}
+		/* the module is closed when the driver is unloaded */
+		register_driver(drv, dl, cPath);
+		current_driver = drv;
 		return Rf_mkString(current_driver->name);
 	} else
 		Rf_error("invalid module name");
@@ -233,44 +398,283 @@ SEXP audio_load_driver(SEXP path) {
 	return R_NilValue;
 }
 
-SEXP audio_player(SEXP source, SEXP rate) {
-	float fRate = -1.0;
+/* remove a driver from the registry, release its backend and close the
+   module. Instances hold pointers into the module, so all of them must
+   have been collected. */
+static void unload_driver(audio_driver_list_t *e) {
+	audio_driver_list_t **l = &audio_drivers;
+	device_cache_t **c = &device_caches;
+	while (*c && (*c)->driver != e->driver) c = &(*c)->next;
+	if (*c) {
+		device_cache_t *f = *c;
+		*c = f->next;
+		free_device_info(f);
+		free(f);
+	}
+	driver_release(e);
+	while (*l != e) l = &(*l)->next;
+	*l = e->next;
+	if (current_driver == e->driver)
+		current_driver = audio_drivers ? audio_drivers->driver : 0;
+#ifdef HAS_DLSYM
+	if (e->module) dlclose(e->module);
+#endif
+	free(e->path);
+	free(e);
+}
+
+SEXP audio_unload_driver(SEXP sName) {
+	audio_driver_list_t *e;
+	const char *drv_name;
+	if (TYPEOF(sName) != STRSXP || LENGTH(sName) < 1)
+		Rf_error("invalid audio driver name");
+	drv_name = CHAR(STRING_ELT(sName, 0));
+	load_default_audio_driver(1);
+	if (!(e = driver_by_name(drv_name)))
+		Rf_error("driver '%s' not found", drv_name);
+	if (!e->module)
+		Rf_error("the built-in driver '%s' cannot be unloaded", drv_name);
+	if (e->instances > 0)
+		Rf_error("the driver '%s' is still used by %d audio instance(s)", drv_name, e->instances);
+	unload_driver(e);
+	return current_driver ? Rf_mkString(current_driver->name) : R_NilValue;
+}
+
+/* when the package is unloaded: release all backends and close all modules */
+void audio_unload_drivers(void) {
+	audio_driver_list_t *e = audio_drivers;
+	while (e) {
+		audio_driver_list_t *next = e->next;
+		if (e->module)
+			unload_driver(e);
+		else
+			driver_release(e);
+		e = next;
+	}
+}
+
+/* number of channels a source will be played with (see audio_engine_new) */
+static int source_channels(SEXP source) {
+	ae_reader_t *r = audio_engine_reader(source);
+	if (r)
+		return r->chs;
+	if (Rf_isFunction(source)) {
+		SEXP sCh = Rf_getAttrib(source, Rf_install("channels"));
+		return (sCh == R_NilValue) ? 1 : Rf_asInteger(sCh);
+	} else {
+		SEXP dim = Rf_getAttrib(source, R_DimSymbol);
+		return (TYPEOF(dim) == INTSXP && LENGTH(dim) > 0 && INTEGER(dim)[0] == 2) ? 2 : 1;
+	}
+}
+
+/* validate the request against the driver capabilities and choose the
+   device format before anything is allocated, then create the instance */
+static SEXP open_instance(audio_config_t *cfg) {
+	const char *what[] = { "", "playback", "recording", "full-duplex streams" };
+	const int need[] = { 0, ACAP_PLAY, ACAP_RECORD, ACAP_DUPLEX };
+	audio_instance_t *p = 0;
+	audio_caps_t caps;
+	int out_chs;
 	if (!current_driver)
 		load_default_audio_driver(0);
-	if (TYPEOF(rate) == INTSXP || TYPEOF(rate) == REALSXP)
-		fRate = (float) Rf_asReal(rate);
-	audio_instance_t *p = current_driver->create_player(source, fRate, 0);
+	driver_caps(current_driver, &caps);
+	if (!(caps.flags & need[cfg->kind]))
+		Rf_error("the currently used audio driver doesn't support %s", what[cfg->kind]);
+	if ((cfg->flags & APFLAG_UNBOUNDED) && !(caps.flags & ACAP_ENGINE))
+		Rf_error("the currently used audio driver doesn't support open-ended recording");
+	if (cfg->kind != AI_RECORDER && !(caps.flags & ACAP_ENGINE) && audio_engine_reader(cfg->source))
+		Rf_error("the currently used audio driver doesn't support streaming from files");
+	if (cfg->rate > 0.0 && ((caps.min_rate > 0.0 && cfg->rate < caps.min_rate) ||
+							(caps.max_rate > 0.0 && cfg->rate > caps.max_rate)))
+		Rf_error("sample rate %g is not supported by the audio driver '%s' (%g..%g)",
+				 (double) cfg->rate, current_driver->name, caps.min_rate, caps.max_rate);
+	if (cfg->kind != AI_PLAYER && caps.max_in > 0 && cfg->channels > caps.max_in)
+		Rf_error("the audio driver '%s' supports at most %d input channel(s)", current_driver->name, caps.max_in);
+	if (cfg->kind != AI_RECORDER && caps.max_out > 0 && (out_chs = source_channels(cfg->source)) > caps.max_out)
+		Rf_error("the audio driver '%s' supports at most %d output channel(s), the source has %d",
+				 current_driver->name, caps.max_out, out_chs);
+	if (cfg->buffer > 0 && ((caps.min_buffer > 0 && cfg->buffer < caps.min_buffer) ||
+							(caps.max_buffer > 0 && cfg->buffer > caps.max_buffer)))
+		Rf_error("buffer size %d is not supported by the audio driver '%s' (%d..%d)",
+				 cfg->buffer, current_driver->name, caps.min_buffer, caps.max_buffer);
+	if (cfg->device >= 0) {
+		device_cache_t *c = driver_devices(current_driver, 0);
+		if (cfg->kind == AI_RECORDER && cfg->channels > c->info[cfg->device].max_in)
+			Rf_error("the device '%s' supports at most %d input channel(s)", c->info[cfg->device].name, c->info[cfg->device].max_in);
+		if (cfg->kind == AI_PLAYER && source_channels(cfg->source) > c->info[cfg->device].max_out)
+			Rf_error("the device '%s' supports at most %d output channel(s)", c->info[cfg->device].name, c->info[cfg->device].max_out);
+	}
+	/* use the driver's native format so it doesn't have to convert */
+	cfg->format = caps.native_format;
+	driver_ready(current_driver);
+	if (AUDIO_DRIVER_IS_V2(current_driver) && current_driver->open)
+		p = current_driver->open(cfg);
+	else if (cfg->kind == AI_PLAYER)
+		p = current_driver->create_player(cfg->source, cfg->rate, cfg->flags);
+	else if (cfg->kind == AI_RECORDER)
+		p = current_driver->create_recorder(cfg->target, cfg->rate, cfg->channels, cfg->flags);
 	if (!p) Rf_error("cannot start audio driver");
 	p->driver = current_driver;
-	p->kind = AI_PLAYER;
+	p->kind = cfg->kind;
 	SEXP ptr = R_MakeExternalPtr(p, R_NilValue, R_NilValue);
 	Rf_protect(ptr);
 	R_RegisterCFinalizer(ptr, audio_instance_destructor);
 	Rf_setAttrib(ptr, R_ClassSymbol, Rf_mkString("audioInstance"));
+	driver_entry(current_driver)->instances++;
 	Rf_unprotect(1);
-	return ptr;	
+	return ptr;
 }
 
-SEXP audio_recorder(SEXP source, SEXP rate, SEXP channels) {
-	float fRate = -1.0;
-	int chs = Rf_asInteger(channels);
+static void init_config(audio_config_t *cfg, int kind, SEXP rate) {
+	SEXP sBuf;
+	int buf;
 	if (!current_driver)
 		load_default_audio_driver(0);
+	memset(cfg, 0, sizeof(audio_config_t));
+	cfg->kind = kind;
+	cfg->source = cfg->target = R_NilValue;
+	cfg->rate = -1.0;
+	cfg->device = -1;
 	if (TYPEOF(rate) == INTSXP || TYPEOF(rate) == REALSXP)
-		fRate = (float) Rf_asReal(rate);
-	if (chs < 1) chs = 1;
-	if (!current_driver->create_recorder)
-		Rf_error("the currently used audio driver doesn't support recording");
-	audio_instance_t *p = current_driver->create_recorder(source, fRate, chs, 0);
-	if (!p) Rf_error("cannot start audio driver");
-	p->driver = current_driver;
-	p->kind = AI_RECORDER;
-	SEXP ptr = R_MakeExternalPtr(p, R_NilValue, R_NilValue);
-	Rf_protect(ptr);
-	R_RegisterCFinalizer(ptr, audio_instance_destructor);
-	Rf_setAttrib(ptr, R_ClassSymbol, Rf_mkString("audioInstance"));
+		cfg->rate = (float) Rf_asReal(rate);
+	/* frames per buffer (period), 0 leaves it to the driver */
+	sBuf = Rf_GetOption1(Rf_install("audio.buffer"));
+	if (sBuf != R_NilValue && LENGTH(sBuf) > 0 && (buf = Rf_asInteger(sBuf)) != R_NaInt && buf > 0)
+		cfg->buffer = buf;
+}
+
+SEXP audio_player(SEXP source, SEXP rate, SEXP loop, SEXP device) {
+	audio_config_t cfg;
+	init_config(&cfg, AI_PLAYER, rate);
+	cfg.source = source;
+	cfg.device = device_arg(current_driver, device, 1);
+	cfg.flags = (Rf_asLogical(loop) == 1) ? APFLAG_LOOP : 0;
+	return open_instance(&cfg);
+}
+
+/* NULL targets are open-ended, the engine records into chunks and the
+   driver gets an empty target */
+static SEXP recording_target(audio_config_t *cfg, SEXP target) {
+	if (target != R_NilValue)
+		return target;
+	cfg->flags |= APFLAG_UNBOUNDED;
+	return Rf_allocVector(REALSXP, 0);
+}
+
+SEXP audio_recorder(SEXP source, SEXP rate, SEXP channels, SEXP device) {
+	audio_config_t cfg;
+	SEXP res;
+	init_config(&cfg, AI_RECORDER, rate);
+	cfg.target = Rf_protect(recording_target(&cfg, source));
+	cfg.device = device_arg(current_driver, device, 0);
+	cfg.channels = Rf_asInteger(channels);
+	if (cfg.channels < 1) cfg.channels = 1;
+	res = open_instance(&cfg);
 	Rf_unprotect(1);
-	return ptr;
+	return res;
+}
+
+SEXP audio_duplex(SEXP source, SEXP target, SEXP rate, SEXP channels) {
+	audio_config_t cfg;
+	SEXP res;
+	init_config(&cfg, AI_DUPLEX, rate);
+	cfg.source = source;
+	cfg.target = Rf_protect(recording_target(&cfg, target));
+	cfg.channels = Rf_asInteger(channels);
+	if (cfg.channels < 1) cfg.channels = 1;
+	res = open_instance(&cfg);
+	Rf_unprotect(1);
+	return res;
+}
+
+/* driver by name, NULL means the current driver */
+static audio_driver_t *find_driver(SEXP sName) {
+	load_default_audio_driver(0);
+	if (TYPEOF(sName) == STRSXP && LENGTH(sName) > 0) {
+		const char *drv_name = CHAR(STRING_ELT(sName, 0));
+		audio_driver_list_t *e = driver_by_name(drv_name);
+		if (!e) Rf_error("driver '%s' not found", drv_name);
+		return e->driver;
+	}
+	return current_driver;
+}
+
+SEXP audio_driver_caps(SEXP sName) {
+	audio_driver_t *d = find_driver(sName);
+	audio_caps_t caps;
+	SEXP res, names, fmt;
+	const char *nm[] = { "name", "api", "play", "record", "duplex", "devices", "engine", "formats", "native.format",
+						 "max.output", "max.input", "min.rate", "max.rate", "default.rate", "min.buffer", "max.buffer" };
+	const char *fn[] = { "s16", "s24", "s32", "f32" };
+	int i, n = 0;
+	driver_caps(d, &caps);
+	res = Rf_protect(Rf_allocVector(VECSXP, 16));
+	names = Rf_allocVector(STRSXP, 16);
+	Rf_setAttrib(res, R_NamesSymbol, names);
+	for (i = 0; i < 16; i++)
+		SET_STRING_ELT(names, i, Rf_mkChar(nm[i]));
+	SET_VECTOR_ELT(res, 0, Rf_mkString(d->name ? d->name : ""));
+	SET_VECTOR_ELT(res, 1, Rf_ScalarInteger(AUDIO_DRIVER_IS_V3(d) ? 3 : (AUDIO_DRIVER_IS_V2(d) ? 2 : 1)));
+	SET_VECTOR_ELT(res, 2, Rf_ScalarLogical((caps.flags & ACAP_PLAY) ? 1 : 0));
+	SET_VECTOR_ELT(res, 3, Rf_ScalarLogical((caps.flags & ACAP_RECORD) ? 1 : 0));
+	SET_VECTOR_ELT(res, 4, Rf_ScalarLogical((caps.flags & ACAP_DUPLEX) ? 1 : 0));
+	SET_VECTOR_ELT(res, 5, Rf_ScalarLogical((caps.flags & ACAP_DEVICES) ? 1 : 0));
+	SET_VECTOR_ELT(res, 6, Rf_ScalarLogical((caps.flags & ACAP_ENGINE) ? 1 : 0));
+	for (i = 0; i < 4; i++)
+		if (caps.formats & (1 << i)) n++;
+	fmt = Rf_allocVector(STRSXP, n);
+	SET_VECTOR_ELT(res, 7, fmt);
+	for (i = 0, n = 0; i < 4; i++)
+		if (caps.formats & (1 << i))
+			SET_STRING_ELT(fmt, n++, Rf_mkChar(fn[i]));
+	for (i = 0; i < 4; i++)
+		if (caps.native_format == (1 << i))
+			SET_VECTOR_ELT(res, 8, Rf_mkString(fn[i]));
+	/* zero means unknown or unlimited */
+	SET_VECTOR_ELT(res, 9, Rf_ScalarInteger(caps.max_out ? caps.max_out : R_NaInt));
+	SET_VECTOR_ELT(res, 10, Rf_ScalarInteger(caps.max_in ? caps.max_in : R_NaInt));
+	SET_VECTOR_ELT(res, 11, Rf_ScalarReal(caps.min_rate > 0.0 ? caps.min_rate : R_NaReal));
+	SET_VECTOR_ELT(res, 12, Rf_ScalarReal(caps.max_rate > 0.0 ? caps.max_rate : R_NaReal));
+	SET_VECTOR_ELT(res, 13, Rf_ScalarReal(caps.default_rate > 0.0 ? caps.default_rate : R_NaReal));
+	SET_VECTOR_ELT(res, 14, Rf_ScalarInteger(caps.min_buffer ? caps.min_buffer : R_NaInt));
+	SET_VECTOR_ELT(res, 15, Rf_ScalarInteger(caps.max_buffer ? caps.max_buffer : R_NaInt));
+	Rf_unprotect(1);
+	return res;
+}
+
+SEXP audio_driver_devices(SEXP sName, SEXP sRefresh) {
+	audio_driver_t *d = find_driver(sName);
+	device_cache_t *c = driver_devices(d, (Rf_asLogical(sRefresh) == 1) ? 1 : 0);
+	const char *nm[] = { "name", "host.api", "max.output", "max.input", "default.rate",
+						 "output.latency", "input.latency", "default.output", "default.input" };
+	SEXP res = Rf_protect(Rf_allocVector(VECSXP, 9)), names, sRN;
+	int i, j, n = c->n;
+	names = Rf_allocVector(STRSXP, 9);
+	Rf_setAttrib(res, R_NamesSymbol, names);
+	for (j = 0; j < 9; j++) {
+		SET_STRING_ELT(names, j, Rf_mkChar(nm[j]));
+		SET_VECTOR_ELT(res, j, Rf_allocVector((j < 2) ? STRSXP : ((j < 4) ? INTSXP : ((j < 7) ? REALSXP : LGLSXP)), n));
+	}
+	for (i = 0; i < n; i++) {
+		audio_device_info_t *di = &c->info[i];
+		SET_STRING_ELT(VECTOR_ELT(res, 0), i, Rf_mkChar(di->name));
+		SET_STRING_ELT(VECTOR_ELT(res, 1), i, Rf_mkChar(di->host_api));
+		INTEGER(VECTOR_ELT(res, 2))[i] = di->max_out;
+		INTEGER(VECTOR_ELT(res, 3))[i] = di->max_in;
+		/* zero means unknown */
+		REAL(VECTOR_ELT(res, 4))[i] = (di->default_rate > 0.0) ? di->default_rate : R_NaReal;
+		REAL(VECTOR_ELT(res, 5))[i] = (di->out_latency > 0.0) ? di->out_latency : R_NaReal;
+		REAL(VECTOR_ELT(res, 6))[i] = (di->in_latency > 0.0) ? di->in_latency : R_NaReal;
+		LOGICAL(VECTOR_ELT(res, 7))[i] = di->is_default_out ? 1 : 0;
+		LOGICAL(VECTOR_ELT(res, 8))[i] = di->is_default_in ? 1 : 0;
+	}
+	sRN = Rf_allocVector(INTSXP, 2);
+	INTEGER(sRN)[0] = R_NaInt;
+	INTEGER(sRN)[1] = -n;
+	Rf_setAttrib(res, R_RowNamesSymbol, sRN);
+	Rf_setAttrib(res, R_ClassSymbol, Rf_mkString("data.frame"));
+	Rf_unprotect(1);
+	return res;
 }
 
 SEXP audio_start(SEXP instance) {
@@ -310,7 +714,16 @@ SEXP audio_close(SEXP instance) {
 		Rf_error("invalid audio instance");
 	audio_instance_t *p = (audio_instance_t *) EXTPTR_PTR(instance);
 	if (!p) Rf_error("invalid audio instance");
-	return Rf_ScalarLogical((p->driver)->close(p));
+	{
+		audio_engine_t *e = instance_engine(p);
+		int ok = (p->driver)->close(p);
+		/* the audio thread is gone, so a streamed recording can be finished */
+		if (e && e->chunks && e->chunks->sink && !audio_engine_close_sink(e)) {
+			Rf_warning("the recording could not be written completely");
+			ok = 0;
+		}
+		return Rf_ScalarLogical(ok);
+	}
 }
 
 SEXP audio_driver_name(SEXP instance) {
@@ -362,10 +775,14 @@ static int fallback_wait(double timeout) {
 }
 
 SEXP audio_instance_source(SEXP instance) {
+	audio_engine_t *e;
 	if (TYPEOF(instance) != EXTPTRSXP)
 		Rf_error("invalid audio instance");
 	audio_instance_t *p = (audio_instance_t *) EXTPTR_PTR(instance);
 	if (!p) Rf_error("invalid audio instance");
+	/* open-ended recordings are assembled from their chunks */
+	if ((e = instance_engine(p)) && e->chunks)
+		return audio_engine_collect(e);
 	return p->source;
 }
 
@@ -381,6 +798,358 @@ SEXP audio_wait(SEXP instance, SEXP timeout) {
 	return Rf_ScalarInteger(p->driver->wait ? p->driver->wait(p, Rf_asReal(timeout)) : WAIT_ERROR);
 }
 
+SEXP audio_instance_filters(SEXP instance, SEXP spec) {
+	audio_engine_t *e;
+	if (TYPEOF(instance) != EXTPTRSXP)
+		Rf_error("invalid audio instance");
+	audio_instance_t *p = (audio_instance_t *) EXTPTR_PTR(instance);
+	if (!p) Rf_error("invalid audio instance");
+	if (!(e = instance_engine(p)))
+		Rf_error("the audio driver '%s' doesn't support filters", p->driver->name);
+	/* the chain is built here on the R thread and swapped into the callback */
+	audio_engine_set_filters(e, (spec == R_NilValue || LENGTH(spec) == 0) ? 0 : filter_chain_create(spec, e->rate, e->chs));
+	return Rf_ScalarLogical(1);
+}
+
+SEXP audio_instance_sink(SEXP instance, SEXP where, SEXP level) {
+	audio_engine_t *e;
+	int lv = Rf_asInteger(level);
+	if (TYPEOF(instance) != EXTPTRSXP)
+		Rf_error("invalid audio instance");
+	audio_instance_t *p = (audio_instance_t *) EXTPTR_PTR(instance);
+	if (!p) Rf_error("invalid audio instance");
+	if (TYPEOF(where) != STRSXP || LENGTH(where) < 1)
+		Rf_error("invalid file name");
+	if (!(e = instance_engine(p)) || !e->chunks)
+		Rf_error("the audio driver '%s' doesn't support streaming recordings to files", p->driver->name);
+	if (lv == NA_INTEGER)
+		Rf_error("invalid compression level");
+	audio_engine_set_sink(e, flac_sink_new(CHAR(STRING_ELT(where, 0)), e->rate, e->chs, lv));
+	return Rf_ScalarLogical(1);
+}
+
+SEXP audio_instance_dither(SEXP instance, SEXP mode) {
+	audio_engine_t *e;
+	int m = Rf_asInteger(mode);
+	if (TYPEOF(instance) != EXTPTRSXP)
+		Rf_error("invalid audio instance");
+	audio_instance_t *p = (audio_instance_t *) EXTPTR_PTR(instance);
+	if (!p) Rf_error("invalid audio instance");
+	if (m < DITHER_NONE || m > DITHER_SHAPED)
+		Rf_error("invalid dither mode");
+	if (!(e = instance_engine(p))) {
+		if (m == DITHER_NONE) return Rf_ScalarLogical(0);
+		Rf_error("the audio driver '%s' doesn't support dithering", p->driver->name);
+	}
+	audio_engine_set_dither(e, m);
+	return Rf_ScalarLogical(1);
+}
+
+static audio_engine_t *player_engine(SEXP instance, const char *what) {
+	audio_engine_t *e;
+	if (TYPEOF(instance) != EXTPTRSXP)
+		Rf_error("invalid audio instance");
+	audio_instance_t *p = (audio_instance_t *) EXTPTR_PTR(instance);
+	if (!p) Rf_error("invalid audio instance");
+	if (!(e = instance_engine(p)))
+		Rf_error("the audio driver '%s' doesn't support %s", p->driver->name, what);
+	if (p->kind != AI_PLAYER)
+		Rf_error("%s is only supported for players", what);
+	if (e->stream)
+		Rf_error("%s is not supported for streamed sources (functions and files)", what);
+	return e;
+}
+
+/* frame offsets from R, NA means the default `def' */
+static unsigned long long frame_arg(SEXP sFrame, unsigned long long def, unsigned long long length) {
+	double d = Rf_asReal(sFrame);
+	if (ISNAN(d)) return def;
+	if (d < 0.0 || d > (double) length)
+		Rf_error("frame offset %g is outside of the source (0..%.0f)", d, (double) length);
+	return (unsigned long long) d;
+}
+
+static void post_command(audio_engine_t *e, int op, int flag, unsigned long long a, unsigned long long b, unsigned int c) {
+	if (!audio_engine_post(e, op, flag, a, b, c, 0.0))
+		Rf_error("too many pending commands, the audio device is not processing them");
+}
+
+SEXP audio_instance_seek(SEXP instance, SEXP frame) {
+	audio_engine_t *e = player_engine(instance, "seeking");
+	post_command(e, AE_CMD_SEEK, 0, frame_arg(frame, 0, e->length), 0, 0);
+	return Rf_ScalarLogical(1);
+}
+
+SEXP audio_instance_region(SEXP instance, SEXP start, SEXP end) {
+	audio_engine_t *e = player_engine(instance, "play regions");
+	unsigned long long s = frame_arg(start, 0, e->length), en = frame_arg(end, e->length, e->length);
+	if (s >= en) Rf_error("the region must contain at least one frame");
+	post_command(e, AE_CMD_REGION, 0, s, en, 0);
+	return Rf_ScalarLogical(1);
+}
+
+SEXP audio_instance_loop(SEXP instance, SEXP on, SEXP start, SEXP end, SEXP xfade) {
+	audio_engine_t *e = player_engine(instance, "looping");
+	unsigned long long s = frame_arg(start, 0, e->length), en = frame_arg(end, e->length, e->length);
+	double xf = Rf_asReal(xfade);
+	if (s >= en) Rf_error("the loop must contain at least one frame");
+	if (ISNAN(xf) || xf < 0.0 || xf > 4294967295.0) Rf_error("invalid crossfade length");
+	if (xf > (double) (en - s))
+		Rf_error("the crossfade cannot be longer than the loop");
+	/* the engine clamps the loop points into the play region */
+	post_command(e, AE_CMD_LOOP, (Rf_asLogical(on) == 1) ? 1 : 0, s, en, (unsigned int) xf);
+	return Rf_ScalarLogical(1);
+}
+
+SEXP audio_instance_queue(SEXP instance, SEXP source, SEXP rate) {
+	audio_engine_t *e = player_engine(instance, "queuing");
+	SEXP dim;
+	int chs;
+	if (source == R_NilValue)
+		return Rf_ScalarInteger(audio_engine_queued(e));
+	if (TYPEOF(source) != INTSXP && TYPEOF(source) != REALSXP)
+		Rf_error("only numeric vectors or matrices can be queued");
+	dim = Rf_getAttrib(source, R_DimSymbol);
+	chs = (TYPEOF(dim) == INTSXP && LENGTH(dim) > 0) ? INTEGER(dim)[0] : 1;
+	if (chs != e->chs)
+		Rf_error("the queued sample has %d channel(s) but the player uses %d", chs, e->chs);
+	if (TYPEOF(rate) == INTSXP || TYPEOF(rate) == REALSXP) {
+		double r = Rf_asReal(rate);
+		/* there is no resampling, so the rates must match */
+		if (!ISNAN(r) && r != (double) e->rate)
+			Rf_error("the sample rate of the queued sample (%g) differs from the player (%g)", r, (double) e->rate);
+	}
+	return Rf_ScalarInteger(audio_engine_enqueue(e, source));
+}
+
+SEXP audio_instance_stream(SEXP instance) {
+	audio_engine_t *e;
+	ae_stream_t *s;
+	SEXP res, names;
+	const char *nm[] = { "lookahead", "buffered", "starved", "starved.frames", "done" };
+	int i;
+	if (TYPEOF(instance) != EXTPTRSXP)
+		Rf_error("invalid audio instance");
+	audio_instance_t *p = (audio_instance_t *) EXTPTR_PTR(instance);
+	if (!p) Rf_error("invalid audio instance");
+	if (!(e = instance_engine(p)))
+		return R_NilValue;
+	if (e->chunks) {
+		const char *cn[] = { "chunk.size", "chunks", "frames", "pool", "dropped" };
+		ae_chunks_t *c = e->chunks;
+		audio_engine_service(e);
+		res = Rf_protect(Rf_allocVector(VECSXP, 5));
+		names = Rf_allocVector(STRSXP, 5);
+		Rf_setAttrib(res, R_NamesSymbol, names);
+		for (i = 0; i < 5; i++)
+			SET_STRING_ELT(names, i, Rf_mkChar(cn[i]));
+		SET_VECTOR_ELT(res, 0, Rf_ScalarReal((double) AE_CHUNK_FRAMES));
+		SET_VECTOR_ELT(res, 1, Rf_ScalarReal((double) c->count));
+		SET_VECTOR_ELT(res, 2, Rf_ScalarReal((double) AE_LOAD(e->position)));
+		SET_VECTOR_ELT(res, 3, Rf_ScalarReal((double) (c->free_wr - AE_LOAD(c->free_rd))));
+		SET_VECTOR_ELT(res, 4, Rf_ScalarReal((double) AE_LOAD(c->dropped)));
+		Rf_unprotect(1);
+		return res;
+	}
+	if (!(s = e->stream))
+		return R_NilValue;
+	res = Rf_protect(Rf_allocVector(VECSXP, 5));
+	names = Rf_allocVector(STRSXP, 5);
+	Rf_setAttrib(res, R_NamesSymbol, names);
+	for (i = 0; i < 5; i++)
+		SET_STRING_ELT(names, i, Rf_mkChar(nm[i]));
+	/* counters are updated by the audio thread, these are snapshots */
+	SET_VECTOR_ELT(res, 0, Rf_ScalarReal((double) s->size));
+	SET_VECTOR_ELT(res, 1, Rf_ScalarReal((double) (AE_LOAD(s->wr) - AE_LOAD(s->rd)) +
+					 (s->pending ? (double) (LENGTH(s->pending) / e->chs - s->pending_at) : 0.0)));
+	SET_VECTOR_ELT(res, 2, Rf_ScalarReal((double) AE_LOAD(s->starved)));
+	SET_VECTOR_ELT(res, 3, Rf_ScalarReal((double) AE_LOAD(s->starved_frames)));
+	SET_VECTOR_ELT(res, 4, Rf_ScalarLogical(AE_LOAD(s->eof) ? 1 : 0));
+	Rf_unprotect(1);
+	return res;
+}
+
+SEXP audio_instance_stats(SEXP instance) {
+	audio_engine_t *e;
+	ae_stats_t *st;
+	SEXP res, names, hist, hnames;
+	const char *nm[] = { "callbacks", "underruns", "overruns", "late", "time.mean", "time.min", "time.max", "headroom", "histogram" };
+	unsigned int n, i;
+	char buf[32];
+	if (TYPEOF(instance) != EXTPTRSXP)
+		Rf_error("invalid audio instance");
+	audio_instance_t *p = (audio_instance_t *) EXTPTR_PTR(instance);
+	if (!p) Rf_error("invalid audio instance");
+	if (!(e = instance_engine(p)))
+		Rf_error("the audio driver '%s' doesn't collect statistics", p->driver->name);
+	st = &e->stats;
+	res = Rf_protect(Rf_allocVector(VECSXP, 9));
+	names = Rf_allocVector(STRSXP, 9);
+	Rf_setAttrib(res, R_NamesSymbol, names);
+	for (i = 0; i < 9; i++)
+		SET_STRING_ELT(names, i, Rf_mkChar(nm[i]));
+	/* the count is updated last by the audio thread */
+	n = AE_LOAD(st->callbacks);
+	SET_VECTOR_ELT(res, 0, Rf_ScalarReal((double) n));
+	SET_VECTOR_ELT(res, 1, Rf_ScalarReal((double) AE_LOAD(st->underruns)));
+	SET_VECTOR_ELT(res, 2, Rf_ScalarReal((double) AE_LOAD(st->overruns)));
+	SET_VECTOR_ELT(res, 3, Rf_ScalarReal((double) AE_LOAD(st->late)));
+	/* durations in seconds, headroom as a fraction of the period */
+	SET_VECTOR_ELT(res, 4, Rf_ScalarReal(n ? ((double) AE_LOAD(st->time_sum)) * 1e-9 / (double) n : R_NaReal));
+	SET_VECTOR_ELT(res, 5, Rf_ScalarReal(n ? ((double) AE_LOAD(st->time_min)) * 1e-9 : R_NaReal));
+	SET_VECTOR_ELT(res, 6, Rf_ScalarReal(n ? ((double) AE_LOAD(st->time_max)) * 1e-9 : R_NaReal));
+	SET_VECTOR_ELT(res, 7, Rf_ScalarReal(n ? ((double) AE_LOAD(st->headroom)) / 10000.0 : R_NaReal));
+	hist = Rf_allocVector(REALSXP, AE_HIST_BUCKETS);
+	SET_VECTOR_ELT(res, 8, hist);
+	hnames = Rf_allocVector(STRSXP, AE_HIST_BUCKETS);
+	Rf_setAttrib(hist, R_NamesSymbol, hnames);
+	for (i = 0; i < AE_HIST_BUCKETS; i++) {
+		REAL(hist)[i] = (double) AE_LOAD(st->hist[i]);
+		if (i == 0)
+			snprintf(buf, sizeof(buf), "<1us");
+		else if (i == AE_HIST_BUCKETS - 1)
+			snprintf(buf, sizeof(buf), ">=%uus", 1u << (i - 1));
+		else
+			snprintf(buf, sizeof(buf), "%u-%uus", 1u << (i - 1), 1u << i);
+		SET_STRING_ELT(hnames, i, Rf_mkChar(buf));
+	}
+	Rf_unprotect(1);
+	return res;
+}
+
+SEXP audio_instance_position(SEXP instance) {
+	audio_engine_t *e;
+	ae_clock_t c;
+	SEXP res, names;
+	const char *nm[] = { "frames", "position", "stream.time", "timestamp", "now", "rate" };
+	int i;
+	if (TYPEOF(instance) != EXTPTRSXP)
+		Rf_error("invalid audio instance");
+	audio_instance_t *p = (audio_instance_t *) EXTPTR_PTR(instance);
+	if (!p) Rf_error("invalid audio instance");
+	if (!(e = instance_engine(p)))
+		Rf_error("the audio driver '%s' doesn't report positions", p->driver->name);
+	if (!audio_engine_read_clock(e, &c))
+		Rf_error("unable to read a consistent position");
+	res = Rf_protect(Rf_allocVector(VECSXP, 6));
+	names = Rf_allocVector(STRSXP, 6);
+	Rf_setAttrib(res, R_NamesSymbol, names);
+	for (i = 0; i < 6; i++)
+		SET_STRING_ELT(names, i, Rf_mkChar(nm[i]));
+	SET_VECTOR_ELT(res, 0, Rf_ScalarReal((double) c.frames));
+	SET_VECTOR_ELT(res, 1, Rf_ScalarReal((double) c.position));
+	SET_VECTOR_ELT(res, 2, Rf_ScalarReal(ISNAN(c.stream_time) ? R_NaReal : c.stream_time));
+	SET_VECTOR_ELT(res, 3, Rf_ScalarReal(ISNAN(c.timestamp) ? R_NaReal : c.timestamp));
+	SET_VECTOR_ELT(res, 4, Rf_ScalarReal(audio_engine_clock()));
+	SET_VECTOR_ELT(res, 5, Rf_ScalarReal((double) e->rate));
+	Rf_unprotect(1);
+	return res;
+}
+
+SEXP audio_instance_gain(SEXP instance, SEXP gain) {
+	audio_engine_t *e;
+	double g = Rf_asReal(gain);
+	if (TYPEOF(instance) != EXTPTRSXP)
+		Rf_error("invalid audio instance");
+	audio_instance_t *p = (audio_instance_t *) EXTPTR_PTR(instance);
+	if (!p) Rf_error("invalid audio instance");
+	if (!(e = instance_engine(p)))
+		Rf_error("the audio driver '%s' doesn't support gain control", p->driver->name);
+	if (ISNAN(g) || g < 0.0)
+		Rf_error("invalid gain");
+	if (!audio_engine_post(e, AE_CMD_GAIN, 0, 0, 0, 0, g))
+		Rf_error("too many pending commands, the audio device is not processing them");
+	return Rf_ScalarLogical(1);
+}
+
+SEXP audio_instance_offset(SEXP instance) {
+	audio_engine_t *e;
+	if (TYPEOF(instance) != EXTPTRSXP)
+		Rf_error("invalid audio instance");
+	audio_instance_t *p = (audio_instance_t *) EXTPTR_PTR(instance);
+	if (!p) Rf_error("invalid audio instance");
+	/* the instance engine of duplex instances is the capture side */
+	if (p->kind != AI_DUPLEX || !(e = instance_engine(p)))
+		return R_NilValue;
+	return Rf_ScalarInteger(AE_LOAD(e->io_offset));
+}
+
+SEXP audio_instance_trigger(SEXP instance, SEXP threshold, SEXP preroll, SEXP hang) {
+	audio_engine_t *e;
+	double db = Rf_asReal(threshold), pre = Rf_asReal(preroll), h = Rf_asReal(hang);
+	if (TYPEOF(instance) != EXTPTRSXP)
+		Rf_error("invalid audio instance");
+	audio_instance_t *p = (audio_instance_t *) EXTPTR_PTR(instance);
+	if (!p) Rf_error("invalid audio instance");
+	if (p->kind == AI_PLAYER)
+		Rf_error("only recording instances can be triggered");
+	if (!(e = instance_engine(p)))
+		Rf_error("the audio driver '%s' doesn't support triggered recording", p->driver->name);
+	if (ISNAN(db) || db > 0.0)
+		Rf_error("invalid threshold, must be in dBFS (at most 0)");
+	if (ISNAN(pre) || pre < 0.0 || pre > 60.0)
+		Rf_error("invalid pre-roll, must be between 0 and 60 seconds");
+	if (ISNAN(h) || h < 0.0)
+		Rf_error("invalid hang time");
+	/* dBFS of the mean square, 0 dB is a full-scale square wave */
+	audio_engine_set_trigger(e, pow(10.0, db / 10.0),
+							 (unsigned int) (pre * e->rate + 0.5),
+							 (h * e->rate > 4294967295.0) ? 4294967295u : (unsigned int) (h * e->rate + 0.5));
+	return Rf_ScalarLogical(1);
+}
+
+SEXP audio_instance_segments(SEXP instance) {
+	audio_engine_t *e;
+	ae_segment_t *seg;
+	const char *nm[] = { "start", "frames", "input", "time", "timestamp", "open" };
+	SEXP res, names, sRN;
+	int i, j, n, open;
+	struct timeval tv;
+	double wall;
+	if (TYPEOF(instance) != EXTPTRSXP)
+		Rf_error("invalid audio instance");
+	audio_instance_t *p = (audio_instance_t *) EXTPTR_PTR(instance);
+	if (!p) Rf_error("invalid audio instance");
+	if (!(e = instance_engine(p)) || !e->trigger)
+		return R_NilValue;
+	n = (int) audio_engine_segments(e, &seg, &open);
+	/* the engine clock is monotonic, convert timestamps to wall time */
+	gettimeofday(&tv, 0);
+	wall = ((double) tv.tv_sec) + ((double) tv.tv_usec) * 1e-6 - audio_engine_clock();
+	res = Rf_protect(Rf_allocVector(VECSXP, 6));
+	names = Rf_allocVector(STRSXP, 6);
+	Rf_setAttrib(res, R_NamesSymbol, names);
+	for (j = 0; j < 6; j++) {
+		SET_STRING_ELT(names, j, Rf_mkChar(nm[j]));
+		SET_VECTOR_ELT(res, j, Rf_allocVector((j < 5) ? REALSXP : LGLSXP, n));
+	}
+	{
+		SEXP cls = Rf_allocVector(STRSXP, 2);
+		Rf_setAttrib(VECTOR_ELT(res, 4), R_ClassSymbol, cls);
+		SET_STRING_ELT(cls, 0, Rf_mkChar("POSIXct"));
+		SET_STRING_ELT(cls, 1, Rf_mkChar("POSIXt"));
+	}
+	/* start is 1-based in the recording, time is the offset of the
+	   first frame in the input (including the skipped parts) */
+	for (i = 0; i < n; i++) {
+		REAL(VECTOR_ELT(res, 0))[i] = (double) seg[i].start + 1.0;
+		REAL(VECTOR_ELT(res, 1))[i] = (double) seg[i].frames;
+		REAL(VECTOR_ELT(res, 2))[i] = (double) seg[i].input + 1.0;
+		REAL(VECTOR_ELT(res, 3))[i] = (double) seg[i].input / e->rate;
+		REAL(VECTOR_ELT(res, 4))[i] = seg[i].timestamp + wall;
+		LOGICAL(VECTOR_ELT(res, 5))[i] = (open && i == n - 1) ? 1 : 0;
+	}
+	sRN = Rf_allocVector(INTSXP, 2);
+	INTEGER(sRN)[0] = R_NaInt;
+	INTEGER(sRN)[1] = -n;
+	Rf_setAttrib(res, R_RowNamesSymbol, sRN);
+	Rf_setAttrib(res, R_ClassSymbol, Rf_mkString("data.frame"));
+	if (AE_LOAD(e->trigger->lost))
+		Rf_setAttrib(res, Rf_install("lost"), Rf_ScalarInteger((int) AE_LOAD(e->trigger->lost)));
+	Rf_unprotect(1);
+	return res;
+}
+
 SEXP audio_instance_address(SEXP instance) {
 	if (TYPEOF(instance) != EXTPTRSXP)
 		Rf_error("invalid audio instance");
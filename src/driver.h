@@ -39,13 +39,16 @@
 #include "config.h"
 #endif
 
+#include <stddef.h>  /* for offsetof */
+
 #define R_NO_REMAP      /* to not pollute the namespace */
 #include <R.h>
 #include <Rinternals.h>
 
-#define R_AUDIO_API 1.0
+#define R_AUDIO_API 3.0
 
 #define APFLAG_LOOP   0x0001
+#define APFLAG_UNBOUNDED 0x0002 /* recorders: open-ended recording (engine only) */
 
 #define WAIT_DONE     1
 #define WAIT_TIMEOUT  2
@@ -54,6 +57,56 @@
 typedef struct audio_instance *(*create_player_t)(SEXP, float, int);
 typedef struct audio_instance *(*create_recorder_t)(SEXP, float, int, int);
 
+#define AI_PLAYER   1
+#define AI_RECORDER 2
+#define AI_DUPLEX   3
+
+/* sample formats (bit mask) */
+#define AFMT_S16      0x0001
+#define AFMT_S24      0x0002
+#define AFMT_S32      0x0004
+#define AFMT_F32      0x0008
+
+/* driver capabilities (bit mask) */
+#define ACAP_PLAY     0x0001
+#define ACAP_RECORD   0x0002
+#define ACAP_DUPLEX   0x0004
+#define ACAP_DEVICES  0x0008 /* supports device enumeration and selection */
+#define ACAP_ENGINE   0x0010 /* instances carry the engine entry (see audio_instance_t) */
+
+/* capabilities reported by a driver (API v2), 0 means unknown/unlimited */
+typedef struct audio_caps {
+	int flags;            /* ACAP_* */
+	int formats;          /* AFMT_* supported sample formats */
+	int native_format;    /* AFMT_* preferred format (no conversion in the driver) */
+	int max_out, max_in;  /* channels */
+	double min_rate, max_rate, default_rate;
+	int min_buffer, max_buffer; /* frames per buffer */
+} audio_caps_t;
+
+/* device description (API v2), strings are owned by the driver */
+typedef struct audio_device_info {
+	const char *name;
+	const char *host_api;
+	int max_out, max_in;  /* channels */
+	double default_rate;
+	double out_latency, in_latency; /* default (low) latencies in seconds */
+	int is_default_out, is_default_in;
+} audio_device_info_t;
+
+/* parameters for opening an instance (API v2) */
+typedef struct audio_config {
+	int kind;             /* AI_PLAYER, AI_RECORDER or AI_DUPLEX */
+	SEXP source;          /* source to play (player, duplex) */
+	SEXP target;          /* target to record into (recorder, duplex) */
+	float rate;           /* sample rate, -1 if unspecified */
+	int channels;         /* input channels (recorder, duplex) */
+	int format;           /* AFMT_* device format chosen by the core */
+	int buffer;           /* frames per buffer, 0 for the driver's default */
+	int device;           /* device index, -1 for the default device */
+	int flags;            /* APFLAG_* */
+} audio_config_t;
+
 /* define driver structure */
 typedef struct audio_driver {
 	unsigned int length; /* length of the driver structure, i.e., sizeof(audio_driver_t) */
@@ -70,18 +123,34 @@ typedef struct audio_driver {
 	int (*wait)(void *, double timeout);
 	int (*close)(void *);
 	void (*dispose)(void *);
+
+	/* API v2 - present if length >= AUDIO_DRIVER_V2_LENGTH, all entries are optional */
+	int (*caps)(audio_caps_t *);       /* fill the capabilities, returns 0 on failure */
+	int (*devices)(void);              /* number of devices */
+	int (*device_info)(int, audio_device_info_t *); /* index, info; returns 0 on failure */
+	struct audio_instance *(*open)(const audio_config_t *); /* create an instance, raises an R error on failure */
+
+	/* API v3 - present if length >= AUDIO_DRIVER_V3_LENGTH, all entries are optional */
+	int (*init)(void);      /* initialize the backend on first use (before devices or instances), returns 0 on failure */
+	void (*release)(void);  /* release the backend when the driver is unloaded */
 } audio_driver_t;
 
-#define AI_PLAYER   1
-#define AI_RECORDER 2
+/* drivers are identified by the length of their structure, version 1
+   drivers end with dispose, version 2 drivers with open */
+#define AUDIO_DRIVER_V1_LENGTH (offsetof(audio_driver_t, caps))
+#define AUDIO_DRIVER_V2_LENGTH (offsetof(audio_driver_t, init))
+#define AUDIO_DRIVER_V3_LENGTH (sizeof(audio_driver_t))
+#define AUDIO_DRIVER_IS_V2(D) ((D)->length >= AUDIO_DRIVER_V2_LENGTH)
+#define AUDIO_DRIVER_IS_V3(D) ((D)->length >= AUDIO_DRIVER_V3_LENGTH)
 
 /* define audio instance structure. individual implementations
    are free to add their own fields, but those listed below must be
    common to all instances */
 typedef struct audio_instance {
 	audio_driver_t *driver;  /* must point to the driver that created this */
-	int kind;                /* must be either AI_PLAYER or AI_RECORDER */
-	SEXP source;             /* source (player) or target (recorder) */ 
+	int kind;                /* must be either AI_PLAYER, AI_RECORDER or AI_DUPLEX */
+	SEXP source;             /* source (player) or target (recorder, duplex) */ 
+	struct audio_engine *engine; /* shared engine (see engine.h), only present if the driver has ACAP_ENGINE */
 } audio_instance_t;
 
 #endif
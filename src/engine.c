@@ -0,0 +1,1218 @@
+/* Shared playback/capture engine used by the audio drivers
+   audio R package
+   Copyright(c) 2026 Simon Urbanek
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation
+   files (the "Software"), to deal in the Software without
+   restriction, including without limitation the rights to use, copy,
+   modify, merge, publish, distribute, sublicense, and/or sell copies
+   of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   * The above copyright notice and this permission notice shall be
+     included in all copies or substantial portions of the Software.
+ 
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND ON
+   INFRINGEMENT. 
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR
+   ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+   CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+   WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ 
+   The text above constitutes the entire license; however, the
+   PortAudio community also makes the following non-binding requests:
+
+   * Any person wishing to distribute modifications to the Software is
+     requested to send the modifications to the original developer so
+     that they can be incorporated into the canonical version. It is
+     also requested that these non-binding requests be included along
+     with the license above.
+
+ */
+
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+#include "engine.h"
+
+#ifdef __WIN32__
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/time.h>
+#include <R_ext/eventloop.h>
+#endif
+
+#define AE_DEFAULT_LOOKAHEAD 8192 /* frames */
+
+/* marker used in `pending' to request removal of the filter chain */
+static audio_filter_chain_t no_filters;
+
+#define AE_ACTIVITY 73 /* input handler activity id, arbitrary */
+
+static void stream_fill(audio_engine_t *e);
+
+#ifndef __WIN32__
+/* called by R's event loop when the audio thread asks for service */
+static void wakeup_handler(void *data) {
+	audio_engine_t *e = (audio_engine_t*) data;
+	char tmp[64];
+	while (read(e->wake_fd[0], tmp, sizeof(tmp)) > 0) {}
+	audio_engine_service(e);
+}
+#endif
+
+/* (R) the audio thread cannot call R, so it writes to a pipe which is
+   watched by R's event loop. Without it (Windows) R services the
+   engine only while waiting. */
+static void wakeup_init(audio_engine_t *e) {
+#ifndef __WIN32__
+	if (e->wake_fd[0] == -1 && !pipe(e->wake_fd)) {
+		InputHandler *ih;
+		fcntl(e->wake_fd[0], F_SETFL, O_NONBLOCK);
+		fcntl(e->wake_fd[1], F_SETFL, O_NONBLOCK);
+		ih = addInputHandler(R_InputHandlers, e->wake_fd[0], wakeup_handler, AE_ACTIVITY);
+		if (ih) ih->userData = e;
+		e->wake_handler = ih;
+	}
+#endif
+}
+
+static void wakeup_free(audio_engine_t *e) {
+#ifndef __WIN32__
+	if (e->wake_handler)
+		removeInputHandler(&R_InputHandlers, (InputHandler*) e->wake_handler);
+	if (e->wake_fd[0] != -1) close(e->wake_fd[0]);
+	if (e->wake_fd[1] != -1) close(e->wake_fd[1]);
+#endif
+}
+
+/* (audio) */
+static void wakeup(audio_engine_t *e) {
+#ifndef __WIN32__
+	if (e->wake_fd[1] != -1 && write(e->wake_fd[1], "", 1) < 1) {} /* R may still pick it up while waiting */
+#endif
+}
+
+static ae_stream_t *stream_new(audio_engine_t *e, int size) {
+	ae_stream_t *s = (ae_stream_t*) calloc(1, sizeof(ae_stream_t));
+	if (!s) return 0;
+	s->size = size;
+	if (!(s->ring = (double*) malloc(sizeof(double) * e->chs * size))) {
+		free(s);
+		return 0;
+	}
+	return s;
+}
+
+static void stream_free(ae_stream_t *s) {
+	if (!s) return;
+	if (s->reader) s->reader->close(s->reader);
+	if (s->pending) R_ReleaseObject(s->pending);
+	free(s->ring);
+	free(s);
+}
+
+/* (R) move closed segments from the ring to the list */
+static void trigger_service(audio_engine_t *e) {
+	ae_trigger_t *t = e->trigger;
+	unsigned int wr = AE_LOAD(t->seg_wr);
+	while (t->seg_rd != wr) {
+		if (t->count == t->size) {
+			unsigned int size = t->size ? (t->size * 2) : 64;
+			ae_segment_t *l = (ae_segment_t*) realloc(t->list, sizeof(ae_segment_t) * size);
+			if (!l) return; /* they stay in the ring */
+			t->list = l;
+			t->size = size;
+		}
+		t->list[t->count++] = t->seg[t->seg_rd % AE_SEGMENT_RING];
+		AE_STORE(t->seg_rd, t->seg_rd + 1);
+	}
+}
+
+static void trigger_free(ae_trigger_t *t) {
+	if (!t) return;
+	free(t->ring);
+	free(t->list);
+	free(t);
+}
+
+static ae_chunk_t *chunk_new(audio_engine_t *e) {
+	return (ae_chunk_t*) malloc(sizeof(ae_chunk_t) + sizeof(double) * AE_CHUNK_FRAMES * e->chs);
+}
+
+/* (R) move completed chunks to the list and top up the pool */
+static void chunks_service(audio_engine_t *e) {
+	ae_chunks_t *c = e->chunks;
+	unsigned int wr;
+	AE_STORE(c->requested, 0);
+	wr = AE_LOAD(c->full_wr);
+	while (c->full_rd != wr) {
+		ae_chunk_t *ch = c->full[c->full_rd % AE_CHUNK_RING];
+		ch->next = 0;
+		c->frames += ch->frames;
+		c->count++;
+		/* the sink owns (and may free) the chunk once it has it */
+		if (c->sink) {
+			if (!c->sink->write(c->sink, ch))
+				c->sink_error = 1;
+		} else {
+			if (c->tail) c->tail->next = ch; else c->head = ch;
+			c->tail = ch;
+		}
+		AE_STORE(c->full_rd, c->full_rd + 1);
+	}
+	while (c->free_wr - AE_LOAD(c->free_rd) < AE_CHUNK_POOL) {
+		ae_chunk_t *ch = chunk_new(e);
+		if (!ch) break; /* the audio thread will drop input until R has memory */
+		c->free[c->free_wr % AE_CHUNK_RING] = ch;
+		AE_STORE(c->free_wr, c->free_wr + 1);
+	}
+}
+
+static ae_chunks_t *chunks_new(audio_engine_t *e) {
+	ae_chunks_t *c = (ae_chunks_t*) calloc(1, sizeof(ae_chunks_t));
+	if (!c) return 0;
+	e->chunks = c;
+	chunks_service(e);
+	if (c->free_wr < AE_CHUNK_POOL) { /* even the initial pool failed */
+		while (c->free_wr--)
+			free(c->free[c->free_wr]);
+		free(c);
+		return e->chunks = 0;
+	}
+	return c;
+}
+
+/* (R) the audio thread is gone, so the current chunk is ours */
+static int sink_close(ae_chunks_t *c) {
+	ae_chunk_t *last = c->current;
+	int ok;
+	if (!c->sink) return 1;
+	c->current = 0;
+	if (last && !last->frames) {
+		free(last);
+		last = 0;
+	}
+	ok = c->sink->close(c->sink, last) && !c->sink_error;
+	c->sink = 0;
+	return ok;
+}
+
+static void chunks_free(ae_chunks_t *c) {
+	ae_chunk_t *ch;
+	if (!c) return;
+	/* the audio thread is gone */
+	if (c->sink) {
+		while (c->full_rd != c->full_wr) {
+			ch = c->full[c->full_rd++ % AE_CHUNK_RING];
+			if (!c->sink->write(c->sink, ch))
+				c->sink_error = 1;
+		}
+		sink_close(c);
+	}
+	while ((ch = c->head)) {
+		c->head = ch->next;
+		free(ch);
+	}
+	for (; c->full_rd != c->full_wr; c->full_rd++)
+		free(c->full[c->full_rd % AE_CHUNK_RING]);
+	for (; c->free_rd != c->free_wr; c->free_rd++)
+		free(c->free[c->free_rd % AE_CHUNK_RING]);
+	free(c->current);
+	free(c);
+}
+
+ae_reader_t *audio_engine_reader(SEXP source) {
+	ae_reader_t *r;
+	if (TYPEOF(source) != EXTPTRSXP || R_ExternalPtrTag(source) != Rf_install("audio.reader"))
+		return 0;
+	if (!(r = (ae_reader_t*) R_ExternalPtrAddr(source)))
+		Rf_error("the stream has been played already");
+	return r;
+}
+
+audio_engine_t *audio_engine_new(SEXP source, float rate, int chs, int flags) {
+	audio_engine_t *e;
+	ae_reader_t *reader = audio_engine_reader(source);
+	int lookahead = AE_DEFAULT_LOOKAHEAD;
+	if (reader) {
+		if (chs < 1)
+			chs = reader->chs;
+		if (chs != reader->chs)
+			Rf_error("the stream has %d channel(s), %d requested", reader->chs, chs);
+		lookahead = (int) reader->lookahead;
+	} else if (Rf_isFunction(source)) {
+		SEXP sCh = Rf_getAttrib(source, Rf_install("channels"));
+		SEXP sLA = Rf_getAttrib(source, Rf_install("lookahead"));
+		if (chs < 1)
+			chs = (sCh == R_NilValue) ? 1 : Rf_asInteger(sCh);
+		if (sLA != R_NilValue)
+			lookahead = Rf_asInteger(sLA);
+		if (chs < 1 || chs == R_NaInt)
+			Rf_error("invalid number of channels");
+		if (lookahead < AE_BLOCK || lookahead == R_NaInt)
+			lookahead = AE_BLOCK;
+	} else if (chs < 1) { /* if the source is a matrix with 2 rows then we'll use stereo */
+		SEXP dim = Rf_getAttrib(source, R_DimSymbol);
+		chs = (TYPEOF(dim) == INTSXP && LENGTH(dim) > 0 && INTEGER(dim)[0] == 2) ? 2 : 1;
+	}
+	if (chs > AE_MAX_CHANNELS)
+		Rf_error("too many channels (at most %d are supported)", AE_MAX_CHANNELS);
+	e = (audio_engine_t*) calloc(1, sizeof(audio_engine_t));
+	if (!e)
+		Rf_error("out of memory");
+	e->source = source;
+	e->rate = rate;
+	e->chs = chs;
+	e->position = 0;
+	e->length = (reader || Rf_isFunction(source)) ? 0 : (XLENGTH(source) / chs);
+	e->region_start = e->loop_start = 0;
+	e->region_end = e->loop_end = e->length;
+	e->loop = (flags & APFLAG_LOOP) ? 1 : 0;
+	e->first.source = source;
+	e->first.length = e->length;
+	e->playing = e->last = &e->first;
+	dither_init(&e->dither, DITHER_NONE, (unsigned int) (size_t) e);
+	e->stats.time_min = 0xffffffff;
+	e->stats.headroom = 10000;
+	e->clock.stream_time = e->clock.timestamp = NAN;
+	e->gain = e->gain_target = 1.0;
+	e->wake_fd[0] = e->wake_fd[1] = -1;
+	if (reader) {
+		if (!(e->stream = stream_new(e, lookahead))) {
+			free(e);
+			Rf_error("out of memory");
+		}
+		/* the engine owns the reader from now on */
+		R_ClearExternalPtr(source);
+		e->stream->reader = reader;
+		if (!reader->start(reader, e->stream)) {
+			stream_free(e->stream);
+			free(e);
+			Rf_error("cannot start the stream reader");
+		}
+	} else if (Rf_isFunction(source)) {
+		if (!(e->stream = stream_new(e, lookahead))) {
+			free(e);
+			Rf_error("out of memory");
+		}
+		wakeup_init(e);
+		stream_fill(e); /* start with a full look-ahead */
+	} else if (flags & APFLAG_UNBOUNDED) {
+		/* the target is not used, the recording ends when stopped */
+		e->length = e->region_end = e->loop_end = e->first.length = AE_UNBOUNDED;
+		if (!chunks_new(e)) {
+			free(e);
+			Rf_error("out of memory");
+		}
+		wakeup_init(e);
+	}
+	return e;
+}
+
+/* (R) copy n frames of a source function result starting at frame
+   from into the ring */
+static void stream_put(audio_engine_t *e, SEXP res, unsigned int from, unsigned int n) {
+	ae_stream_t *s = e->stream;
+	unsigned int i, at = s->wr % s->size;
+	for (i = from; i < from + n; i++, at++) {
+		double *d;
+		int c;
+		if (at == s->size) at = 0;
+		d = s->ring + at * e->chs;
+		if (TYPEOF(res) == INTSXP)
+			for (c = 0; c < e->chs; c++) d[c] = ((double) INTEGER(res)[i * e->chs + c]) / 32767.0;
+		else
+			for (c = 0; c < e->chs; c++) d[c] = REAL(res)[i * e->chs + c];
+	}
+	AE_STORE(s->wr, s->wr + n);
+}
+
+/* (R) call the source function until the look-ahead is full */
+static void stream_fill(audio_engine_t *e) {
+	ae_stream_t *s = e->stream;
+	AE_STORE(s->requested, 0);
+	while (!s->eof) {
+		unsigned int space = s->size - (s->wr - AE_LOAD(s->rd)), n;
+		int err = 0;
+		SEXP res;
+		/* frames the function returned beyond the free space last time
+		   go first */
+		if (s->pending) {
+			n = LENGTH(s->pending) / e->chs - s->pending_at;
+			if (n > space) n = space;
+			stream_put(e, s->pending, s->pending_at, n);
+			s->pending_at += n;
+			if (s->pending_at < LENGTH(s->pending) / e->chs)
+				break; /* the ring is full */
+			R_ReleaseObject(s->pending);
+			s->pending = 0;
+			continue;
+		}
+		/* don't bother the function for tiny blocks */
+		if (space < s->size / 4 || space < AE_BLOCK) break;
+		res = Rf_protect(Rf_lang2(e->source, Rf_ScalarInteger(space)));
+		res = R_tryEval(res, R_GlobalEnv, &err);
+		Rf_unprotect(1);
+		if (err || (res != R_NilValue && TYPEOF(res) != INTSXP && TYPEOF(res) != REALSXP)) {
+			AE_STORE(s->eof, 1);
+			Rf_warning("the audio source function %s, ending playback", err ? "failed" : "returned an invalid result");
+			break;
+		}
+		n = (res == R_NilValue) ? 0 : (LENGTH(res) / e->chs);
+		if (n == 0) {
+			AE_STORE(s->eof, 1);
+			break;
+		}
+		if (n > space) {
+			/* keep the rest for the next fill */
+			R_PreserveObject(res);
+			s->pending = res;
+			s->pending_at = space;
+			n = space;
+		}
+		stream_put(e, res, 0, n);
+	}
+}
+
+void audio_engine_service(audio_engine_t *e) {
+	if (e && e->stream && !e->stream->reader && !e->stream->eof)
+		stream_fill(e);
+	if (e && e->chunks)
+		chunks_service(e);
+	if (e && e->trigger)
+		trigger_service(e);
+}
+
+void audio_engine_set_trigger(audio_engine_t *e, double threshold, unsigned int preroll, unsigned int hang) {
+	ae_trigger_t *t = (ae_trigger_t*) calloc(1, sizeof(ae_trigger_t));
+	if (!t)
+		Rf_error("out of memory");
+	if (preroll && !(t->ring = (double*) malloc(sizeof(double) * preroll * e->chs))) {
+		free(t);
+		Rf_error("out of memory");
+	}
+	t->threshold = threshold;
+	t->preroll = preroll;
+	t->hang = hang;
+	trigger_free(e->trigger);
+	e->trigger = t;
+	wakeup_init(e);
+}
+
+unsigned int audio_engine_segments(audio_engine_t *e, ae_segment_t **seg, int *open) {
+	ae_trigger_t *t = e->trigger;
+	unsigned int n, tries = 0;
+	*open = 0;
+	*seg = 0;
+	if (!t) return 0;
+	trigger_service(e);
+	/* make room for the open segment */
+	if (t->count == t->size) {
+		ae_segment_t *l = (ae_segment_t*) realloc(t->list, sizeof(ae_segment_t) * (t->size + 1));
+		if (!l) Rf_error("out of memory");
+		t->list = l;
+		t->size++;
+	}
+	n = t->count;
+	/* the open segment is consistent if it is still open and no segment
+	   was closed while we read it */
+	while (tries++ < 100) {
+		unsigned int wr = AE_LOAD(t->seg_wr);
+		if (!AE_LOAD(t->active)) break;
+		t->list[n] = t->cur;
+		t->list[n].frames = AE_LOAD(e->position) - t->list[n].start;
+		if (AE_LOAD(t->active) && AE_LOAD(t->seg_wr) == wr) {
+			if (wr == t->seg_rd) /* otherwise it follows unseen closed segments */
+				*open = 1;
+			break;
+		}
+	}
+	*seg = t->list;
+	return n + *open;
+}
+
+void audio_engine_set_sink(audio_engine_t *e, ae_sink_t *sink) {
+	if (!e->chunks) {
+		sink->close(sink, 0);
+		Rf_error("only open-ended recordings can be streamed");
+	}
+	if (e->chunks->sink) sink_close(e->chunks);
+	e->chunks->sink = sink;
+	e->chunks->sink_error = 0;
+}
+
+int audio_engine_close_sink(audio_engine_t *e) {
+	if (!e || !e->chunks || !e->chunks->sink)
+		return 1;
+	chunks_service(e);
+	return sink_close(e->chunks);
+}
+
+SEXP audio_engine_collect(audio_engine_t *e) {
+	ae_chunks_t *c = e->chunks;
+	ae_chunk_t *cur, *ch;
+	unsigned int n = 0, tries = 0;
+	double *d;
+	SEXP res;
+	if (c->sink)
+		Rf_error("the recording is streamed to %s", c->sink->name ? c->sink->name : "a sink");
+	/* the chunk being filled is only contiguous with the list if all
+	   chunks completed before it have been moved to the list */
+	while (1) {
+		chunks_service(e);
+		cur = AE_LOAD(c->current);
+		if (!cur || cur->seq < c->count) { /* nothing started or already in the list */
+			cur = 0;
+			break;
+		}
+		if (cur->seq == c->count) {
+			n = AE_LOAD(cur->frames);
+			break;
+		}
+		if (++tries > 100) /* the audio thread is faster than us, use what we have */
+			break;
+	}
+	res = Rf_protect(Rf_allocVector(REALSXP, (R_xlen_t) (c->frames + n) * e->chs));
+	d = REAL(res);
+	for (ch = c->head; ch; ch = ch->next) {
+		memcpy(d, ch->data, sizeof(double) * ch->frames * e->chs);
+		d += (size_t) ch->frames * e->chs;
+	}
+	if (cur && n)
+		memcpy(d, cur->data, sizeof(double) * n * e->chs);
+	/* matrix dimensions are int, so longer recordings stay interleaved */
+	if (e->chs > 1 && c->frames + n > (unsigned long long) INT_MAX)
+		Rf_warning("the recording has more than %d frames, returning interleaved samples without dimensions", INT_MAX);
+	else if (e->chs > 1) {
+		SEXP dim = Rf_allocVector(INTSXP, 2);
+		INTEGER(dim)[0] = e->chs;
+		INTEGER(dim)[1] = (int) (c->frames + n);
+		Rf_setAttrib(res, R_DimSymbol, dim);
+	}
+	Rf_setAttrib(res, Rf_install("rate"), Rf_ScalarInteger((int) e->rate));
+	Rf_setAttrib(res, Rf_install("bits"), Rf_ScalarInteger(16));
+	Rf_setAttrib(res, R_ClassSymbol, Rf_mkString("audioSample"));
+	Rf_unprotect(1);
+	return res;
+}
+
+static void free_retired(audio_engine_t *e) {
+	audio_filter_chain_t *fc = AE_XCHG(e->retired, (audio_filter_chain_t*) 0);
+	while (fc) {
+		audio_filter_chain_t *next = fc->next_retired;
+		filter_chain_free(fc);
+		fc = next;
+	}
+}
+
+/* the initial source is preserved by the driver, queued ones by us */
+static void release_entry(audio_engine_t *e, ae_entry_t *en) {
+	if (en == &e->first) return;
+	R_ReleaseObject(en->source);
+	free(en);
+}
+
+static void free_played(audio_engine_t *e) {
+	ae_entry_t *en = AE_XCHG(e->played, (ae_entry_t*) 0);
+	while (en) {
+		ae_entry_t *next = en->next_played;
+		release_entry(e, en);
+		en = next;
+	}
+}
+
+void audio_engine_free(audio_engine_t *e) {
+	audio_filter_chain_t *fc;
+	ae_entry_t *en;
+	if (!e) return;
+	free_retired(e);
+	free_played(e);
+	/* the audio thread is gone, so all remaining entries are ours */
+	en = e->playing;
+	while (en) {
+		ae_entry_t *next = en->next;
+		release_entry(e, en);
+		en = next;
+	}
+	fc = AE_XCHG(e->pending, (audio_filter_chain_t*) 0);
+	if (fc != &no_filters) filter_chain_free(fc);
+	filter_chain_free(e->filters);
+	wakeup_free(e);
+	stream_free(e->stream);
+	chunks_free(e->chunks);
+	trigger_free(e->trigger);
+	free(e);
+}
+
+void audio_engine_set_filters(audio_engine_t *e, audio_filter_chain_t *fc) {
+	audio_filter_chain_t *old;
+	free_retired(e);
+	old = AE_XCHG(e->pending, fc ? fc : &no_filters);
+	/* a chain that was never picked up can be freed right away */
+	if (old && old != &no_filters) filter_chain_free(old);
+}
+
+/* audio thread: hand a chain back to R for disposal (lock-free push) */
+static void retire(audio_engine_t *e, audio_filter_chain_t *fc) {
+	audio_filter_chain_t *head = AE_LOAD(e->retired);
+	do {
+		fc->next_retired = head;
+	} while (!AE_CAS(e->retired, head, fc));
+}
+
+/* audio thread: pick up a new filter chain if R has posted one */
+static void update_filters(audio_engine_t *e) {
+	audio_filter_chain_t *fc;
+	if (!AE_LOAD(e->pending)) return;
+	fc = AE_XCHG(e->pending, (audio_filter_chain_t*) 0);
+	if (fc) {
+		audio_filter_chain_t *old = e->filters;
+		e->filters = (fc == &no_filters) ? 0 : fc;
+		if (old) retire(e, old);
+	}
+}
+
+int audio_engine_enqueue(audio_engine_t *e, SEXP source) {
+	ae_entry_t *en;
+	free_played(e);
+	en = (ae_entry_t*) calloc(1, sizeof(ae_entry_t));
+	if (!en)
+		Rf_error("out of memory");
+	en->source = source;
+	en->length = XLENGTH(source) / e->chs;
+	R_PreserveObject(source);
+	/* the entry is complete before it becomes visible to the audio thread */
+	AE_STORE(e->last->next, en);
+	e->last = en;
+	return audio_engine_queued(e);
+}
+
+int audio_engine_queued(audio_engine_t *e) {
+	int n = 0;
+	ae_entry_t *en;
+	free_played(e);
+	/* entries are only released by R, so `playing' remains valid while
+	   we walk even if the audio thread moves on */
+	en = AE_LOAD(e->playing);
+	while ((en = AE_LOAD(en->next)))
+		n++;
+	return n;
+}
+
+/* audio thread: move on to the next queued source, returns 0 if there
+   is none */
+static int next_entry(audio_engine_t *e) {
+	ae_entry_t *cur = e->playing, *next = AE_LOAD(cur->next), *head;
+	if (!next) return 0;
+	AE_STORE(e->playing, next);
+	e->source = next->source;
+	e->length = next->length;
+	e->position = e->region_start = e->loop_start = 0;
+	e->region_end = e->loop_end = e->length;
+	e->xfade = 0;
+	/* hand the finished entry back to R (lock-free push) */
+	head = AE_LOAD(e->played);
+	do {
+		cur->next_played = head;
+	} while (!AE_CAS(e->played, head, cur));
+	return 1;
+}
+
+int audio_engine_post(audio_engine_t *e, int op, int flag, unsigned long long a, unsigned long long b, unsigned int c, double value) {
+	unsigned int head = e->cmd_head;
+	ae_command_t *cmd;
+	if (head - AE_LOAD(e->cmd_tail) >= AE_QUEUE_SIZE)
+		return 0;
+	cmd = &e->cmd[head & (AE_QUEUE_SIZE - 1)];
+	cmd->op = op;
+	cmd->flag = flag;
+	cmd->a = a;
+	cmd->b = b;
+	cmd->c = c;
+	cmd->value = value;
+	AE_STORE(e->cmd_head, head + 1);
+	return 1;
+}
+
+/* keep the loop points and position consistent with the region */
+static void clamp_transport(audio_engine_t *e) {
+	/* streams have no length, regions and loops are rejected by R */
+	if (e->stream) return;
+	if (e->loop_start < e->region_start) e->loop_start = e->region_start;
+	if (e->loop_end > e->region_end) e->loop_end = e->region_end;
+	if (e->loop_start >= e->loop_end) {
+		e->loop_start = e->region_start;
+		e->loop_end = e->region_end;
+	}
+	/* without enough material before the loop start the tail is faded
+	   into the loop head instead, so both have to fit into the loop */
+	if (e->xfade > e->loop_start && e->xfade > (e->loop_end - e->loop_start) / 2)
+		e->xfade = (unsigned int) ((e->loop_end - e->loop_start) / 2);
+	if (e->xfade > e->loop_end - e->loop_start) e->xfade = (unsigned int) (e->loop_end - e->loop_start);
+	if (e->position < e->region_start) e->position = e->region_start;
+	if (e->position > e->region_end) e->position = e->region_end;
+}
+
+/* first frame of the material the loop tail is faded into: the frames
+   preceding the loop start or, if there are not enough, the loop head */
+static unsigned long long xfade_source(const audio_engine_t *e) {
+	return (e->xfade > e->loop_start) ? e->loop_start : (e->loop_start - e->xfade);
+}
+
+/* where playback continues after the loop end: past the faded-in head
+   if the head was used for the crossfade */
+static unsigned long long loop_restart(const audio_engine_t *e) {
+	return (e->xfade > e->loop_start) ? (e->loop_start + e->xfade) : e->loop_start;
+}
+
+/* audio thread: execute all pending commands */
+static void run_commands(audio_engine_t *e) {
+	unsigned int tail = e->cmd_tail, head = AE_LOAD(e->cmd_head);
+	if (tail == head) return;
+	while (tail != head) {
+		const ae_command_t *cmd = &e->cmd[tail & (AE_QUEUE_SIZE - 1)];
+		switch (cmd->op) {
+		case AE_CMD_SEEK:
+			e->position = cmd->a;
+			break;
+		case AE_CMD_REGION:
+			e->region_end = (cmd->b > e->length) ? e->length : cmd->b;
+			e->region_start = (cmd->a > e->region_end) ? e->region_end : cmd->a;
+			e->position = e->region_start;
+			break;
+		case AE_CMD_LOOP:
+			e->loop = cmd->flag;
+			e->loop_start = cmd->a;
+			e->loop_end = cmd->b;
+			e->xfade = cmd->c;
+			break;
+		case AE_CMD_PAUSE:
+			e->paused = 1;
+			break;
+		case AE_CMD_RESUME:
+			e->paused = 0;
+			break;
+		case AE_CMD_GAIN:
+			e->gain_target = cmd->value;
+			break;
+		case AE_CMD_STOP:
+			e->stopped = 1;
+			break;
+		}
+		clamp_transport(e);
+		tail++;
+	}
+	AE_STORE(e->cmd_tail, tail);
+}
+
+static double source_sample(audio_engine_t *e, size_t index) {
+	if (TYPEOF(e->source) == INTSXP)
+		return ((double) INTEGER(e->source)[index]) / 32767.0;
+	if (TYPEOF(e->source) == REALSXP)
+		return REAL(e->source)[index];
+	return 0.0;
+}
+
+/* copy `frames' frames starting at frame `index' of the source into the
+   scratch buffer as doubles in [-1, 1] and apply the loop crossfade */
+static void fetch_block(audio_engine_t *e, unsigned long long index, unsigned int frames) {
+	unsigned int i, samples = frames * e->chs;
+	double *d = e->buf;
+	if (e->stream) { /* consume the look-ahead, next_run has checked the fill */
+		ae_stream_t *st = e->stream;
+		unsigned int at = st->rd % st->size, first = st->size - at;
+		if (first > frames) first = frames;
+		memcpy(d, st->ring + at * e->chs, sizeof(double) * first * e->chs);
+		if (first < frames)
+			memcpy(d + first * e->chs, st->ring, sizeof(double) * (frames - first) * e->chs);
+		AE_STORE(st->rd, st->rd + frames);
+		return;
+	}
+	if (TYPEOF(e->source) == INTSXP) {
+		const int *s = INTEGER(e->source) + (size_t) index * e->chs;
+		for (i = 0; i < samples; i++)
+			d[i] = ((double) s[i]) / 32767.0;
+	} else if (TYPEOF(e->source) == REALSXP)
+		memcpy(d, REAL(e->source) + (size_t) index * e->chs, sizeof(double) * samples);
+	else /* not reached: functions and readers are served by the stream above */
+		memset(d, 0, sizeof(double) * samples);
+	/* approaching the loop end we fade into the material that leads up
+	   to the restart point (see loop_restart) so the jump back is seamless */
+	if (e->loop && e->xfade && index + frames > e->loop_end - e->xfade && index < e->loop_end) {
+		unsigned long long fs = e->loop_end - e->xfade, src = xfade_source(e);
+		unsigned int t, c;
+		for (t = (index < fs) ? (unsigned int) (fs - index) : 0; t < frames && index + t < e->loop_end; t++) {
+			unsigned int k = (unsigned int) (index + t - fs);
+			size_t from = (size_t) (src + k) * e->chs;
+			double g = ((double) k + 0.5) / (double) e->xfade;
+			for (c = 0; c < e->chs; c++)
+				d[t * e->chs + c] = d[t * e->chs + c] * (1.0 - g) + source_sample(e, from + c) * g;
+		}
+	}
+}
+
+/* apply the gain to the scratch buffer, changes are ramped linearly
+   over the block to avoid zipper noise */
+static void apply_gain(audio_engine_t *e, double *d, unsigned int frames) {
+	double g = e->gain;
+	unsigned int i, c, chs = e->chs;
+	if (g == e->gain_target) {
+		if (g != 1.0)
+			for (i = 0; i < frames * chs; i++)
+				d[i] *= g;
+		return;
+	} else {
+		double step = (e->gain_target - g) / (double) frames;
+		for (i = 0; i < frames; i++, g += step)
+			for (c = 0; c < chs; c++)
+				*(d++) *= g;
+		e->gain = e->gain_target;
+	}
+}
+
+/* determine the next run of frames to play, returns 0 at the end */
+static unsigned int next_run(audio_engine_t *e, unsigned int frames) {
+	unsigned long long end = e->loop ? e->loop_end : e->region_end, rem;
+	if (e->stream) {
+		unsigned int avail = AE_LOAD(e->stream->wr) - e->stream->rd;
+		return (avail > frames) ? frames : avail;
+	}
+	while (e->position >= end) {
+		if (e->loop && e->loop_end > e->loop_start)
+			e->position = loop_restart(e);
+		else if (next_entry(e)) /* continue with the queue mid-buffer */
+			end = e->region_end;
+		else
+			return 0;
+	}
+	rem = (e->position < end) ? end - e->position : 0;
+	return (rem > frames) ? frames : (unsigned int) rem;
+}
+
+double audio_engine_clock(void) {
+#ifdef __WIN32__
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return ((double) count.QuadPart) / ((double) freq.QuadPart);
+#elif defined CLOCK_MONOTONIC
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((double) ts.tv_sec) + ((double) ts.tv_nsec) * 1e-9;
+#else /* fall back to wall time on older systems */
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return ((double) tv.tv_sec) + ((double) tv.tv_usec) * 1e-6;
+#endif
+}
+
+void audio_engine_callback_done(audio_engine_t *e, double start, unsigned int frames) {
+	ae_stats_t *st = &e->stats;
+	double dur = audio_engine_clock() - start, period = ((double) frames) / e->rate;
+	unsigned int ns = (dur < 4.0) ? (unsigned int) (dur * 1e9) : 0xffffffff, us = ns / 1000, b = 0;
+	while (us && b < AE_HIST_BUCKETS - 1) {
+		us >>= 1;
+		b++;
+	}
+	AE_STORE(st->hist[b], st->hist[b] + 1);
+	AE_STORE(st->time_sum, st->time_sum + ns);
+	if (ns < st->time_min) AE_STORE(st->time_min, ns);
+	if (ns > st->time_max) AE_STORE(st->time_max, ns);
+	if (frames && e->rate > 0.0) {
+		double h = (period - dur) / period * 10000.0;
+		if (h < (double) st->headroom) AE_STORE(st->headroom, (h < -1e9) ? -1000000000 : (int) h);
+		if (dur > period) AE_STORE(st->late, st->late + 1);
+	}
+	/* last, so the count never exceeds the other entries */
+	AE_STORE(st->callbacks, st->callbacks + 1);
+}
+
+/* seqlock fields are accessed with relaxed atomics, the ordering comes
+   from the fences around them */
+#define AE_STORE_RELAXED(X, V) do { __typeof__(X) v_ = (V); __atomic_store(&(X), &v_, __ATOMIC_RELAXED); } while (0)
+#define AE_LOAD_RELAXED(X, V) __atomic_load(&(X), &(V), __ATOMIC_RELAXED)
+
+void audio_engine_timestamp(audio_engine_t *e, double stream_time) {
+	ae_clock_t *c = &e->clock;
+	unsigned int seq = c->seq;
+	__atomic_store_n(&c->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	AE_STORE_RELAXED(c->frames, e->frames_total);
+	AE_STORE_RELAXED(c->position, e->position);
+	AE_STORE_RELAXED(c->stream_time, stream_time);
+	AE_STORE_RELAXED(c->timestamp, audio_engine_clock());
+	AE_STORE(c->seq, seq + 2);
+}
+
+int audio_engine_read_clock(audio_engine_t *e, ae_clock_t *c) {
+	int tries = 100;
+	while (tries--) {
+		unsigned int seq = AE_LOAD(e->clock.seq);
+		if (seq & 1) continue;
+		AE_LOAD_RELAXED(e->clock.frames, c->frames);
+		AE_LOAD_RELAXED(e->clock.position, c->position);
+		AE_LOAD_RELAXED(e->clock.stream_time, c->stream_time);
+		AE_LOAD_RELAXED(e->clock.timestamp, c->timestamp);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&e->clock.seq, __ATOMIC_RELAXED) == seq) {
+			c->seq = seq;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void audio_engine_xrun(audio_engine_t *e, int underruns, int overruns) {
+	if (underruns) AE_STORE(e->stats.underruns, e->stats.underruns + underruns);
+	if (overruns) AE_STORE(e->stats.overruns, e->stats.overruns + overruns);
+}
+
+/* audio thread: deal with a look-ahead that didn't have enough frames
+   for the whole buffer and ask R for more. Returns the number of frames
+   to pad with silence. */
+static unsigned int stream_check(audio_engine_t *e, unsigned int done, unsigned int frames) {
+	ae_stream_t *s = e->stream;
+	unsigned int pad = 0;
+	if (done < frames && (!AE_LOAD(s->eof) || AE_LOAD(s->wr) != s->rd)) {
+		/* starved, keep the device running with silence */
+		s->starved++;
+		s->starved_frames += frames - done;
+		pad = frames - done;
+	}
+	if (AE_LOAD(s->wr) - s->rd < s->size / 2 && !AE_LOAD(s->eof) && !AE_XCHG(s->requested, 1)) {
+		if (s->reader)
+			s->reader->wake(s->reader);
+		else
+			wakeup(e);
+	}
+	return pad;
+}
+
+/* the buffer is filled across loop boundaries, so only a short count
+   signals the end of the play region */
+unsigned int audio_engine_render_s16(audio_engine_t *e, short *out, unsigned int frames) {
+	unsigned int done = 0, chs = e->chs, run;
+	int dmode = AE_LOAD(e->dither.mode);
+	update_filters(e);
+	run_commands(e);
+	if (e->stopped)
+		return 0;
+	if (e->paused) {
+		memset(out, 0, sizeof(short) * frames * chs);
+		e->frames_total += frames;
+		return frames;
+	}
+	while (done < frames && (run = next_run(e, frames - done)) > 0) {
+		unsigned long long index = e->position;
+		short *o = out + done * chs;
+		if (!e->filters && dmode == DITHER_NONE && !(e->loop && e->xfade) && !e->stream &&
+			e->gain == 1.0 && e->gain_target == 1.0) {
+			unsigned int samples = run * chs; /* samples (i.e. SInt16s) */
+			short *iBuf = o, *sentinel = iBuf + samples;
+			if (TYPEOF(e->source) == INTSXP) {
+				int *iSrc = INTEGER(e->source) + (size_t) index * chs;
+				while (iBuf < sentinel)
+					*(iBuf++) = (short) *(iSrc++);
+			} else if (TYPEOF(e->source) == REALSXP) {
+				double *iSrc = REAL(e->source) + (size_t) index * chs;
+				while (iBuf < sentinel)
+					*(iBuf++) = (short) (32767.0 * (*(iSrc++)));
+			} else /* not reached: streams never take this path */
+				memset(o, 0, sizeof(short) * samples);
+		} else {
+			unsigned int bd = 0;
+			while (bd < run) {
+				unsigned int n = run - bd, t, c;
+				const double *b = e->buf;
+				if (n > AE_BLOCK) n = AE_BLOCK;
+				fetch_block(e, index + bd, n);
+				apply_gain(e, e->buf, n);
+				if (e->filters)
+					filter_chain_process(e->filters, e->buf, n);
+				if (dmode == DITHER_NONE) {
+					unsigned int i, samples = n * chs;
+					for (i = 0; i < samples; i++) {
+						/* filters can overshoot, so clamp */
+						double v = 32767.0 * b[i];
+						v = (v > 32767.0) ? 32767.0 : ((v < -32768.0) ? -32768.0 : v);
+						o[i] = (short) v;
+					}
+					o += samples;
+				} else
+					for (t = 0; t < n; t++)
+						for (c = 0; c < chs; c++, b++)
+							*(o++) = (short) dither_quantize(&e->dither, *b, c, 32767.0, -32768.0, 32767.0);
+				bd += n;
+			}
+		}
+		e->position += run;
+		done += run;
+	}
+	if (e->stream && (run = stream_check(e, done, frames))) {
+		memset(out + done * chs, 0, sizeof(short) * run * chs);
+		done += run;
+	}
+	e->frames_total += done;
+	return done;
+}
+
+/* silence in frames [from, from + n) of interleaved or planar output */
+static void zero_f32(float *out, float **planar, unsigned int chs, unsigned int from, unsigned int n) {
+	unsigned int c;
+	if (!planar)
+		memset(out + from * chs, 0, sizeof(float) * n * chs);
+	else
+		for (c = 0; c < chs; c++)
+			memset(planar[c] + from, 0, sizeof(float) * n);
+}
+
+/* float output is either interleaved (out) or one buffer per channel (planar) */
+static unsigned int render_f32(audio_engine_t *e, float *out, float **planar, unsigned int frames) {
+	unsigned int done = 0, chs = e->chs, run;
+	update_filters(e);
+	run_commands(e);
+	if (e->stopped)
+		return 0;
+	if (e->paused) {
+		zero_f32(out, planar, chs, 0, frames);
+		e->frames_total += frames;
+		return frames;
+	}
+	while (done < frames && (run = next_run(e, frames - done)) > 0) {
+		unsigned long long index = e->position;
+		unsigned int bd = 0;
+		float *o = planar ? 0 : (out + done * chs);
+		while (bd < run) {
+			unsigned int n = run - bd, i, c, samples;
+			if (n > AE_BLOCK) n = AE_BLOCK;
+			samples = n * chs;
+			fetch_block(e, index + bd, n);
+			apply_gain(e, e->buf, n);
+			if (e->filters)
+				filter_chain_process(e->filters, e->buf, n);
+			if (planar)
+				for (c = 0; c < chs; c++) {
+					float *p = planar[c] + done + bd;
+					for (i = c; i < samples; i += chs)
+						*(p++) = (float) e->buf[i];
+				}
+			else
+				for (i = 0; i < samples; i++)
+					*(o++) = (float) e->buf[i];
+			bd += n;
+		}
+		e->position += run;
+		done += run;
+	}
+	if (e->stream && (run = stream_check(e, done, frames))) {
+		zero_f32(out, planar, chs, done, run);
+		done += run;
+	}
+	e->frames_total += done;
+	return done;
+}
+
+unsigned int audio_engine_render_f32(audio_engine_t *e, float *out, unsigned int frames) {
+	return render_f32(e, out, 0, frames);
+}
+
+unsigned int audio_engine_render_planar(audio_engine_t *e, float **out, unsigned int frames) {
+	return render_f32(e, 0, out, frames);
+}
+
+/* audio thread: space for up to *n frames in the current chunk, 0 if
+   the pool is exhausted (R hasn't serviced the engine in time) */
+static double *chunk_space(audio_engine_t *e, unsigned int *n) {
+	ae_chunks_t *c = e->chunks;
+	ae_chunk_t *cur = c->current;
+	if (!cur || cur->frames == AE_CHUNK_FRAMES) {
+		if (cur) {
+			/* the ring can hold the whole pool, so it never overflows */
+			c->full[c->full_wr % AE_CHUNK_RING] = cur;
+			AE_STORE(c->full_wr, c->full_wr + 1);
+		}
+		if (c->free_rd == AE_LOAD(c->free_wr)) {
+			AE_STORE(c->current, (ae_chunk_t*) 0);
+			return 0;
+		}
+		cur = c->free[c->free_rd % AE_CHUNK_RING];
+		AE_STORE(c->free_rd, c->free_rd + 1);
+		cur->frames = 0;
+		cur->seq = c->seq++;
+		AE_STORE(c->current, cur);
+		/* ask R to move the completed chunk and replace the used one */
+		if (!AE_XCHG(c->requested, 1))
+			wakeup(e);
+	}
+	if (*n > AE_CHUNK_FRAMES - cur->frames)
+		*n = AE_CHUNK_FRAMES - cur->frames;
+	return cur->data + (size_t) cur->frames * e->chs;
+}
+
+/* audio thread: space for up to *n frames at the current position of
+   the target or chunk, 0 if there is none (dropped input is counted) */
+static double *reserve(audio_engine_t *e, unsigned int *n, unsigned int wanted) {
+	double *d;
+	if (e->length - e->position < *n) *n = (unsigned int) (e->length - e->position);
+	if (!e->chunks)
+		return REAL(e->source) + (size_t) e->position * e->chs;
+	if (!(d = chunk_space(e, n)))
+		AE_STORE(e->chunks->dropped, e->chunks->dropped + wanted);
+	return d;
+}
+
+/* audio thread: the reserved frames have been written */
+static void commit(audio_engine_t *e, unsigned int n) {
+	if (e->chunks) /* publish the frames to collect() */
+		AE_STORE(e->chunks->current->frames, e->chunks->current->frames + n);
+	AE_STORE(e->position, e->position + n);
+}
+
+/* audio thread: append processed frames, returns the number stored */
+static unsigned int store(audio_engine_t *e, const double *d, unsigned int frames) {
+	unsigned int done = 0, n;
+	double *to;
+	while (done < frames && e->position < e->length) {
+		n = frames - done;
+		if (!(to = reserve(e, &n, frames - done)))
+			break;
+		memcpy(to, d + (size_t) done * e->chs, sizeof(double) * n * e->chs);
+		commit(e, n);
+		done += n;
+	}
+	return done;
+}
+
+/* audio thread: store the pre-roll (oldest first) and open a segment */
+static void trigger_open(audio_engine_t *e) {
+	ae_trigger_t *t = e->trigger;
+	unsigned int first = (t->ring_pos + t->preroll - t->ring_fill) % (t->preroll ? t->preroll : 1), n;
+	t->cur.input = t->input - t->ring_fill;
+	t->cur.start = e->position;
+	t->cur.frames = 0;
+	t->cur.timestamp = audio_engine_clock() - (double) t->ring_fill / (double) e->rate;
+	AE_STORE(t->active, 1);
+	if (t->ring_fill) {
+		n = t->preroll - first;
+		if (n > t->ring_fill) n = t->ring_fill;
+		store(e, t->ring + (size_t) first * e->chs, n);
+		if (n < t->ring_fill)
+			store(e, t->ring, t->ring_fill - n);
+	}
+	t->ring_fill = t->ring_pos = 0;
+}
+
+static void trigger_close(audio_engine_t *e) {
+	ae_trigger_t *t = e->trigger;
+	t->cur.frames = e->position - t->cur.start;
+	if (t->seg_wr - AE_LOAD(t->seg_rd) < AE_SEGMENT_RING) {
+		t->seg[t->seg_wr % AE_SEGMENT_RING] = t->cur;
+		AE_STORE(t->seg_wr, t->seg_wr + 1);
+	} else
+		AE_STORE(t->lost, t->lost + 1);
+	AE_STORE(t->active, 0);
+	if (t->seg_wr - AE_LOAD(t->seg_rd) > AE_SEGMENT_RING / 2)
+		wakeup(e);
+}
+
+/* audio thread: keep the last `preroll' frames */
+static void preroll_push(ae_trigger_t *t, const double *d, unsigned int n, unsigned int chs) {
+	unsigned int k;
+	if (!t->preroll) return;
+	if (n > t->preroll) {
+		d += (size_t) (n - t->preroll) * chs;
+		n = t->preroll;
+	}
+	while (n) {
+		k = t->preroll - t->ring_pos;
+		if (k > n) k = n;
+		memcpy(t->ring + (size_t) t->ring_pos * chs, d, sizeof(double) * k * chs);
+		t->ring_pos = (t->ring_pos + k) % t->preroll;
+		t->ring_fill = (t->ring_fill + k > t->preroll) ? t->preroll : (t->ring_fill + k);
+		d += (size_t) k * chs;
+		n -= k;
+	}
+}
+
+static unsigned int trigger_capture(audio_engine_t *e, const double *in, unsigned int frames) {
+	ae_trigger_t *t = e->trigger;
+	unsigned int done = 0, chs = e->chs;
+	while (done < frames && e->position < e->length) {
+		unsigned int n = frames - done, i, ns;
+		double ms = 0.0, *d = t->blk;
+		if (n > AE_BLOCK) n = AE_BLOCK;
+		ns = n * chs;
+		memcpy(d, in + (size_t) done * chs, sizeof(double) * ns);
+		apply_gain(e, d, n);
+		/* the level is measured after the filters, so e.g. a highpass
+		   keeps rumble from triggering */
+		if (e->filters)
+			filter_chain_process(e->filters, d, n);
+		for (i = 0; i < ns; i++)
+			ms += d[i] * d[i];
+		ms /= (double) ns;
+		if (ms >= t->threshold) {
+			if (!t->active)
+				trigger_open(e);
+			t->hang_left = t->hang;
+			store(e, d, n);
+		} else if (t->active) {
+			store(e, d, n);
+			if (t->hang_left <= n)
+				trigger_close(e);
+			else
+				t->hang_left -= n;
+		} else
+			preroll_push(t, d, n, chs);
+		t->input += n;
+		e->frames_total += n;
+		done += n;
+	}
+	return done;
+}
+
+unsigned int audio_engine_capture(audio_engine_t *e, const double *in, unsigned int frames) {
+	unsigned int n, done = 0;
+	double *d;
+	update_filters(e);
+	run_commands(e);
+	/* input is dropped while paused */
+	if (e->stopped || e->paused || TYPEOF(e->source) != REALSXP || e->position >= e->length)
+		return 0;
+	if (e->trigger)
+		return trigger_capture(e, in, frames);
+	while (done < frames && e->position < e->length) {
+		n = frames - done;
+		if (!(d = reserve(e, &n, frames - done)))
+			break;
+		memcpy(d, in + (size_t) done * e->chs, sizeof(double) * n * e->chs);
+		apply_gain(e, d, n);
+		/* filter the captured frames in-place in the target */
+		if (e->filters)
+			filter_chain_process(e->filters, d, n);
+		commit(e, n);
+		e->frames_total += n;
+		done += n;
+	}
+	return done;
+}
+
+void audio_engine_set_dither(audio_engine_t *e, int mode) {
+	AE_STORE(e->dither.mode, mode);
+}
+
+void audio_engine_rewind(audio_engine_t *e) {
+	/* seek to the start (clamped to the play region) */
+	audio_engine_post(e, AE_CMD_SEEK, 0, 0, 0, 0, 0.0);
+}
+
+void audio_engine_sync(audio_engine_t *e) {
+	run_commands(e);
+}
@@ -0,0 +1,381 @@
+/* Shared playback/capture engine used by the audio drivers
+   audio R package
+   Copyright(c) 2026 Simon Urbanek
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation
+   files (the "Software"), to deal in the Software without
+   restriction, including without limitation the rights to use, copy,
+   modify, merge, publish, distribute, sublicense, and/or sell copies
+   of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   * The above copyright notice and this permission notice shall be
+     included in all copies or substantial portions of the Software.
+ 
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND ON
+   INFRINGEMENT. 
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR
+   ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+   CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+   WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ 
+   The text above constitutes the entire license; however, the
+   PortAudio community also makes the following non-binding requests:
+
+   * Any person wishing to distribute modifications to the Software is
+     requested to send the modifications to the original developer so
+     that they can be incorporated into the canonical version. It is
+     also requested that these non-binding requests be included along
+     with the license above.
+
+ */
+
+#ifndef AUDIO_ENGINE_H__
+#define AUDIO_ENGINE_H__
+
+#include "driver.h"
+#include "filter.h"
+#include "dither.h"
+
+/* The engine holds everything about an audio instance that does not
+   depend on the device: the source/target, the current position and
+   the processing applied to the samples. Drivers call the render and
+   capture functions from their callbacks and only deal with the device
+   itself. Fields marked (audio) are owned by the audio thread once the
+   instance is started, fields marked (R) are only touched by the R
+   thread, all others are exchanged atomically. */
+
+/* frames processed at once */
+#define AE_BLOCK        512
+/* maximal number of channels supported by the engine */
+#define AE_MAX_CHANNELS 8
+
+#if AE_MAX_CHANNELS > DITHER_MAX_CHANNELS
+#error "the dither state must cover all engine channels"
+#endif
+
+/* we use the GCC/clang __atomic built-ins which are supported by all
+   compilers R can be built with */
+#define AE_LOAD(X)     __atomic_load_n(&(X), __ATOMIC_ACQUIRE)
+#define AE_STORE(X, V) __atomic_store_n(&(X), (V), __ATOMIC_RELEASE)
+#define AE_XCHG(X, V)  __atomic_exchange_n(&(X), (V), __ATOMIC_ACQ_REL)
+#define AE_CAS(X, E, V) __atomic_compare_exchange_n(&(X), &(E), (V), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+
+/* Control commands are posted by R into a single-producer,
+   single-consumer ring and executed by the audio thread at the top of
+   the next callback, so changes of the transport state are atomic with
+   respect to the rendered blocks. */
+#define AE_CMD_SEEK    1 /* a = frame */
+#define AE_CMD_REGION  2 /* a = start, b = end (exclusive) */
+#define AE_CMD_LOOP    3 /* flag = enable, a = start, b = end (exclusive), c = crossfade frames */
+#define AE_CMD_PAUSE   4 /* render silence without advancing */
+#define AE_CMD_RESUME  5
+#define AE_CMD_GAIN    6 /* value = linear gain, ramped over one block */
+#define AE_CMD_STOP    7 /* end the playback/recording */
+
+/* must be a power of 2 */
+#define AE_QUEUE_SIZE  64
+
+typedef struct ae_command {
+	int op, flag;
+	unsigned long long a, b;    /* frames */
+	unsigned int c;
+	double value;
+} ae_command_t;
+
+/* Players can queue further sources which are played gaplessly once
+   the current one ends. R appends at `last', the audio thread advances
+   `playing' and hands finished entries back via `played' so that R can
+   release them (it cannot touch R objects itself). */
+typedef struct ae_entry {
+	SEXP source;
+	unsigned long long length; /* in frames */
+	struct ae_entry *next;  /* next entry to play, set by R */
+	struct ae_entry *next_played;
+} ae_entry_t;
+
+/* Sources that are R functions are called by R on the main thread
+   (via the event loop or while waiting) to fill a look-ahead ring
+   which is consumed by the audio thread. The function is called with
+   the number of frames requested and returns the next block, NULL or
+   an empty vector ends the stream. */
+struct ae_stream;
+
+/* The look-ahead can also be filled by a reader thread instead of R
+   (e.g. from a file, see filestream.c). Such sources are external
+   pointers tagged "audio.reader", the engine takes over the reader
+   when it is created. The reader fills the ring and sets eof at the
+   end just like stream_fill() does. */
+typedef struct ae_reader {
+	int chs;                    /* channels of the source */
+	unsigned int lookahead;     /* size of the ring in frames */
+	/* (R) start filling the ring, returns 0 on failure */
+	int (*start)(struct ae_reader *r, struct ae_stream *s);
+	/* (audio) the ring is less than half full, must not block */
+	void (*wake)(struct ae_reader *r);
+	/* (R) stop and free the reader, the audio thread is gone */
+	void (*close)(struct ae_reader *r);
+} ae_reader_t;
+
+typedef struct ae_stream {
+	double *ring;               /* interleaved frames */
+	unsigned int size;          /* capacity in frames */
+	unsigned int wr;            /* frames written so far (R) */
+	unsigned int rd;            /* frames read so far (audio) */
+	int eof;                    /* (R) the function has ended the stream */
+	int requested;              /* refill requested by the audio thread */
+	unsigned int starved;       /* (audio) callbacks that ran out of data */
+	unsigned int starved_frames;/* (audio) frames of silence inserted */
+	ae_reader_t *reader;        /* fills the ring instead of R */
+	SEXP pending;               /* (R) preserved result that did not fit into the ring */
+	unsigned int pending_at;    /* (R) first frame of pending not yet in the ring */
+} ae_stream_t;
+
+/* Open-ended recordings (APFLAG_UNBOUNDED) are captured into chunks
+   instead of the target. The audio thread takes empty chunks from a
+   pool which R keeps topped up and hands full ones back, R links them
+   into the list of completed chunks. Nothing is allocated or freed by
+   the audio thread and R can read the recording at any time. */
+#define AE_CHUNK_FRAMES 16384
+#define AE_CHUNK_POOL   8
+#define AE_CHUNK_RING   16  /* must hold the whole pool */
+#define AE_UNBOUNDED    0xffffffffffffffffull /* length of open-ended targets */
+
+typedef struct ae_chunk {
+	unsigned int frames;        /* frames stored, published by the audio thread */
+	unsigned int seq;           /* (audio) index of the chunk in the recording */
+	struct ae_chunk *next;      /* (R) next completed chunk */
+	double data[1];             /* interleaved frames, AE_CHUNK_FRAMES long */
+} ae_chunk_t;
+
+/* Instead of being kept, completed chunks can be passed to a sink (e.g.
+   an encoder writing a file). R calls `write' while servicing the
+   engine, the sink owns the chunk from then on and releases it with
+   free(). `close' is called by R after the audio thread has stopped,
+   it gets the partially filled last chunk (if any), finishes the
+   output and frees the sink. Both return 0 on failure. */
+typedef struct ae_sink {
+	int (*write)(struct ae_sink *s, struct ae_chunk *chunk);
+	int (*close)(struct ae_sink *s, struct ae_chunk *last);
+	const char *name;           /* description used in messages (e.g. the file name) */
+} ae_sink_t;
+
+typedef struct ae_chunks {
+	ae_chunk_t *free[AE_CHUNK_RING]; /* empty chunks */
+	unsigned int free_wr;       /* (R) */
+	unsigned int free_rd;       /* (audio) */
+	ae_chunk_t *full[AE_CHUNK_RING]; /* completed chunks not yet in the list */
+	unsigned int full_wr;       /* (audio) */
+	unsigned int full_rd;       /* (R) */
+	ae_chunk_t *current;        /* chunk being filled */
+	unsigned int seq;           /* (audio) next chunk index */
+	int requested;              /* service requested by the audio thread */
+	unsigned int dropped;       /* (audio) frames dropped because the pool was empty */
+	ae_chunk_t *head, *tail;    /* (R) completed chunks */
+	unsigned int count;         /* (R) number of completed chunks */
+	unsigned long long frames;  /* (R) frames in completed chunks */
+	ae_sink_t *sink;            /* (R) receives completed chunks instead of the list */
+	int sink_error;             /* (R) the sink has failed */
+} ae_chunks_t;
+
+/* Triggered recorders only store input while its level is above a
+   threshold. The mean square of each block (after gain and filters) is
+   compared with the threshold, blocks below it are kept in a pre-roll
+   ring which is stored in front of the block that opens a segment. A
+   segment is closed once the level has stayed below the threshold for
+   the hang time. Closed segments are reported to R via a ring. */
+#define AE_SEGMENT_RING 64
+
+typedef struct ae_segment {
+	unsigned long long input;   /* first frame in the input (including skipped frames) */
+	unsigned long long start;   /* first frame in the recording */
+	unsigned long long frames;  /* length in frames */
+	double timestamp;           /* audio_engine_clock() time of the first frame */
+} ae_segment_t;
+
+typedef struct ae_trigger {
+	double threshold;           /* mean square level */
+	unsigned int preroll, hang; /* in frames */
+	double *ring;               /* (audio) pre-roll frames */
+	unsigned int ring_pos, ring_fill; /* (audio) */
+	unsigned int hang_left;     /* (audio) */
+	unsigned long long input;   /* (audio) input frames so far */
+	int active;                 /* a segment is open */
+	ae_segment_t cur;           /* the open segment, valid while active */
+	ae_segment_t seg[AE_SEGMENT_RING]; /* closed segments not yet seen by R */
+	unsigned int seg_wr;        /* (audio) */
+	unsigned int seg_rd;        /* (R) */
+	unsigned int lost;          /* (audio) segments not reported because the ring was full */
+	ae_segment_t *list;         /* (R) closed segments */
+	unsigned int count, size;   /* (R) */
+	double blk[AE_BLOCK * AE_MAX_CHANNELS]; /* (audio) scratch */
+} ae_trigger_t;
+
+/* Callback statistics, written by the audio thread only and read by R
+   without locking (each counter is read atomically, but a snapshot
+   can mix counters of adjacent callbacks). Durations are in ns. */
+#define AE_HIST_BUCKETS 16 /* bucket 0: < 1us, k: [2^(k-1), 2^k) us, last: everything above */
+
+typedef struct ae_stats {
+	unsigned int callbacks;
+	unsigned int underruns;     /* output underflows reported by the device */
+	unsigned int overruns;      /* input overflows reported by the device */
+	unsigned int late;          /* callbacks that took longer than their period */
+	unsigned long long time_sum;
+	unsigned int time_min, time_max;
+	int headroom;               /* smallest (period - duration) / period in 1/10000 */
+	unsigned int hist[AE_HIST_BUCKETS];
+} ae_stats_t;
+
+/* Clock snapshot published by the audio thread at the start of each
+   callback. It is guarded by a sequence counter which is odd during
+   updates, readers retry instead of locking so the audio thread never
+   waits for R. */
+typedef struct ae_clock {
+	unsigned int seq;
+	unsigned long long frames; /* frames processed before this callback */
+	unsigned long long position; /* position in the current source */
+	double stream_time;        /* device time of the first frame of the buffer, NaN if unknown */
+	double timestamp;          /* audio_engine_clock() in the callback */
+} ae_clock_t;
+
+typedef struct audio_engine {
+	SEXP source;            /* source (player) or target (recorder), (audio) for queued players */
+	float rate;
+	int chs;                /* channels per frame */
+	/* frame counts are 64-bit so long recordings and sources don't wrap */
+	unsigned long long position; /* (audio) current position in frames */
+	unsigned long long length;   /* (audio) length of the source/target in frames */
+	unsigned long long region_start, region_end; /* (audio) play region [start, end) */
+	int loop;                                    /* (audio) loop between loop_start and loop_end */
+	unsigned long long loop_start, loop_end;     /* (audio) loop points [start, end) within the region */
+	unsigned int xfade;                          /* (audio) loop crossfade length in frames */
+	int paused, stopped;    /* (audio) */
+	double gain, gain_target; /* (audio) */
+	ae_command_t cmd[AE_QUEUE_SIZE];
+	unsigned int cmd_head;  /* next slot to write (R) */
+	unsigned int cmd_tail;  /* next slot to execute (audio) */
+	ae_stream_t *stream;    /* look-ahead if the source is a function or reader */
+	ae_chunks_t *chunks;    /* chunked storage of open-ended recordings */
+	ae_trigger_t *trigger;  /* level-triggered recording */
+	int wake_fd[2];         /* pipe to request service from R (unix only) */
+	void *wake_handler;     /* input handler (unix only) */
+	ae_stats_t stats;       /* (audio) callback statistics */
+	unsigned long long frames_total; /* (audio) frames rendered or captured so far */
+	int io_offset;          /* (audio) full-duplex capture: frames between output and input */
+	ae_clock_t clock;       /* (audio) published clock */
+	ae_entry_t first;       /* entry of the initial source */
+	ae_entry_t *playing;    /* (audio) entry currently playing */
+	ae_entry_t *last;       /* (R) last entry of the queue */
+	ae_entry_t *played;     /* finished entries to be released by R */
+	audio_filter_chain_t *filters;  /* (audio) chain currently applied */
+	audio_filter_chain_t *pending;  /* chain to be picked up by the audio thread */
+	audio_filter_chain_t *retired;  /* chains released by the audio thread, freed by R */
+	dither_t dither;                /* requantization to integer output formats, mode is set by R */
+	double buf[AE_BLOCK * AE_MAX_CHANNELS]; /* (audio) scratch buffer */
+} audio_engine_t;
+
+/* create an engine for the given source/target. If chs is 0 the number
+   of channels is inferred from the source (matrix with 2 rows is
+   stereo, anything else mono, functions use their "channels"
+   attribute, readers their own). The look-ahead of function sources
+   is set by their "lookahead" attribute (in frames) and is filled
+   before returning. Raises an R error on failure. */
+audio_engine_t *audio_engine_new(SEXP source, float rate, int chs, int flags);
+/* (R) the reader of a reader source (see ae_reader_t), NULL for other
+   sources. Raises an R error if the reader has been used already. */
+ae_reader_t *audio_engine_reader(SEXP source);
+/* the audio thread must not use the engine anymore */
+void audio_engine_free(audio_engine_t *e);
+
+/* players: render up to `frames' frames into the buffer and return the
+   number of frames rendered. Loops are rendered seamlessly, so fewer
+   than `frames' frames means that the end of the play region has been
+   reached (0 if it was reached already or the engine was stopped).
+   A paused engine renders silence. */
+unsigned int audio_engine_render_s16(audio_engine_t *e, short *out, unsigned int frames);
+unsigned int audio_engine_render_f32(audio_engine_t *e, float *out, unsigned int frames);
+/* the same with one buffer per channel (e.g. the port buffers of JACK) */
+unsigned int audio_engine_render_planar(audio_engine_t *e, float **out, unsigned int frames);
+
+/* recorders: store interleaved frames (with e->chs channels) into the
+   target, returns the number of frames stored. The target is full once
+   position reaches length (never for open-ended recordings). */
+unsigned int audio_engine_capture(audio_engine_t *e, const double *in, unsigned int frames);
+
+/* (R) open-ended recordings: the frames captured so far as an
+   audioSample (matrix with one row per channel if chs > 1) */
+SEXP audio_engine_collect(audio_engine_t *e);
+
+/* (R) stream an open-ended recording into a sink (see ae_sink_t)
+   instead of keeping it in memory. Must be called before the instance
+   is started. The engine owns the sink. */
+void audio_engine_set_sink(audio_engine_t *e, ae_sink_t *sink);
+/* (R) finish the sink once the audio thread has stopped using the
+   engine (e.g. after the driver has closed the instance), returns 0 if
+   the sink has failed at any point. Does nothing without a sink. */
+int audio_engine_close_sink(audio_engine_t *e);
+
+/* (R) make a recorder triggered: threshold is the mean square level,
+   pre-roll and hang time are in frames. Must be called before the
+   instance is started. Raises an R error on failure. */
+void audio_engine_set_trigger(audio_engine_t *e, double threshold, unsigned int preroll, unsigned int hang);
+/* (R) segments recorded so far (closed ones first), the length of the
+   open segment is its length so far. Returns the number of segments
+   and sets *open if the last one is still open. The array is valid
+   until the next call. */
+unsigned int audio_engine_segments(audio_engine_t *e, ae_segment_t **seg, int *open);
+
+/* seek to the start of the play region. Like all commands it takes
+   effect when the audio thread next renders or captures, see
+   audio_engine_sync() for drivers that are idle at that point. */
+void audio_engine_rewind(audio_engine_t *e);
+/* execute pending commands now. Called by the audio thread if it skips
+   rendering/capturing (e.g. a full recorder), or by R while the audio
+   thread is known not to use the engine (e.g. all buffers of a
+   completed playback have been returned). */
+void audio_engine_sync(audio_engine_t *e);
+
+/* (R) post a control command (AE_CMD_*), returns 0 if the queue is full */
+int audio_engine_post(audio_engine_t *e, int op, int flag, unsigned long long a, unsigned long long b, unsigned int c, double value);
+
+/* (R) append a source (with the same number of channels) to the play
+   queue, it is preserved until it has been played. Returns the number
+   of queued entries that have not started playing yet. */
+int audio_engine_enqueue(audio_engine_t *e, SEXP source);
+/* (R) number of queued entries that have not started playing yet */
+int audio_engine_queued(audio_engine_t *e);
+
+/* monotonic clock in seconds */
+double audio_engine_clock(void);
+
+/* drivers: report the start (as returned by audio_engine_clock()) and
+   the number of frames of a completed callback and any xruns the
+   device has signalled */
+void audio_engine_callback_done(audio_engine_t *e, double start, unsigned int frames);
+void audio_engine_xrun(audio_engine_t *e, int underruns, int overruns);
+
+/* drivers: publish the clock at the start of a callback, stream_time
+   is the device time at which the first frame of the buffer is played
+   (or was captured), NaN if the device doesn't provide it */
+void audio_engine_timestamp(audio_engine_t *e, double stream_time);
+/* (R) read a consistent copy of the clock, returns 0 if the audio
+   thread kept updating it */
+int audio_engine_read_clock(audio_engine_t *e, ae_clock_t *c);
+
+/* (R) refill the look-ahead of function sources, move completed
+   chunks of open-ended recordings and closed segments of triggered
+   recordings. Drivers call this while waiting. */
+void audio_engine_service(audio_engine_t *e);
+
+/* set the dither mode (DITHER_*) used for integer output */
+void audio_engine_set_dither(audio_engine_t *e, int mode);
+
+/* (R) replace the filter chain (NULL to remove), the previous one is
+   released once the audio thread has stopped using it */
+void audio_engine_set_filters(audio_engine_t *e, audio_filter_chain_t *fc);
+
+#endif
@@ -0,0 +1,104 @@
+/* Radix-2 FFT used by the filter and analysis code
+   audio R package
+   Copyright(c) 2026 Simon Urbanek
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation
+   files (the "Software"), to deal in the Software without
+   restriction, including without limitation the rights to use, copy,
+   modify, merge, publish, distribute, sublicense, and/or sell copies
+   of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   * The above copyright notice and this permission notice shall be
+     included in all copies or substantial portions of the Software.
+ 
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND ON
+   INFRINGEMENT. 
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR
+   ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+   CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+   WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ 
+   The text above constitutes the entire license; however, the
+   PortAudio community also makes the following non-binding requests:
+
+   * Any person wishing to distribute modifications to the Software is
+     requested to send the modifications to the original developer so
+     that they can be incorporated into the canonical version. It is
+     also requested that these non-binding requests be included along
+     with the license above.
+
+ */
+
+#include <stdlib.h>
+#include <math.h>
+#include "fft.h"
+
+#ifndef M_PI
+#define M_PI 3.141592653589793238462643383280
+#endif
+
+fft_plan_t *fft_plan_new(unsigned int n) {
+	fft_plan_t *plan;
+	unsigned int i, log2n = 0;
+	if (n < 2 || (n & (n - 1))) return 0;
+	while ((1u << log2n) < n) log2n++;
+	plan = (fft_plan_t*) calloc(1, sizeof(fft_plan_t));
+	if (!plan) return 0;
+	plan->n = n;
+	plan->log2n = log2n;
+	plan->cs = (double*) malloc(sizeof(double) * (n / 2));
+	plan->sn = (double*) malloc(sizeof(double) * (n / 2));
+	plan->rev = (unsigned int*) malloc(sizeof(unsigned int) * n);
+	if (!plan->cs || !plan->sn || !plan->rev) {
+		fft_plan_free(plan);
+		return 0;
+	}
+	for (i = 0; i < n / 2; i++) {
+		plan->cs[i] = cos(2.0 * M_PI * (double) i / (double) n);
+		plan->sn[i] = sin(2.0 * M_PI * (double) i / (double) n);
+	}
+	for (i = 0; i < n; i++) {
+		unsigned int j, r = 0;
+		for (j = 0; j < log2n; j++)
+			if (i & (1u << j)) r |= 1u << (log2n - 1 - j);
+		plan->rev[i] = r;
+	}
+	return plan;
+}
+
+void fft_plan_free(fft_plan_t *plan) {
+	if (!plan) return;
+	free(plan->cs);
+	free(plan->sn);
+	free(plan->rev);
+	free(plan);
+}
+
+void fft_transform(const fft_plan_t *plan, double *re, double *im, int inverse) {
+	unsigned int n = plan->n, i, j, size;
+	for (i = 0; i < n; i++) {
+		unsigned int r = plan->rev[i];
+		if (r > i) {
+			double t = re[i]; re[i] = re[r]; re[r] = t;
+			t = im[i]; im[i] = im[r]; im[r] = t;
+		}
+	}
+	for (size = 2; size <= n; size <<= 1) {
+		unsigned int half = size / 2, step = n / size;
+		for (i = 0; i < n; i += size)
+			for (j = 0; j < half; j++) {
+				unsigned int a = i + j, b = a + half;
+				double wr = plan->cs[j * step], wi = inverse ? plan->sn[j * step] : -plan->sn[j * step];
+				double tr = wr * re[b] - wi * im[b];
+				double ti = wr * im[b] + wi * re[b];
+				re[b] = re[a] - tr;
+				im[b] = im[a] - ti;
+				re[a] += tr;
+				im[a] += ti;
+			}
+	}
+}
@@ -0,0 +1,57 @@
+/* Radix-2 FFT used by the filter and analysis code
+   audio R package
+   Copyright(c) 2026 Simon Urbanek
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation
+   files (the "Software"), to deal in the Software without
+   restriction, including without limitation the rights to use, copy,
+   modify, merge, publish, distribute, sublicense, and/or sell copies
+   of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   * The above copyright notice and this permission notice shall be
+     included in all copies or substantial portions of the Software.
+ 
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND ON
+   INFRINGEMENT. 
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR
+   ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+   CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+   WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ 
+   The text above constitutes the entire license; however, the
+   PortAudio community also makes the following non-binding requests:
+
+   * Any person wishing to distribute modifications to the Software is
+     requested to send the modifications to the original developer so
+     that they can be incorporated into the canonical version. It is
+     also requested that these non-binding requests be included along
+     with the license above.
+
+ */
+
+#ifndef AUDIO_FFT_H__
+#define AUDIO_FFT_H__
+
+/* An FFT plan holds the twiddle factors and bit-reversal table for one
+   size so they can be computed once and shared by all transforms of
+   that size. Plans are read-only after creation, hence they can be
+   used from several threads at once. */
+typedef struct fft_plan {
+	unsigned int n, log2n;
+	double *cs, *sn;     /* cos/sin(2 pi k / n), k < n/2 */
+	unsigned int *rev;   /* bit-reversal permutation */
+} fft_plan_t;
+
+/* n must be a power of two; returns NULL if n is invalid or on allocation failure */
+fft_plan_t *fft_plan_new(unsigned int n);
+void fft_plan_free(fft_plan_t *plan);
+
+/* in-place complex transform of (re, im). The inverse transform is not
+   scaled, i.e., the caller has to divide by n. */
+void fft_transform(const fft_plan_t *plan, double *re, double *im, int inverse);
+
+#endif
@@ -34,6 +34,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define R_NO_REMAP      /* to not pollute the namespace */
@@ -41,6 +42,21 @@
 #include <R.h>
 #include <Rinternals.h>
 
+#include "engine.h" /* AE_LOAD/AE_STORE */
+#include "dither.h"
+
+#if HAS_PTHREAD
+#include <pthread.h>
+#endif
+#ifdef __WIN32__
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/select.h>
+#include <R_ext/eventloop.h>
+#endif
+
 /* WAVE file is essentially a RIFF file, hence the structures */
 
 typedef struct riff_header {
@@ -62,236 +78,689 @@ typedef struct wav_fmt {
 	unsigned short byps, bips;
 } wav_fmt_t;
 
-SEXP load_wave_file(SEXP src)
-{
-	if (Rf_inherits(src, "connection"))
-		Rf_error("sorry, connections are not supported yet");
-	if (TYPEOF(src) != STRSXP || LENGTH(src) < 1)
-		Rf_error("invalid file name");
-	{
-		const char *fName = CHAR(STRING_ELT(src, 0));
-		FILE *f = fopen(fName, "rb");
-		riff_header_t rh;
-		wav_fmt_t fmt;
-		riff_chunk_t rc;
-		unsigned int to_go = 0, has_fmt = 0;
-		SEXP res = R_NilValue;
-		
-		if (!f)
-			Rf_error("unable to open file '%s'", fName);
-		if (fread(&rh, sizeof(rh), 1, f) != 1) {
-			fclose(f);
-			Rf_error("unable to read header from '%s'", fName);
-		}
-		if (memcmp(rh.riff, "RIFF", 4) || memcmp(rh.type, "WAVE", 4)) {
-			fclose(f);
-			Rf_error("not a WAVE format");
+/* samples converted (or written) at once, progress is reported per block */
+#define WAVE_BLOCK 65536
+
+/* The parsing and conversion below doesn't use the R API so it can
+   run on a worker thread for the asynchronous variants. */
+
+/* reads the chunks up to the data chunk and leaves f at its first
+   byte, returns NULL on success or an error message */
+static const char *wave_header(FILE *f, wav_fmt_t *fmt, unsigned int *len) {
+	riff_header_t rh;
+	riff_chunk_t rc;
+	unsigned int to_go = 0, has_fmt = 0;
+	if (fread(&rh, sizeof(rh), 1, f) != 1)
+		return "unable to read header";
+	if (memcmp(rh.riff, "RIFF", 4) || memcmp(rh.type, "WAVE", 4))
+		return "not a WAVE format";
+	to_go = rh.len;
+	while (!feof(f) && to_go >= 8) {
+		int n = (int)fread(&rc, 1, 8, f);
+		if (n < 8)
+			return "incomplete file";
+		to_go -= n;
+		if (!memcmp(rc.rci, "fmt ", 4)) { /* format chunk */
+			if (to_go < 16 || rc.len < 16)
+				return "corrupt file";
+			memcpy(fmt, &rc, 8);
+			n = (int)fread(&fmt->ver, 1, 16, f);
+			if (n < 16)
+				return "incomplete file";
+			to_go -= n;
+			/* skip extensions of the format */
+			if (rc.len > 16) {
+				if (rc.len - 16 > to_go || fseek(f, rc.len - 16, SEEK_CUR))
+					return "incomplete file";
+				to_go -= rc.len - 16;
+			}
+			has_fmt = 1;
+		} else if (!memcmp(rc.rci, "data", 4)) {
+			if (!has_fmt)
+				return "data chunk without preceeding format chunk";
+			*len = rc.len;
+			return 0;
+		} else { /* skip any chunks we don't know */
+			if (rc.len > to_go || fseek(f, rc.len, SEEK_CUR))
+				return "incomplete file";
+			to_go -= rc.len;
 		}
-		to_go = rh.len;
-		while (!feof(f) && to_go >= 8) {
-			int n = (int)fread(&rc, 1, 8, f);
-			if (n < 8) {
-				fclose(f);
-				Rf_error("incomplete file");
+	}
+	return "no data chunk found";
+}
+
+/* converts k samples of `st' bytes each from src to doubles. The
+   conversion runs backwards so src can be the start of d (in-place) */
+static void wave_convert(double *d, const void *src, size_t k, unsigned int st) {
+	long i = (long) k - 1;
+	switch (st) {
+	case 1:
+		{
+			const signed char *ca = (const signed char*) src;
+			while (i >= 0) {
+				signed char c = ca[i];
+				d[i--] = (c < 0)?(((double) c) / 127.0) : (((double) c) / 128.0);
 			}
-			to_go -= n;
-			if (!memcmp(rc.rci, "fmt ", 4)) { /* format chunk */
-				if (to_go < 16) {
-					fclose(f);
-					Rf_error("corrupt file");
-				}
-				memcpy(&fmt, &rc, 8);
-				n = (int)fread(&fmt.ver, 1, 16, f);
-				if (n < 16) {
-					fclose(f);
-					Rf_error("incomplete file");
-				}
-				to_go -= n;
-				has_fmt = 1;
-			} else if (!memcmp(rc.rci, "data", 4)) {
-				unsigned int samples = rc.len;
-				unsigned int st = 1;
-				double *d;
-				if (!has_fmt) {
-					fclose(f);
-					Rf_error("data chunk without preceeding format chunk");
-				}
-				if (fmt.bips == 16) {
-					st = 2; samples /= 2;
-				} else if (fmt.bips == 32) {
-					st = 4; samples /= 4;
-				} else if (fmt.bips != 8) {
-					fclose(f);
-					Rf_error("unsupported smaple width: %d bits", fmt.bips);
-				}
-				res = Rf_allocVector(REALSXP, samples);
-				n = (int)fread(d = REAL(res), st, samples, f);
-				if (n < samples) {
-					fclose(f);
-					Rf_error("incomplete file");
-				}
-				/* now convert the format to doubles, in-place */
-				{
-					int i = n - 1;
-					switch (st) {
-						case 1:
-					    {
-						    signed char *ca = (signed char*) REAL(res);
-						    while (i >= 0) {
-							    signed char c = ca[i];
-							    d[i--] = (c < 0)?(((double) c) / 127.0) : (((double) c) / 128.0);
-						    }
-					    }
-						case 2:
-					    {
-						    short int *sa = (short int*) REAL(res);
-						    while (i >= 0) {
-							    short int s = sa[i];
-							    d[i--] = (s < 0)?(((double) s) / 32767.0) : (((double) s) / 32768.0);
-						    }
-					    }
-						case 4:
-					    {
-						    int *sa = (int*) REAL(res);
-						    while (i >= 0) {
-							    int s = sa[i];
-							    d[i--] = (s < 0)?(((double) s) / 2147483647.0) : (((double) s) / 2147483648.0);
-						    }
-					    }
-					}
-				}
-				n *= st;
-				if (n > to_go) /* it's questionable whether we should bark here - it's file inconsistency to say the least */
-					to_go = 0;
-				else
-					to_go -= n;
-			} else { /* skip any chunks we don't know */
-				if (rc.len > to_go || fseek(f, rc.len, SEEK_CUR)) {
-					fclose(f);
-					Rf_error("incomplete file");
-				}
-				to_go -= rc.len;
+		}
+		break;
+	case 2:
+		{
+			const short int *sa = (const short int*) src;
+			while (i >= 0) {
+				short int s = sa[i];
+				d[i--] = (s < 0)?(((double) s) / 32767.0) : (((double) s) / 32768.0);
 			}
 		}
-		fclose(f);
-		Rf_protect(res);
+		break;
+	case 4:
 		{
-			SEXP sym = Rf_protect(Rf_install("rate"));
-			Rf_setAttrib(res, sym, Rf_ScalarInteger(fmt.rate));
-			Rf_unprotect(1);
-			sym = Rf_protect(Rf_install("bits"));
-			Rf_setAttrib(res, sym, Rf_ScalarInteger(fmt.bips));
-			Rf_unprotect(1);
-			Rf_setAttrib(res, R_ClassSymbol, Rf_mkString("audioSample"));
-			if (fmt.chs > 1) {
-				SEXP dim = Rf_allocVector(INTSXP, 2);
-				INTEGER(dim)[0] = fmt.chs;
-				INTEGER(dim)[1] = LENGTH(res) / fmt.chs;
-				Rf_setAttrib(res, R_DimSymbol, dim);
+			const int *sa = (const int*) src;
+			while (i >= 0) {
+				int s = sa[i];
+				d[i--] = (s < 0)?(((double) s) / 2147483647.0) : (((double) s) / 2147483648.0);
 			}
 		}
-		Rf_unprotect(1);
-		return res;
+		break;
 	}
 }
 
-SEXP save_wave_file(SEXP where, SEXP what) {
-	unsigned int size = LENGTH(what) * 2; /* use 16 bits by default */
-	unsigned int rate = 44100;
-	unsigned int chs = 1;
-	unsigned int bits = 16, bps = 2;
-	
+/* reads `samples' samples of `st' bytes each and converts them to
+   doubles, in-place block by block. Returns the number of samples
+   read, `done' (if not NULL) is updated after each block */
+static size_t wave_read(FILE *f, double *d, size_t samples, unsigned int st, size_t *done) {
+	size_t pos = 0;
+	while (pos < samples) {
+		size_t k = (samples - pos > WAVE_BLOCK) ? WAVE_BLOCK : (samples - pos);
+		double *b = d + pos;
+		k = fread(b, st, k, f);
+		wave_convert(b, b, k, st);
+		pos += k;
+		if (done) AE_STORE(*done, pos);
+		if (!k) break;
+	}
+	return pos;
+}
+
+/* writes the header and the samples, returns NULL or an error message */
+static const char *wave_write(FILE *f, const double *d, size_t n, unsigned int chs, unsigned int rate,
+							  unsigned int bits, dither_t *dth, size_t *done) {
+	unsigned int bps = (bits / 8) * chs;
+	unsigned int size = (unsigned int) (n * (bits / 8));
+	riff_header_t rh = { "RIFF", size + 36, "WAVE" };
+	wav_fmt_t fmt = { "fmt ", 16, 1, (short) chs, rate, rate * bps, (unsigned short) bps, (unsigned short) bits };
+	riff_chunk_t rc = { "data", size };
+	union {
+		signed char c[2048];
+		short int s[2048];
+		int i[2048];
+	} buf;
+	size_t i = 0;
+	unsigned int k = 0;
+	if (fwrite(&rh, sizeof(rh), 1, f) != 1 ||
+		fwrite(&fmt, sizeof(fmt), 1, f) != 1 ||
+		fwrite(&rc, sizeof(rc), 1, f) != 1)
+		return "write error";
+	while (i < n) {
+		if (bits == 8)
+			buf.c[k++] = (signed char) dither_quantize(dth, d[i], i % chs, 127.0, -128.0, 127.0);
+		else if (bits == 16)
+			buf.s[k++] = (short int) dither_quantize(dth, d[i], i % chs, 32767.0, -32768.0, 32767.0);
+		else
+			buf.i[k++] = (int) (d[i] * 2147483647.0);
+		i++;
+		if (k == 2048 || i == n) {
+			if (fwrite(&buf, bits / 8, k, f) != k)
+				return "write error";
+			k = 0;
+			if (done && !(i & (WAVE_BLOCK - 1))) AE_STORE(*done, i);
+		}
+	}
+	if (done) AE_STORE(*done, n);
+	return 0;
+}
+
+static void wave_attributes(SEXP res, const wav_fmt_t *fmt) {
+	SEXP sym = Rf_protect(Rf_install("rate"));
+	Rf_setAttrib(res, sym, Rf_ScalarInteger(fmt->rate));
+	Rf_unprotect(1);
+	sym = Rf_protect(Rf_install("bits"));
+	Rf_setAttrib(res, sym, Rf_ScalarInteger(fmt->bips));
+	Rf_unprotect(1);
+	Rf_setAttrib(res, R_ClassSymbol, Rf_mkString("audioSample"));
+	if (fmt->chs > 1) {
+		SEXP dim = Rf_allocVector(INTSXP, 2);
+		INTEGER(dim)[0] = fmt->chs;
+		INTEGER(dim)[1] = LENGTH(res) / fmt->chs;
+		Rf_setAttrib(res, R_DimSymbol, dim);
+	}
+}
+
+/* opens the file and parses the header, leaves the file at the first sample */
+static FILE *wave_open_file(SEXP src, wav_fmt_t *fmt, unsigned int *len, unsigned int *st) {
+	const char *fName, *err;
+	FILE *f;
+	if (Rf_inherits(src, "connection"))
+		Rf_error("sorry, connections are not supported yet");
+	if (TYPEOF(src) != STRSXP || LENGTH(src) < 1)
+		Rf_error("invalid file name");
+	fName = CHAR(STRING_ELT(src, 0));
+	if (!(f = fopen(fName, "rb")))
+		Rf_error("unable to open file '%s'", fName);
+	if ((err = wave_header(f, fmt, len))) {
+		fclose(f);
+		Rf_error("%s", err);
+	}
+	if (fmt->bips == 16)
+		*st = 2;
+	else if (fmt->bips == 32)
+		*st = 4;
+	else if (fmt->bips == 8)
+		*st = 1;
+	else {
+		fclose(f);
+		Rf_error("unsupported smaple width: %d bits", fmt->bips);
+	}
+	return f;
+}
+
+/* opens the file and parses the header, returns the (unfilled) result vector */
+static SEXP wave_open(SEXP src, FILE **fp, unsigned int *st) {
+	wav_fmt_t fmt;
+	unsigned int len = 0;
+	FILE *f = wave_open_file(src, &fmt, &len, st);
+	SEXP res = Rf_protect(Rf_allocVector(REALSXP, len / *st));
+	wave_attributes(res, &fmt);
+	Rf_unprotect(1);
+	*fp = f;
+	return res;
+}
+
+SEXP load_wave_file(SEXP src)
+{
+	FILE *f = 0;
+	unsigned int st = 1;
+	SEXP res = Rf_protect(wave_open(src, &f, &st));
+	size_t n = wave_read(f, REAL(res), XLENGTH(res), st, 0);
+	fclose(f);
+	if (n < (size_t) XLENGTH(res))
+		Rf_error("incomplete file");
+	Rf_unprotect(1);
+	return res;
+}
+
+/* checks the object to save and creates the file */
+static FILE *wave_create(SEXP where, SEXP what, SEXP sDither, dither_t *dth,
+						 unsigned int *chs, unsigned int *rate, unsigned int *bits) {
 	SEXP dim = Rf_getAttrib(what, R_DimSymbol);
-	if (TYPEOF(dim) == INTSXP && LENGTH(dim) > 1 && INTEGER(dim)[0] == 2) chs = 2;
+	const char *fName;
+	FILE *f;
+	*rate = 44100;
+	*chs = 1;
+	*bits = 16; /* use 16 bits by default */
+	if (TYPEOF(dim) == INTSXP && LENGTH(dim) > 1 && INTEGER(dim)[0] == 2) *chs = 2;
 	dim = Rf_getAttrib(what, Rf_install("bits"));
 	if (TYPEOF(dim) == INTSXP || TYPEOF(dim) == REALSXP) {
 		int b = Rf_asInteger(dim);
-		if (b == 8) { size /= 2; bits = 8; bps = 1; } else if (b == 32) { size *= 2; bits = 32; bps = 4; }
+		if (b == 8 || b == 32) *bits = b;
 	}
-	bps *= chs;
 	dim = Rf_getAttrib(what, Rf_install("rate"));
 	if (TYPEOF(dim) == INTSXP || TYPEOF(dim) == REALSXP)
-		rate = Rf_asInteger(dim);
+		*rate = Rf_asInteger(dim);
 	if (TYPEOF(what) != REALSXP)
 		Rf_error("saved object must be in real form");
+	dither_init(dth, Rf_asInteger(sDither), 0);
+	if (dth->mode < DITHER_NONE || dth->mode > DITHER_SHAPED) dth->mode = DITHER_NONE;
 	
 	if (Rf_inherits(where, "connection"))
 		Rf_error("sorry, connections are not supported yet");
 	if (TYPEOF(where) != STRSXP || LENGTH(where) < 1)
 		Rf_error("invalid file name");
-	
+	fName = CHAR(STRING_ELT(where, 0));
+	if (!(f = fopen(fName, "wb")))
+		Rf_error("unable to create file '%s'", fName);
+	return f;
+}
+
+SEXP save_wave_file(SEXP where, SEXP what, SEXP sDither) {
+	dither_t dth;
+	unsigned int chs, rate, bits;
+	FILE *f = wave_create(where, what, sDither, &dth, &chs, &rate, &bits);
+	const char *err = wave_write(f, REAL(what), XLENGTH(what), chs, rate, bits, &dth, 0);
+	fclose(f);
+	if (err)
+		Rf_error("%s", err);
+	return R_NilValue;
+}
+
+/* --- asynchronous load/save ---
+
+   The file is opened and the header parsed on the R thread (so errors
+   are reported right away), the result vector is allocated there as
+   well. The samples are then read into (or written from) the vector
+   by a worker thread. The vector is held by the job handle, so it
+   stays in place until the worker is done. Completion is signalled
+   through a pipe watched by R's event loop which calls the optional
+   callback. Without threads the work is done right away. */
+
+#define JOB_LOAD 1
+#define JOB_SAVE 2
+
+#define JOB_ACTIVITY 74 /* input handler activity id, arbitrary */
+
+typedef struct wave_job {
+	int type;
+	FILE *f;
+	double *d;                    /* samples of the result (load) or the saved object (save) */
+	size_t n, done;               /* samples in total and processed so far */
+	unsigned int st;              /* (load) bytes per sample in the file */
+	unsigned int chs, rate, bits; /* (save) */
+	dither_t dth;
+	const char *err;              /* (worker) set on failure */
+	int finished;                 /* (worker) set once the file is closed */
+	int reported;                 /* (R) completion has been handled */
+	SEXP self;                    /* the handle (not protected, the handler is removed by the finalizer) */
+	int fd[2];
+	void *handler;
+#if HAS_PTHREAD
+	pthread_t thread;
+	int running;
+#endif
+} wave_job_t;
+
+static void job_run(wave_job_t *job) {
+	if (job->type == JOB_LOAD) {
+		if (wave_read(job->f, job->d, job->n, job->st, &job->done) < job->n)
+			job->err = "incomplete file";
+	} else
+		job->err = wave_write(job->f, job->d, job->n, job->chs, job->rate, job->bits, &job->dth, &job->done);
+	if (fclose(job->f) && !job->err)
+		job->err = "write error";
+	job->f = 0;
+	AE_STORE(job->finished, 1);
+#ifndef __WIN32__
+	if (job->fd[1] != -1 && write(job->fd[1], "", 1) < 1) {} /* polling still works */
+#endif
+}
+
+#if HAS_PTHREAD
+static void *job_thread(void *arg) {
+	job_run((wave_job_t*) arg);
+	return 0;
+}
+#endif
+
+/* (R) releases the thread and the pipe, the vector stays with the handle */
+static void job_release(wave_job_t *job) {
+#if HAS_PTHREAD
+	if (job->running) {
+		pthread_join(job->thread, 0);
+		job->running = 0;
+	}
+#endif
+#ifndef __WIN32__
+	if (job->handler)
+		removeInputHandler(&R_InputHandlers, (InputHandler*) job->handler);
+	job->handler = 0;
+	if (job->fd[0] != -1) close(job->fd[0]);
+	if (job->fd[1] != -1) close(job->fd[1]);
+#endif
+	job->fd[0] = job->fd[1] = -1;
+}
+
+/* (R) called once the worker is done: from the event loop, wait or a poll */
+static void job_complete(wave_job_t *job) {
+	SEXP cb;
+	int err = 0;
+	if (job->reported || !AE_LOAD(job->finished)) return;
+	job->reported = 1;
+	job_release(job);
+	cb = VECTOR_ELT(R_ExternalPtrProtected(job->self), 1);
+	if (cb != R_NilValue) {
+		SEXP call = Rf_protect(Rf_lang2(cb, job->self));
+		R_tryEval(call, R_GlobalEnv, &err);
+		Rf_unprotect(1);
+		if (err)
+			Rf_warning("the completion callback failed");
+	}
+}
+
+#ifndef __WIN32__
+static void job_handler(void *data) {
+	wave_job_t *job = (wave_job_t*) data;
+	char tmp[16];
+	if (job->fd[0] != -1)
+		while (read(job->fd[0], tmp, sizeof(tmp)) > 0) {}
+	job_complete(job);
+}
+#endif
+
+static void job_finalizer(SEXP ptr) {
+	wave_job_t *job = (wave_job_t*) R_ExternalPtrAddr(ptr);
+	if (job) {
+		job_release(job);
+		if (job->f) fclose(job->f);
+		R_ClearExternalPtr(ptr);
+		free(job);
+	}
+}
+
+static wave_job_t *job_get(SEXP sJob) {
+	wave_job_t *job;
+	if (TYPEOF(sJob) != EXTPTRSXP || !Rf_inherits(sJob, "audioJob") ||
+		!(job = (wave_job_t*) R_ExternalPtrAddr(sJob)))
+		Rf_error("invalid audio job");
+	return job;
+}
+
+/* (R) creates the handle holding `what' and starts the worker */
+static SEXP job_start(wave_job_t *job, SEXP what, SEXP callback) {
+	SEXP res, prot = Rf_protect(Rf_allocVector(VECSXP, 2));
+	SET_VECTOR_ELT(prot, 0, what);
+	SET_VECTOR_ELT(prot, 1, callback);
+	res = Rf_protect(R_MakeExternalPtr(job, R_NilValue, prot));
+	R_RegisterCFinalizer(res, job_finalizer);
+	Rf_setAttrib(res, R_ClassSymbol, Rf_mkString("audioJob"));
+	job->self = res;
+	job->fd[0] = job->fd[1] = -1;
+#if HAS_PTHREAD
+#ifndef __WIN32__
+	if (!pipe(job->fd)) {
+		InputHandler *ih;
+		fcntl(job->fd[0], F_SETFL, O_NONBLOCK);
+		fcntl(job->fd[1], F_SETFL, O_NONBLOCK);
+		ih = addInputHandler(R_InputHandlers, job->fd[0], job_handler, JOB_ACTIVITY);
+		if (ih) ih->userData = job;
+		job->handler = ih;
+	}
+#endif
+	if (!pthread_create(&job->thread, 0, job_thread, job))
+		job->running = 1;
+	else
+#endif
 	{
-		const char *fName = CHAR(STRING_ELT(where, 0));
-		riff_header_t rh = { "RIFF", size + 36, "WAVE" };
-		wav_fmt_t fmt = { "fmt ", 16, 1, (short) chs, rate, rate * bps, (unsigned short) bps, (unsigned short) bits };
-		riff_chunk_t rc = { "data", size };
-		FILE *f = fopen(fName, "wb");
-		if (!f)
-			Rf_error("unable to create file '%s'", fName);
-		if (fwrite(&rh, sizeof(rh), 1, f) != 1 ||
-		    fwrite(&fmt, sizeof(fmt), 1, f) != 1 ||
-		    fwrite(&rc, sizeof(rc), 1, f) != 1) {
-			fclose(f);
-			Rf_error("write error");
-		}
+		job_run(job);
+		job_complete(job);
+	}
+	Rf_unprotect(2);
+	return res;
+}
+
+SEXP load_wave_async(SEXP src, SEXP callback) {
+	wave_job_t *job;
+	FILE *f = 0;
+	unsigned int st = 1;
+	SEXP res = Rf_protect(wave_open(src, &f, &st));
+	if (!(job = (wave_job_t*) calloc(1, sizeof(wave_job_t)))) {
+		fclose(f);
+		Rf_error("out of memory");
+	}
+	job->type = JOB_LOAD;
+	job->f = f;
+	job->d = REAL(res);
+	job->n = XLENGTH(res);
+	job->st = st;
+	res = job_start(job, res, callback);
+	Rf_unprotect(1);
+	return res;
+}
+
+SEXP save_wave_async(SEXP where, SEXP what, SEXP sDither, SEXP callback) {
+	wave_job_t *job;
+	dither_t dth;
+	unsigned int chs, rate, bits;
+	FILE *f = wave_create(where, what, sDither, &dth, &chs, &rate, &bits);
+	if (!(job = (wave_job_t*) calloc(1, sizeof(wave_job_t)))) {
+		fclose(f);
+		Rf_error("out of memory");
+	}
+	job->type = JOB_SAVE;
+	job->f = f;
+	job->d = REAL(what);
+	job->n = XLENGTH(what);
+	job->chs = chs;
+	job->rate = rate;
+	job->bits = bits;
+	job->dth = dth;
+	/* the object is read by the worker, so it must not be modified in-place */
+#ifdef MARK_NOT_MUTABLE
+	MARK_NOT_MUTABLE(what);
+#endif
+	return job_start(job, what, callback);
+}
+
+/* waits up to `timeout' seconds (negative = indefinitely), returns TRUE once the job is done */
+SEXP audio_job_wait(SEXP sJob, SEXP sTimeout) {
+	wave_job_t *job = job_get(sJob);
+	double timeout = Rf_asReal(sTimeout);
+	if (timeout < 0) timeout = 9999999.0; /* really a dummy high number */
+	while (!AE_LOAD(job->finished)) {
+		/* use 100ms slices */
+		double slice = (timeout > 0.1) ? 0.1 : timeout;
+		if (slice <= 0.0) break;
+#ifdef __WIN32__
+		Sleep((DWORD) (slice * 1000));
+#else
 		{
-			if (bits == 8) {
-				double *d = REAL(what);
-				signed char buf[2048];
-				int i = 0, j = LENGTH(what), k = 0;
-				while (i < j) {
-					buf[k++] = (signed char) (d[i++] * 127.0);
-					if (k == 2048) {
-						if (fwrite(buf, sizeof(*buf), k, f) != k) {
-							fclose(f);
-							Rf_error("write error");
-						}
-						k = 0;
-					}
-				}
-				if (k && fwrite(buf, sizeof(*buf), k, f) != k) {
-					fclose(f);
-					Rf_error("write error");
-				}
-			} else if (bits == 16) {
-				double *d = REAL(what);
-				short int buf[2048];
-				int i = 0, j = LENGTH(what), k = 0;
-				while (i < j) {
-					buf[k++] = (short int) (d[i++] * 32767.0);
-					if (k == 2048) {
-						if (fwrite(buf, sizeof(*buf), k, f) != k) {
-							fclose(f);
-							Rf_error("write error");
-						}
-						k = 0;
-					}
-				}
-				if (k && fwrite(buf, sizeof(*buf), k, f) != k) {
-					fclose(f);
-					Rf_error("write error");
-				}
-			} else {
-				double *d = REAL(what);
-				int buf[2048];
-				int i = 0, j = LENGTH(what), k = 0;
-				while (i < j) {
-					buf[k++] = (int) (d[i++] * 2147483647.0);
-					if (k == 2048) {
-						if (fwrite(buf, sizeof(*buf), k, f) != k) {
-							fclose(f);
-							Rf_error("write error");
-						}
-						k = 0;
-					}
-				}
-				if (k && fwrite(buf, sizeof(*buf), k, f) != k) {
-					fclose(f);
-					Rf_error("write error");
-				}
-			}
+			struct timeval tv;
+			fd_set fds;
+			tv.tv_sec  = (unsigned int) slice;
+			tv.tv_usec = (unsigned int)((slice - ((double)tv.tv_sec)) * 1000000.0);
+			FD_ZERO(&fds);
+			if (job->fd[0] != -1)
+				FD_SET(job->fd[0], &fds);
+			select(job->fd[0] + 1, &fds, 0, 0, &tv);
 		}
+#endif
+		R_CheckUserInterrupt();
+		timeout -= slice;
+	}
+	job_complete(job);
+	return Rf_ScalarLogical(job->reported);
+}
+
+/* list(done, progress, error) */
+SEXP audio_job_info(SEXP sJob) {
+	wave_job_t *job = job_get(sJob);
+	SEXP res, names;
+	job_complete(job);
+	res = Rf_protect(Rf_allocVector(VECSXP, 3));
+	names = Rf_allocVector(STRSXP, 3);
+	Rf_setAttrib(res, R_NamesSymbol, names);
+	SET_STRING_ELT(names, 0, Rf_mkChar("done"));
+	SET_STRING_ELT(names, 1, Rf_mkChar("progress"));
+	SET_STRING_ELT(names, 2, Rf_mkChar("error"));
+	SET_VECTOR_ELT(res, 0, Rf_ScalarLogical(job->reported));
+	SET_VECTOR_ELT(res, 1, Rf_ScalarReal(job->n ? ((double) AE_LOAD(job->done)) / ((double) job->n) : 1.0));
+	SET_VECTOR_ELT(res, 2, (job->reported && job->err) ? Rf_mkString(job->err) : R_NilValue);
+	Rf_unprotect(1);
+	return res;
+}
+
+/* the loaded sample (NULL for saving), waits for the job to finish */
+SEXP audio_job_value(SEXP sJob) {
+	wave_job_t *job = job_get(sJob);
+	audio_job_wait(sJob, Rf_ScalarReal(-1.0));
+	if (job->err)
+		Rf_error("%s", job->err);
+	return (job->type == JOB_LOAD) ? VECTOR_ELT(R_ExternalPtrProtected(sJob), 0) : R_NilValue;
+}
+
+/* --- chunked reading ---
+
+   wave.chunks() keeps the file open and returns it block by block.
+   The raw samples of the next block are read on a separate thread
+   while the current block is processed in R, so only the current
+   chunk and the raw read-ahead buffer are held. The chunk vector is
+   converted into again if nothing but the iterator references it. */
+
+typedef struct wave_iter {
+	FILE *f;
+	wav_fmt_t fmt;
+	unsigned int st, chs;
+	size_t size, overlap;       /* frames per chunk and shared with the previous one */
+	size_t left;                /* frames of the data chunk not read yet */
+	size_t pos;                 /* frame of the file read next */
+	unsigned char *raw;         /* read-ahead buffer */
+	size_t want, got;           /* frames requested and read into raw */
+	int pending;                /* the read has been requested but not started */
+#if HAS_PTHREAD
+	pthread_t thread;
+	int reading;
+#endif
+} wave_iter_t;
+
+static void iter_read(wave_iter_t *it) {
+	it->got = it->want ? fread(it->raw, it->st * it->chs, it->want, it->f) : 0;
+	it->left = (it->got < it->want) ? 0 : (it->left - it->got); /* a truncated file ends here */
+}
+
+#if HAS_PTHREAD
+static void *iter_thread(void *arg) {
+	iter_read((wave_iter_t*) arg);
+	return 0;
+}
+#endif
+
+/* (R) starts reading the next `frames' frames */
+static void iter_request(wave_iter_t *it, size_t frames) {
+	it->want = (frames > it->left) ? it->left : frames;
+	it->pending = 1;
+#if HAS_PTHREAD
+	if (it->want && !pthread_create(&it->thread, 0, iter_thread, it)) {
+		it->reading = 1;
+		it->pending = 0;
+	}
+#endif
+}
+
+/* (R) finishes the requested read, without threads it is done here */
+static void iter_wait(wave_iter_t *it) {
+#if HAS_PTHREAD
+	if (it->reading) {
+		pthread_join(it->thread, 0);
+		it->reading = 0;
+	}
+#endif
+	if (it->pending) {
+		iter_read(it);
+		it->pending = 0;
+	}
+}
+
+static void iter_free(wave_iter_t *it) {
+#if HAS_PTHREAD
+	if (it->reading)
+		pthread_join(it->thread, 0);
+#endif
+	if (it->f) fclose(it->f);
+	free(it->raw);
+	free(it);
+}
+
+static void iter_finalizer(SEXP ptr) {
+	wave_iter_t *it = (wave_iter_t*) R_ExternalPtrAddr(ptr);
+	if (it) {
+		R_ClearExternalPtr(ptr);
+		iter_free(it);
+	}
+}
+
+static wave_iter_t *iter_get(SEXP sIt) {
+	wave_iter_t *it;
+	if (TYPEOF(sIt) != EXTPTRSXP || !Rf_inherits(sIt, "waveChunks") ||
+		!(it = (wave_iter_t*) R_ExternalPtrAddr(sIt)))
+		Rf_error("invalid or closed chunk iterator");
+	return it;
+}
+
+SEXP wave_chunks_open(SEXP src, SEXP sSize, SEXP sOverlap) {
+	double size = Rf_asReal(sSize), overlap = Rf_asReal(sOverlap);
+	unsigned int len = 0, st = 1;
+	wav_fmt_t fmt;
+	wave_iter_t *it;
+	FILE *f;
+	SEXP res, prot;
+	if (ISNAN(size) || size < 1.0)
+		Rf_error("invalid chunk size");
+	if (ISNAN(overlap) || overlap < 0.0 || overlap >= size)
+		Rf_error("the overlap must be non-negative and less than the chunk size");
+	f = wave_open_file(src, &fmt, &len, &st);
+	if (fmt.chs < 1) {
 		fclose(f);
+		Rf_error("invalid number of channels");
 	}
-	return R_NilValue;
+	if (!(it = (wave_iter_t*) calloc(1, sizeof(wave_iter_t))) ||
+		!(it->raw = (unsigned char*) malloc((size_t) size * st * fmt.chs))) {
+		free(it);
+		fclose(f);
+		Rf_error("out of memory");
+	}
+	it->f = f;
+	it->fmt = fmt;
+	it->st = st;
+	it->chs = fmt.chs;
+	it->size = (size_t) size;
+	it->overlap = (size_t) overlap;
+	it->left = len / (st * fmt.chs);
+	/* holds the previous chunk */
+	prot = Rf_protect(Rf_allocVector(VECSXP, 1));
+	res = Rf_protect(R_MakeExternalPtr(it, R_NilValue, prot));
+	R_RegisterCFinalizer(res, iter_finalizer);
+	Rf_setAttrib(res, Rf_install("rate"), Rf_ScalarInteger(fmt.rate));
+	Rf_setAttrib(res, Rf_install("bits"), Rf_ScalarInteger(fmt.bips));
+	Rf_setAttrib(res, Rf_install("channels"), Rf_ScalarInteger(fmt.chs));
+	Rf_setAttrib(res, Rf_install("frames"), Rf_ScalarReal((double) it->left));
+	Rf_setAttrib(res, R_ClassSymbol, Rf_mkString("waveChunks"));
+	iter_request(it, it->size);
+	Rf_unprotect(2);
+	return res;
+}
+
+/* the next chunk or NULL at the end of the file */
+SEXP wave_chunks_next(SEXP sIt) {
+	wave_iter_t *it = iter_get(sIt);
+	SEXP prot = R_ExternalPtrProtected(sIt), prev = VECTOR_ELT(prot, 0), res;
+	size_t chs = it->chs, carry = 0, frames;
+	iter_wait(it);
+	if (!it->got) {
+		SET_VECTOR_ELT(prot, 0, R_NilValue);
+		return R_NilValue;
+	}
+	if (prev != R_NilValue) {
+		carry = XLENGTH(prev) / chs;
+		if (carry > it->overlap) carry = it->overlap;
+	}
+	frames = carry + it->got;
+#ifdef MAYBE_SHARED
+	/* the iterator holds the only reference, so the old chunk can be
+	   re-used. This is not the case if R still has it bound to a
+	   variable, e.g. in while (!is.null(x <- read.chunk(it))) */
+	if (prev != R_NilValue && (size_t) XLENGTH(prev) == frames * chs && !MAYBE_SHARED(prev)) {
+		res = Rf_protect(prev);
+		if (carry)
+			memmove(REAL(res), REAL(res) + XLENGTH(res) - carry * chs, sizeof(double) * carry * chs);
+	} else
+#endif
+	{
+		res = Rf_protect(Rf_allocVector(REALSXP, frames * chs));
+		wave_attributes(res, &it->fmt);
+		if (carry)
+			memcpy(REAL(res), REAL(prev) + XLENGTH(prev) - carry * chs, sizeof(double) * carry * chs);
+	}
+	wave_convert(REAL(res) + carry * chs, it->raw, it->got * chs, it->st);
+	Rf_setAttrib(res, Rf_install("start"), Rf_ScalarReal((double) (it->pos - carry)));
+	it->pos += it->got;
+	SET_VECTOR_ELT(prot, 0, res);
+	/* read the next block while this one is processed */
+	iter_request(it, it->size - it->overlap);
+	Rf_unprotect(1);
+	return res;
+}
+
+SEXP wave_chunks_close(SEXP sIt) {
+	wave_iter_t *it = iter_get(sIt);
+	R_ClearExternalPtr(sIt);
+	SET_VECTOR_ELT(R_ExternalPtrProtected(sIt), 0, R_NilValue);
+	iter_free(it);
+	return Rf_ScalarLogical(1);
 }
@@ -0,0 +1,317 @@
+/* Streaming playback of WAVE files from disk
+   audio R package
+   Copyright(c) 2026 Simon Urbanek
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation
+   files (the "Software"), to deal in the Software without
+   restriction, including without limitation the rights to use, copy,
+   modify, merge, publish, distribute, sublicense, and/or sell copies
+   of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   * The above copyright notice and this permission notice shall be
+     included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND ON
+   INFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR
+   ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+   CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+   WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+   The text above constitutes the entire license; however, the
+   PortAudio community also makes the following non-binding requests:
+
+   * Any person wishing to distribute modifications to the Software is
+     requested to send the modifications to the original developer so
+     that they can be incorporated into the canonical version. It is
+     also requested that these non-binding requests be included along
+     with the license above.
+
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "engine.h"
+
+#if HAS_PTHREAD
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/time.h>
+#endif
+
+/* play.file() plays the data chunk of a WAVE file without loading it:
+   the header is parsed once, then a reader thread reads blocks with
+   pread() and converts them into the engine's look-ahead ring. The
+   audio thread wakes the reader when half of the ring has been played,
+   so one half is being played while the other is refilled. Memory use
+   is the ring plus one block regardless of the length of the file. */
+
+#define FS_LOOKAHEAD  16384 /* frames in the ring */
+#define FS_BLOCK      4096  /* frames read at once */
+#define FS_POLL_MS    20    /* the reader also checks the ring this often */
+
+#if HAS_PTHREAD
+
+typedef struct file_reader {
+	ae_reader_t reader;         /* must be first */
+	int fd;
+	off_t pos, end;             /* next byte to read, end of the data chunk */
+	unsigned int bytes;         /* per sample */
+	int is_float;
+	ae_stream_t *stream;
+	int running;                /* (R) the thread has been started */
+	int wake, quit;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned char buf[1];       /* FS_BLOCK frames as read from the file */
+} file_reader_t;
+
+static unsigned int get_le(const unsigned char *p, int n) {
+	unsigned int v = 0;
+	while (n--) v = (v << 8) | p[n];
+	return v;
+}
+
+/* samples are scaled the same way as load.wave() does */
+static void convert(const file_reader_t *r, const unsigned char *src, double *d, unsigned int samples) {
+	unsigned int i;
+	switch (r->bytes) {
+	case 1:
+		for (i = 0; i < samples; i++) {
+			signed char c = (signed char) src[i];
+			d[i] = (c < 0) ? (((double) c) / 127.0) : (((double) c) / 128.0);
+		}
+		break;
+	case 2:
+		for (i = 0; i < samples; i++, src += 2) {
+			short s = (short) get_le(src, 2);
+			d[i] = (s < 0) ? (((double) s) / 32767.0) : (((double) s) / 32768.0);
+		}
+		break;
+	case 3:
+		for (i = 0; i < samples; i++, src += 3) {
+			int s = (int) (get_le(src, 3) << 8) >> 8;
+			d[i] = (s < 0) ? (((double) s) / 8388607.0) : (((double) s) / 8388608.0);
+		}
+		break;
+	case 4:
+		for (i = 0; i < samples; i++, src += 4) {
+			unsigned int u = get_le(src, 4);
+			if (r->is_float) {
+				float f;
+				memcpy(&f, &u, sizeof(f));
+				d[i] = (double) f;
+			} else {
+				int s = (int) u;
+				d[i] = (s < 0) ? (((double) s) / 2147483647.0) : (((double) s) / 2147483648.0);
+			}
+		}
+		break;
+	}
+}
+
+/* read blocks until the ring is full, returns 0 at the end of the data */
+static int reader_fill(file_reader_t *r) {
+	ae_stream_t *s = r->stream;
+	unsigned int chs = r->reader.chs, fb = r->bytes * chs;
+	AE_STORE(s->requested, 0);
+	while (!AE_LOAD(r->quit)) {
+		unsigned int space = s->size - (s->wr - AE_LOAD(s->rd)), n = FS_BLOCK, at, first;
+		ssize_t got;
+		if (space < FS_BLOCK) return 1;
+		if ((off_t) n * fb > r->end - r->pos)
+			n = (unsigned int) ((r->end - r->pos) / fb);
+		if (!n) break;
+		got = pread(r->fd, r->buf, (size_t) n * fb, r->pos);
+		if (got < 0 && errno == EINTR) continue;
+		if (got < (ssize_t) fb) break; /* read error or a truncated file */
+		n = (unsigned int) (got / fb);
+		r->pos += (off_t) n * fb;
+		at = s->wr % s->size;
+		first = (n > s->size - at) ? (s->size - at) : n;
+		convert(r, r->buf, s->ring + (size_t) at * chs, first * chs);
+		if (first < n)
+			convert(r, r->buf + (size_t) first * fb, s->ring, (n - first) * chs);
+		AE_STORE(s->wr, s->wr + n);
+	}
+	AE_STORE(s->eof, 1);
+	return 0;
+}
+
+static void *reader_thread(void *arg) {
+	file_reader_t *r = (file_reader_t*) arg;
+	while (reader_fill(r)) {
+		struct timeval tv;
+		struct timespec ts;
+		pthread_mutex_lock(&r->lock);
+		if (!r->wake && !r->quit) {
+			/* a wake-up can be missed since the audio thread doesn't lock,
+			   so don't rely on it */
+			gettimeofday(&tv, 0);
+			ts.tv_sec = tv.tv_sec;
+			ts.tv_nsec = (tv.tv_usec + FS_POLL_MS * 1000) * 1000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&r->cond, &r->lock, &ts);
+		}
+		r->wake = 0;
+		pthread_mutex_unlock(&r->lock);
+	}
+	return 0;
+}
+
+static void reader_wake(ae_reader_t *rd) {
+	file_reader_t *r = (file_reader_t*) rd;
+	AE_STORE(r->wake, 1);
+	pthread_cond_signal(&r->cond);
+}
+
+static int reader_start(ae_reader_t *rd, ae_stream_t *s) {
+	file_reader_t *r = (file_reader_t*) rd;
+	r->stream = s;
+	/* start with a full ring */
+	if (!reader_fill(r))
+		return 1;
+	if (pthread_create(&r->thread, 0, reader_thread, r))
+		return 0;
+	r->running = 1;
+	return 1;
+}
+
+static void reader_close(ae_reader_t *rd) {
+	file_reader_t *r = (file_reader_t*) rd;
+	if (r->running) {
+		pthread_mutex_lock(&r->lock);
+		AE_STORE(r->quit, 1);
+		pthread_cond_signal(&r->cond);
+		pthread_mutex_unlock(&r->lock);
+		pthread_join(r->thread, 0);
+	}
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->cond);
+	close(r->fd);
+	free(r);
+}
+
+/* readers that were never played */
+static void reader_finalizer(SEXP ptr) {
+	ae_reader_t *r = (ae_reader_t*) R_ExternalPtrAddr(ptr);
+	if (r) {
+		R_ClearExternalPtr(ptr);
+		r->close(r);
+	}
+}
+
+/* locates the format and the data chunk, returns NULL or an error message */
+static const char *parse_wave(int fd, off_t size, unsigned int *fmt, unsigned int *chs, unsigned int *rate,
+							  unsigned int *bits, off_t *data, off_t *end) {
+	unsigned char h[40];
+	off_t pos = 12;
+	int has_fmt = 0;
+	if (pread(fd, h, 12, 0) != 12 || memcmp(h, "RIFF", 4) || memcmp(h + 8, "WAVE", 4))
+		return "not a WAVE format";
+	while (pos + 8 <= size) {
+		unsigned int len;
+		if (pread(fd, h, 8, pos) != 8)
+			return "incomplete file";
+		len = get_le(h + 4, 4);
+		if (!memcmp(h, "fmt ", 4)) {
+			unsigned int n = (len > 40) ? 40 : len;
+			if (n < 16 || pread(fd, h, n, pos + 8) != (ssize_t) n)
+				return "corrupt file";
+			*fmt = get_le(h, 2);
+			*chs = get_le(h + 2, 2);
+			*rate = get_le(h + 4, 4);
+			*bits = get_le(h + 14, 2);
+			/* WAVE_FORMAT_EXTENSIBLE: the format is the start of the sub-format GUID */
+			if (*fmt == 0xfffe && n >= 26)
+				*fmt = get_le(h + 24, 2);
+			has_fmt = 1;
+		} else if (!memcmp(h, "data", 4)) {
+			if (!has_fmt)
+				return "data chunk without preceeding format chunk";
+			*data = pos + 8;
+			/* files that are still being written may not have the length yet */
+			*end = (len && *data + (off_t) len <= size) ? (*data + (off_t) len) : size;
+			return 0;
+		}
+		pos += 8 + (off_t) len + (len & 1);
+	}
+	return has_fmt ? "no data chunk found" : "no format chunk found";
+}
+
+SEXP audio_file_reader(SEXP sPath) {
+	const char *fName, *err;
+	unsigned int fmt = 0, chs = 0, rate = 0, bits = 0;
+	off_t data = 0, end = 0, size;
+	file_reader_t *r;
+	int fd;
+	SEXP res;
+	if (TYPEOF(sPath) != STRSXP || LENGTH(sPath) < 1)
+		Rf_error("invalid file name");
+	fName = CHAR(STRING_ELT(sPath, 0));
+	if ((fd = open(fName, O_RDONLY)) < 0)
+		Rf_error("unable to open file '%s'", fName);
+	size = lseek(fd, 0, SEEK_END);
+	if ((err = parse_wave(fd, size, &fmt, &chs, &rate, &bits, &data, &end))) {
+		close(fd);
+		Rf_error("%s", err);
+	}
+	if (!((fmt == 1 && (bits == 8 || bits == 16 || bits == 24 || bits == 32)) || (fmt == 3 && bits == 32))) {
+		close(fd);
+		Rf_error("unsupported sample format (%d bits, format %d)", bits, fmt);
+	}
+	if (chs < 1 || chs > AE_MAX_CHANNELS || rate < 1) {
+		close(fd);
+		Rf_error("unsupported number of channels or sample rate");
+	}
+	if (!(r = (file_reader_t*) calloc(1, sizeof(file_reader_t) + FS_BLOCK * chs * (bits / 8)))) {
+		close(fd);
+		Rf_error("out of memory");
+	}
+	r->reader.chs = chs;
+	r->reader.lookahead = FS_LOOKAHEAD;
+	r->reader.start = reader_start;
+	r->reader.wake = reader_wake;
+	r->reader.close = reader_close;
+	r->fd = fd;
+	r->pos = data;
+	r->end = end;
+	r->bytes = bits / 8;
+	r->is_float = (fmt == 3);
+	pthread_mutex_init(&r->lock, 0);
+	pthread_cond_init(&r->cond, 0);
+	/* let the OS read ahead aggressively */
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, data, end - data, POSIX_FADV_SEQUENTIAL);
+#elif defined F_RDAHEAD
+	fcntl(fd, F_RDAHEAD, 1);
+#endif
+	res = Rf_protect(R_MakeExternalPtr(r, Rf_install("audio.reader"), R_NilValue));
+	R_RegisterCFinalizer(res, reader_finalizer);
+	Rf_setAttrib(res, Rf_install("rate"), Rf_ScalarInteger(rate));
+	Rf_setAttrib(res, Rf_install("bits"), Rf_ScalarInteger(bits));
+	Rf_setAttrib(res, Rf_install("channels"), Rf_ScalarInteger(chs));
+	Rf_setAttrib(res, Rf_install("frames"), Rf_ScalarReal((double) ((end - data) / (r->bytes * chs))));
+	Rf_unprotect(1);
+	return res;
+}
+
+#else
+
+SEXP audio_file_reader(SEXP sPath) {
+	Rf_error("streaming from files is not supported on this platform");
+	return R_NilValue;
+}
+
+#endif
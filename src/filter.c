@@ -0,0 +1,433 @@
+/* Filter chains (biquads and FIR) for audio streams
+   audio R package
+   Copyright(c) 2026 Simon Urbanek
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation
+   files (the "Software"), to deal in the Software without
+   restriction, including without limitation the rights to use, copy,
+   modify, merge, publish, distribute, sublicense, and/or sell copies
+   of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   * The above copyright notice and this permission notice shall be
+     included in all copies or substantial portions of the Software.
+ 
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND ON
+   INFRINGEMENT. 
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR
+   ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+   CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+   WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ 
+   The text above constitutes the entire license; however, the
+   PortAudio community also makes the following non-binding requests:
+
+   * Any person wishing to distribute modifications to the Software is
+     requested to send the modifications to the original developer so
+     that they can be incorporated into the canonical version. It is
+     also requested that these non-binding requests be included along
+     with the license above.
+
+ */
+
+#include <string.h>
+#include <math.h>
+#include "filter.h"
+#include "fft.h"
+
+#define FS_BIQUAD 1
+#define FS_FIR    2
+#define FS_PFIR   3
+
+/* uniformly partitioned overlap-save convolution */
+typedef struct pfir {
+	unsigned int B, N, P;   /* block size, FFT size (2B), number of partitions */
+	unsigned int pos, head; /* position within the current block, current slot of the delay line */
+	fft_plan_t *plan;
+	double *Hre, *Him;      /* P kernel partition spectra */
+	double *in;             /* per channel: N time samples [previous block | current block] */
+	double *out;            /* per channel: B output samples of the last block */
+	double *Xre, *Xim;      /* per channel: frequency-domain delay line of P spectra */
+	double *are, *aim;      /* accumulator (work space) */
+} pfir_t;
+
+struct filter_stage {
+	int type;
+	filter_stage_t *next;
+	double c[5];            /* biquad: b0, b1, b2, a1, a2 (normalized) */
+	double *z;              /* biquad: 2 state values per channel */
+	double *h;              /* FIR: taps */
+	unsigned int n, hpos;   /* FIR: number of taps, position in the history */
+	double *hist;           /* FIR: per channel history of 2n (doubled so the window is contiguous) */
+	pfir_t *pf;             /* partitioned FIR */
+};
+
+/* --- design --- */
+
+static int biquad_design(const char *kind, double f, double Q, double gain, double rate, double *c) {
+	double w0 = 2.0 * M_PI * f / rate, cw = cos(w0), sw = sin(w0);
+	double alpha = sw / (2.0 * Q), A = pow(10.0, gain / 40.0), sq = 2.0 * sqrt(A) * alpha;
+	double b0, b1, b2, a0, a1, a2;
+	if (!strcmp(kind, "lowpass")) {
+		b0 = (1.0 - cw) / 2.0; b1 = 1.0 - cw; b2 = b0;
+		a0 = 1.0 + alpha; a1 = -2.0 * cw; a2 = 1.0 - alpha;
+	} else if (!strcmp(kind, "highpass")) {
+		b0 = (1.0 + cw) / 2.0; b1 = -(1.0 + cw); b2 = b0;
+		a0 = 1.0 + alpha; a1 = -2.0 * cw; a2 = 1.0 - alpha;
+	} else if (!strcmp(kind, "bandpass")) {
+		b0 = alpha; b1 = 0.0; b2 = -alpha;
+		a0 = 1.0 + alpha; a1 = -2.0 * cw; a2 = 1.0 - alpha;
+	} else if (!strcmp(kind, "notch")) {
+		b0 = 1.0; b1 = -2.0 * cw; b2 = 1.0;
+		a0 = 1.0 + alpha; a1 = -2.0 * cw; a2 = 1.0 - alpha;
+	} else if (!strcmp(kind, "peak")) {
+		b0 = 1.0 + alpha * A; b1 = -2.0 * cw; b2 = 1.0 - alpha * A;
+		a0 = 1.0 + alpha / A; a1 = -2.0 * cw; a2 = 1.0 - alpha / A;
+	} else if (!strcmp(kind, "lowshelf")) {
+		b0 = A * ((A + 1.0) - (A - 1.0) * cw + sq);
+		b1 = 2.0 * A * ((A - 1.0) - (A + 1.0) * cw);
+		b2 = A * ((A + 1.0) - (A - 1.0) * cw - sq);
+		a0 = (A + 1.0) + (A - 1.0) * cw + sq;
+		a1 = -2.0 * ((A - 1.0) + (A + 1.0) * cw);
+		a2 = (A + 1.0) + (A - 1.0) * cw - sq;
+	} else if (!strcmp(kind, "highshelf")) {
+		b0 = A * ((A + 1.0) + (A - 1.0) * cw + sq);
+		b1 = -2.0 * A * ((A - 1.0) + (A + 1.0) * cw);
+		b2 = A * ((A + 1.0) + (A - 1.0) * cw - sq);
+		a0 = (A + 1.0) - (A - 1.0) * cw + sq;
+		a1 = 2.0 * ((A - 1.0) - (A + 1.0) * cw);
+		a2 = (A + 1.0) - (A - 1.0) * cw - sq;
+	} else
+		return 0;
+	c[0] = b0 / a0; c[1] = b1 / a0; c[2] = b2 / a0;
+	c[3] = a1 / a0; c[4] = a2 / a0;
+	return 1;
+}
+
+static SEXP list_elt(SEXP l, const char *name) {
+	SEXP nam = Rf_getAttrib(l, R_NamesSymbol);
+	int i, n = LENGTH(l);
+	if (TYPEOF(nam) != STRSXP) return R_NilValue;
+	for (i = 0; i < n; i++)
+		if (!strcmp(CHAR(STRING_ELT(nam, i)), name))
+			return VECTOR_ELT(l, i);
+	return R_NilValue;
+}
+
+static const char *elt_string(SEXP l, const char *name) {
+	SEXP v = list_elt(l, name);
+	return (TYPEOF(v) == STRSXP && LENGTH(v) > 0) ? CHAR(STRING_ELT(v, 0)) : "";
+}
+
+static double elt_real(SEXP l, const char *name) {
+	SEXP v = list_elt(l, name);
+	return (TYPEOF(v) == REALSXP || TYPEOF(v) == INTSXP) ? Rf_asReal(v) : NA_REAL;
+}
+
+/* --- stages --- */
+
+static void pfir_free(pfir_t *pf) {
+	fft_plan_free(pf->plan);
+	free(pf->Hre); free(pf->Him); free(pf->in); free(pf->out);
+	free(pf->Xre); free(pf->Xim);
+	free(pf->are); free(pf->aim);
+	free(pf);
+}
+
+static void stage_free(filter_stage_t *s) {
+	if (s->pf) pfir_free(s->pf);
+	free(s->z);
+	free(s->h);
+	free(s->hist);
+	free(s);
+}
+
+static pfir_t *pfir_new(const double *h, unsigned int n, int chs) {
+	unsigned int B = PFIR_BLOCK, N = 2 * PFIR_BLOCK, P = (n + B - 1) / B, p, i;
+	pfir_t *pf = (pfir_t*) calloc(1, sizeof(pfir_t));
+	if (!pf) return 0;
+	pf->B = B; pf->N = N; pf->P = P;
+	pf->plan = fft_plan_new(N);
+	pf->Hre = (double*) calloc((size_t) P * N, sizeof(double));
+	pf->Him = (double*) calloc((size_t) P * N, sizeof(double));
+	pf->in  = (double*) calloc((size_t) chs * N, sizeof(double));
+	pf->out = (double*) calloc((size_t) chs * B, sizeof(double));
+	pf->Xre = (double*) calloc((size_t) chs * P * N, sizeof(double));
+	pf->Xim = (double*) calloc((size_t) chs * P * N, sizeof(double));
+	pf->are = (double*) calloc(N, sizeof(double));
+	pf->aim = (double*) calloc(N, sizeof(double));
+	if (!pf->plan || !pf->Hre || !pf->Him || !pf->in || !pf->out || !pf->Xre || !pf->Xim ||
+	    !pf->are || !pf->aim) {
+		pfir_free(pf);
+		return 0;
+	}
+	/* kernel partitions, zero-padded to N */
+	for (p = 0; p < P; p++) {
+		double *re = pf->Hre + (size_t) p * N, *im = pf->Him + (size_t) p * N;
+		for (i = 0; i < B && p * B + i < n; i++)
+			re[i] = h[p * B + i];
+		fft_transform(pf->plan, re, im, 0);
+	}
+	return pf;
+}
+
+/* one block of overlap-save for channel c */
+static void pfir_block(pfir_t *pf, int c) {
+	unsigned int B = pf->B, N = pf->N, P = pf->P, p, i;
+	double *in = pf->in + (size_t) c * N;
+	double *Xre = pf->Xre + (size_t) c * P * N, *Xim = pf->Xim + (size_t) c * P * N;
+	double *xr = Xre + (size_t) pf->head * N, *xi = Xim + (size_t) pf->head * N;
+	memcpy(xr, in, sizeof(double) * N);
+	memset(xi, 0, sizeof(double) * N);
+	fft_transform(pf->plan, xr, xi, 0);
+	memset(pf->are, 0, sizeof(double) * N);
+	memset(pf->aim, 0, sizeof(double) * N);
+	for (p = 0; p < P; p++) {
+		unsigned int slot = (pf->head + P - p) % P;
+		const double *sr = Xre + (size_t) slot * N, *si = Xim + (size_t) slot * N;
+		const double *hr = pf->Hre + (size_t) p * N, *hi = pf->Him + (size_t) p * N;
+		for (i = 0; i < N; i++) {
+			pf->are[i] += sr[i] * hr[i] - si[i] * hi[i];
+			pf->aim[i] += sr[i] * hi[i] + si[i] * hr[i];
+		}
+	}
+	fft_transform(pf->plan, pf->are, pf->aim, 1);
+	for (i = 0; i < B; i++)
+		pf->out[(size_t) c * B + i] = pf->are[B + i] / (double) N;
+	/* slide the input window */
+	memcpy(in, in + B, sizeof(double) * B);
+}
+
+static void stage_process(filter_stage_t *s, int chs, double *d, unsigned int frames) {
+	unsigned int t;
+	int c;
+	switch (s->type) {
+	case FS_BIQUAD:
+	{
+		double b0 = s->c[0], b1 = s->c[1], b2 = s->c[2], a1 = s->c[3], a2 = s->c[4];
+		for (c = 0; c < chs; c++) {
+			double z1 = s->z[2 * c], z2 = s->z[2 * c + 1], *x = d + c;
+			for (t = 0; t < frames; t++) {
+				double in = x[t * chs], y = b0 * in + z1;
+				z1 = b1 * in - a1 * y + z2;
+				z2 = b2 * in - a2 * y;
+				x[t * chs] = y;
+			}
+			s->z[2 * c] = z1;
+			s->z[2 * c + 1] = z2;
+		}
+		break;
+	}
+	case FS_FIR:
+	{
+		unsigned int n = s->n, k;
+		for (t = 0; t < frames; t++) {
+			s->hpos = (s->hpos == 0) ? n - 1 : s->hpos - 1;
+			for (c = 0; c < chs; c++) {
+				double *hist = s->hist + (size_t) c * 2 * n, acc = 0.0;
+				const double *w = hist + s->hpos;
+				hist[s->hpos] = hist[s->hpos + n] = d[t * chs + c];
+				for (k = 0; k < n; k++)
+					acc += s->h[k] * w[k];
+				d[t * chs + c] = acc;
+			}
+		}
+		break;
+	}
+	case FS_PFIR:
+	{
+		pfir_t *pf = s->pf;
+		for (t = 0; t < frames; t++) {
+			for (c = 0; c < chs; c++) {
+				double *x = d + t * chs + c;
+				pf->in[(size_t) c * pf->N + pf->B + pf->pos] = *x;
+				*x = pf->out[(size_t) c * pf->B + pf->pos];
+			}
+			if (++pf->pos == pf->B) {
+				for (c = 0; c < chs; c++)
+					pfir_block(pf, c);
+				pf->head = (pf->head + 1) % pf->P;
+				pf->pos = 0;
+			}
+		}
+		break;
+	}
+	}
+}
+
+void filter_chain_process(audio_filter_chain_t *fc, double *d, unsigned int frames) {
+	filter_stage_t *s = fc->stages;
+	while (s) {
+		stage_process(s, fc->chs, d, frames);
+		s = s->next;
+	}
+}
+
+void filter_chain_reset(audio_filter_chain_t *fc) {
+	filter_stage_t *s = fc->stages;
+	int chs = fc->chs;
+	while (s) {
+		if (s->z) memset(s->z, 0, sizeof(double) * 2 * chs);
+		if (s->hist) memset(s->hist, 0, sizeof(double) * 2 * s->n * chs);
+		s->hpos = 0;
+		if (s->pf) {
+			pfir_t *pf = s->pf;
+			memset(pf->in, 0, sizeof(double) * chs * pf->N);
+			memset(pf->out, 0, sizeof(double) * chs * pf->B);
+			memset(pf->Xre, 0, sizeof(double) * chs * pf->P * pf->N);
+			memset(pf->Xim, 0, sizeof(double) * chs * pf->P * pf->N);
+			pf->pos = pf->head = 0;
+		}
+		s = s->next;
+	}
+}
+
+void filter_chain_free(audio_filter_chain_t *fc) {
+	filter_stage_t *s;
+	if (!fc) return;
+	s = fc->stages;
+	while (s) {
+		filter_stage_t *n = s->next;
+		stage_free(s);
+		s = n;
+	}
+	free(fc);
+}
+
+audio_filter_chain_t *filter_chain_create(SEXP spec, double rate, int chs) {
+	int i, n;
+	audio_filter_chain_t *fc;
+	filter_stage_t **tail;
+	if (TYPEOF(spec) != VECSXP)
+		Rf_error("invalid filter specification");
+	if (chs < 1)
+		Rf_error("invalid number of channels");
+	n = LENGTH(spec);
+	/* validate everything first so we don't have to clean up after R errors */
+	for (i = 0; i < n; i++) {
+		SEXP f = VECTOR_ELT(spec, i);
+		const char *type;
+		if (TYPEOF(f) != VECSXP)
+			Rf_error("invalid filter specification (element %d)", i + 1);
+		type = elt_string(f, "type");
+		if (!strcmp(type, "biquad")) {
+			const char *kind = elt_string(f, "kind");
+			if (!strcmp(kind, "coef")) {
+				SEXP cf = list_elt(f, "coef");
+				if (TYPEOF(cf) != REALSXP || LENGTH(cf) != 6 || REAL(cf)[3] == 0.0)
+					Rf_error("invalid biquad coefficients (element %d)", i + 1);
+			} else {
+				double fr = elt_real(f, "freq"), Q = elt_real(f, "Q"), c[5];
+				if (ISNAN(rate) || rate <= 0.0)
+					Rf_error("sample rate is required to design biquad filters");
+				if (ISNAN(fr) || fr <= 0.0 || fr >= rate / 2.0)
+					Rf_error("biquad frequency must be between 0 and half the sample rate (element %d)", i + 1);
+				if (ISNAN(Q) || Q <= 0.0)
+					Rf_error("invalid Q (element %d)", i + 1);
+				if (!biquad_design(kind, fr, Q, 0.0, rate, c))
+					Rf_error("unknown biquad type '%s'", kind);
+			}
+		} else if (!strcmp(type, "fir")) {
+			SEXP h = list_elt(f, "h");
+			if (TYPEOF(h) != REALSXP || LENGTH(h) < 1)
+				Rf_error("invalid FIR filter taps (element %d)", i + 1);
+		} else
+			Rf_error("unknown filter type '%s'", type);
+	}
+
+	fc = (audio_filter_chain_t*) calloc(1, sizeof(audio_filter_chain_t));
+	if (!fc) Rf_error("out of memory");
+	fc->chs = chs;
+	tail = &fc->stages;
+	for (i = 0; i < n; i++) {
+		SEXP f = VECTOR_ELT(spec, i);
+		filter_stage_t *s = (filter_stage_t*) calloc(1, sizeof(filter_stage_t));
+		if (!s) break;
+		*tail = s;
+		tail = &s->next;
+		if (!strcmp(elt_string(f, "type"), "biquad")) {
+			const char *kind = elt_string(f, "kind");
+			s->type = FS_BIQUAD;
+			if (!strcmp(kind, "coef")) {
+				const double *cf = REAL(list_elt(f, "coef")); /* b0, b1, b2, a0, a1, a2 */
+				s->c[0] = cf[0] / cf[3]; s->c[1] = cf[1] / cf[3]; s->c[2] = cf[2] / cf[3];
+				s->c[3] = cf[4] / cf[3]; s->c[4] = cf[5] / cf[3];
+			} else {
+				double g = elt_real(f, "gain");
+				biquad_design(kind, elt_real(f, "freq"), elt_real(f, "Q"), ISNAN(g) ? 0.0 : g, rate, s->c);
+			}
+			if (!(s->z = (double*) calloc((size_t) 2 * chs, sizeof(double)))) break;
+		} else {
+			SEXP h = list_elt(f, "h");
+			unsigned int taps = (unsigned int) LENGTH(h);
+			if (taps <= FIR_DIRECT_MAX) {
+				s->type = FS_FIR;
+				s->n = taps;
+				if (!(s->h = (double*) malloc(sizeof(double) * taps))) break;
+				memcpy(s->h, REAL(h), sizeof(double) * taps);
+				if (!(s->hist = (double*) calloc((size_t) 2 * taps * chs, sizeof(double)))) break;
+			} else {
+				s->type = FS_PFIR;
+				if (!(s->pf = pfir_new(REAL(h), taps, chs))) break;
+				fc->latency += s->pf->B;
+			}
+		}
+	}
+	if (i < n) {
+		filter_chain_free(fc);
+		Rf_error("out of memory");
+	}
+	return fc;
+}
+
+/* offline entry point: filter a whole sample with the same code as the
+   stream callbacks. The latency of partitioned FIR stages is
+   compensated so the result is aligned with the input. */
+SEXP audio_filter_apply(SEXP x, SEXP spec) {
+	SEXP dim, res, sRate;
+	int chs = 1;
+	double rate = NA_REAL;
+	R_xlen_t frames, done = 0, skip;
+	audio_filter_chain_t *fc;
+	double buf[4096];
+	unsigned int bl;
+	if (TYPEOF(x) != REALSXP)
+		Rf_error("invalid sample, must be in real form");
+	dim = Rf_getAttrib(x, R_DimSymbol);
+	if (TYPEOF(dim) == INTSXP && LENGTH(dim) > 1 && INTEGER(dim)[0] > 0)
+		chs = INTEGER(dim)[0];
+	if (chs > 4096)
+		Rf_error("too many channels");
+	sRate = Rf_getAttrib(x, Rf_install("rate"));
+	if (TYPEOF(sRate) == INTSXP || TYPEOF(sRate) == REALSXP)
+		rate = Rf_asReal(sRate);
+	frames = XLENGTH(x) / chs;
+	res = Rf_protect(Rf_allocVector(REALSXP, XLENGTH(x)));
+	DUPLICATE_ATTRIB(res, x);
+	fc = filter_chain_create(spec, rate, chs);
+	skip = fc->latency;
+	bl = 4096 / chs;
+	/* feed the input followed by `latency' frames of silence, drop the first `latency' output frames */
+	while (done < frames + (R_xlen_t) fc->latency) {
+		R_xlen_t n = frames + fc->latency - done, t, avail;
+		if (n > bl) n = bl;
+		avail = frames - done;
+		if (avail > n) avail = n;
+		if (avail < 0) avail = 0;
+		if (avail) memcpy(buf, REAL(x) + done * chs, sizeof(double) * avail * chs);
+		if (avail < n) memset(buf + avail * chs, 0, sizeof(double) * (n - avail) * chs);
+		filter_chain_process(fc, buf, (unsigned int) n);
+		for (t = 0; t < n; t++) {
+			R_xlen_t o = done + t - skip;
+			if (o >= 0)
+				memcpy(REAL(res) + o * chs, buf + t * chs, sizeof(double) * chs);
+		}
+		done += n;
+	}
+	filter_chain_free(fc);
+	Rf_unprotect(1);
+	return res;
+}
@@ -0,0 +1,73 @@
+/* Filter chains (biquads and FIR) for audio streams
+   audio R package
+   Copyright(c) 2026 Simon Urbanek
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation
+   files (the "Software"), to deal in the Software without
+   restriction, including without limitation the rights to use, copy,
+   modify, merge, publish, distribute, sublicense, and/or sell copies
+   of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   * The above copyright notice and this permission notice shall be
+     included in all copies or substantial portions of the Software.
+ 
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND ON
+   INFRINGEMENT. 
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR
+   ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+   CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+   WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ 
+   The text above constitutes the entire license; however, the
+   PortAudio community also makes the following non-binding requests:
+
+   * Any person wishing to distribute modifications to the Software is
+     requested to send the modifications to the original developer so
+     that they can be incorporated into the canonical version. It is
+     also requested that these non-binding requests be included along
+     with the license above.
+
+ */
+
+#ifndef AUDIO_FILTER_H__
+#define AUDIO_FILTER_H__
+
+#define R_NO_REMAP      /* to not pollute the namespace */
+#include <R.h>
+#include <Rinternals.h>
+
+/* FIR filters with more taps than this use partitioned FFT
+   convolution, shorter ones are computed directly */
+#define FIR_DIRECT_MAX 64
+/* block size of the partitioned convolution - it is also the latency
+   (in frames) added by each partitioned FIR stage */
+#define PFIR_BLOCK     256
+
+typedef struct filter_stage filter_stage_t;
+
+/* A filter chain is a cascade of stages applied to interleaved frames
+   with a fixed number of channels. All state is allocated when the
+   chain is created such that processing never allocates and can be
+   used in the real-time audio callbacks. */
+typedef struct audio_filter_chain {
+	int chs;
+	unsigned int latency;  /* total delay in frames introduced by the chain */
+	filter_stage_t *stages;
+	struct audio_filter_chain *next_retired; /* used by the engine to hand chains back for disposal */
+} audio_filter_chain_t;
+
+/* create a chain from the R specification (list of audioFilter
+   objects). It raises an R error if the specification is invalid,
+   hence it must only be called from the R thread. */
+audio_filter_chain_t *filter_chain_create(SEXP spec, double rate, int chs);
+void filter_chain_free(audio_filter_chain_t *fc);
+/* reset all stage states (history) to silence */
+void filter_chain_reset(audio_filter_chain_t *fc);
+/* process interleaved frames in-place */
+void filter_chain_process(audio_filter_chain_t *fc, double *d, unsigned int frames);
+
+#endif
@@ -0,0 +1,1498 @@
+/* FLAC file support for R
+   audio R package
+   Copyright(c) 2026 Simon Urbanek
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation
+   files (the "Software"), to deal in the Software without
+   restriction, including without limitation the rights to use, copy,
+   modify, merge, publish, distribute, sublicense, and/or sell copies
+   of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   * The above copyright notice and this permission notice shall be
+     included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND ON
+   INFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR
+   ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+   CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+   WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+   The text above constitutes the entire license; however, the
+   PortAudio community also makes the following non-binding requests:
+
+   * Any person wishing to distribute modifications to the Software is
+     requested to send the modifications to the original developer so
+     that they can be incorporated into the canonical version. It is
+     also requested that these non-binding requests be included along
+     with the license above.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "engine.h"
+#include "flac.h"
+
+#if HAS_PTHREAD
+#include <pthread.h>
+#include <unistd.h> /* sysconf */
+#endif
+
+/* The decoder and the encoder are self-contained (no libFLAC) so FLAC
+   files can be read and written on all platforms. A file is read in
+   two passes: the first pass only locates the frames (sync code,
+   header CRC and consecutive sample numbers) starting from the closest
+   seek point, the second pass decodes the frames. Frames are
+   independent, so the second pass can run on several threads which
+   write into disjoint parts of the result. No R API is used in the
+   second pass. */
+
+#define FLAC_MAX_CHANNELS 8
+#define FLAC_MAX_BLOCK    65535
+#define FLAC_READ_CHUNK   (1024 * 1024)
+
+#ifndef M_PI
+#define M_PI 3.141592653589793238462643383280
+#endif
+
+/* --- CRCs --- */
+
+static unsigned char crc8_table[256];
+static unsigned short crc16_table[256];
+
+static void flac_crc_init(void) {
+	static int ready;
+	int i, j;
+	if (ready) return;
+	for (i = 0; i < 256; i++) {
+		unsigned int c8 = i, c16 = i << 8;
+		for (j = 0; j < 8; j++) {
+			c8 = (c8 & 0x80) ? ((c8 << 1) ^ 0x07) : (c8 << 1);
+			c16 = (c16 & 0x8000) ? ((c16 << 1) ^ 0x8005) : (c16 << 1);
+		}
+		crc8_table[i] = (unsigned char) c8;
+		crc16_table[i] = (unsigned short) c16;
+	}
+	ready = 1;
+}
+
+static unsigned int flac_crc8(const unsigned char *d, size_t n) {
+	unsigned int c = 0;
+	while (n--) c = crc8_table[c ^ *(d++)];
+	return c;
+}
+
+static unsigned int flac_crc16(const unsigned char *d, size_t n) {
+	unsigned int c = 0;
+	while (n--) c = ((c << 8) ^ crc16_table[(c >> 8) ^ *(d++)]) & 0xffff;
+	return c;
+}
+
+/* --- bit reader, the buffer must be followed by 8 readable bytes --- */
+
+typedef struct bits {
+	const unsigned char *buf;
+	size_t pos, end; /* in bits */
+} bits_t;
+
+static inline unsigned long long load_be64(const unsigned char *p) {
+	return ((unsigned long long) p[0] << 56) | ((unsigned long long) p[1] << 48) |
+		((unsigned long long) p[2] << 40) | ((unsigned long long) p[3] << 32) |
+		((unsigned long long) p[4] << 24) | ((unsigned long long) p[5] << 16) |
+		((unsigned long long) p[6] << 8) | (unsigned long long) p[7];
+}
+
+/* up to 32 bits, reads past the end return 0 (callers check pos > end) */
+static inline unsigned int get_bits(bits_t *b, int n) {
+	unsigned long long w;
+	if (!n) return 0;
+	if (b->pos >= b->end) {
+		b->pos += n;
+		return 0;
+	}
+	w = load_be64(b->buf + (b->pos >> 3)) << (b->pos & 7);
+	b->pos += n;
+	return (unsigned int) (w >> (64 - n));
+}
+
+static inline int get_sbits(bits_t *b, int n) {
+	unsigned int v = get_bits(b, n);
+	if (n && n < 32 && (v & (1u << (n - 1))))
+		v |= ~0u << n;
+	return (int) v;
+}
+
+/* number of 0 bits before the next 1 bit */
+static inline unsigned int get_unary(bits_t *b) {
+	unsigned int n = 0;
+	while (b->pos < b->end) {
+		unsigned long long w = load_be64(b->buf + (b->pos >> 3)) << (b->pos & 7);
+		unsigned int valid = 64 - (unsigned int) (b->pos & 7);
+		if (w) {
+			unsigned int z = (unsigned int) __builtin_clzll(w);
+			b->pos += z + 1;
+			return n + z;
+		}
+		n += valid;
+		b->pos += valid;
+	}
+	b->pos++;
+	return n;
+}
+
+/* --- stream structure --- */
+
+typedef struct flac_info {
+	unsigned int min_block, max_block;
+	unsigned int rate, chs, bps;
+	unsigned long long total;   /* frames, 0 if unknown */
+	long first;                 /* file offset of the first frame */
+	int seek_points;
+	unsigned long long *seek_sample, *seek_offset;
+} flac_info_t;
+
+typedef struct flac_frame {
+	size_t offset;              /* in the read buffer */
+	unsigned long long sample;  /* first frame (sample of each channel) */
+	unsigned int block;         /* frames in the block */
+} flac_frame_t;
+
+/* header of a frame, returns the header length or 0 if it is not valid */
+static int parse_header(const unsigned char *p, size_t avail, const flac_info_t *fi, unsigned long long *sample,
+						unsigned int *block, unsigned int *chan, unsigned int *bps) {
+	unsigned long long num;
+	unsigned int bs, sr, ch, ss, i, extra;
+	size_t n = 4;
+	if (avail < 6 || p[0] != 0xff || (p[1] & 0xfe) != 0xf8) return 0;
+	bs = p[2] >> 4; sr = p[2] & 15; ch = p[3] >> 4; ss = (p[3] >> 1) & 7;
+	if (!bs || sr == 15 || ch > 10 || ss == 3 || (p[3] & 1)) return 0;
+	/* UTF-8 style coded frame or sample number */
+	num = p[n];
+	if (!(num & 0x80)) extra = 0;
+	else if ((num & 0xe0) == 0xc0) { extra = 1; num &= 0x1f; }
+	else if ((num & 0xf0) == 0xe0) { extra = 2; num &= 0x0f; }
+	else if ((num & 0xf8) == 0xf0) { extra = 3; num &= 0x07; }
+	else if ((num & 0xfc) == 0xf8) { extra = 4; num &= 0x03; }
+	else if ((num & 0xfe) == 0xfc) { extra = 5; num &= 0x01; }
+	else if (num == 0xfe) { extra = 6; num = 0; }
+	else return 0;
+	n++;
+	if (avail < n + extra + 4) return 0;
+	for (i = 0; i < extra; i++, n++) {
+		if ((p[n] & 0xc0) != 0x80) return 0;
+		num = (num << 6) | (p[n] & 0x3f);
+	}
+	if (bs == 1) *block = 192;
+	else if (bs <= 5) *block = 576 << (bs - 2);
+	else if (bs == 6) *block = p[n++] + 1;
+	else if (bs == 7) { *block = ((p[n] << 8) | p[n + 1]) + 1; n += 2; }
+	else *block = 256 << (bs - 8);
+	/* the decoder's scratch holds FLAC_MAX_BLOCK frames per channel */
+	if (*block > FLAC_MAX_BLOCK || *block > fi->max_block) return 0;
+	if (sr == 12) n++;
+	else if (sr == 13 || sr == 14) n += 2;
+	if (avail < n + 1 || flac_crc8(p, n) != p[n]) return 0;
+	/* fixed block size streams count frames, variable ones samples */
+	*sample = (p[1] & 1) ? num : num * fi->min_block;
+	*chan = ch;
+	switch (ss) {
+	case 0: *bps = fi->bps; break;
+	case 1: *bps = 8; break;
+	case 2: *bps = 12; break;
+	case 4: *bps = 16; break;
+	case 5: *bps = 20; break;
+	case 6: *bps = 24; break;
+	default: *bps = 32;
+	}
+	return (int) n + 1;
+}
+
+/* file bytes read on demand */
+typedef struct flac_input {
+	FILE *f;
+	unsigned char *buf;
+	size_t len, size;
+	int eof;
+} flac_input_t;
+
+/* make sure at least n bytes are in the buffer (unless EOF is reached),
+   the buffer is always followed by 8 zero bytes for the bit reader */
+static int input_need(flac_input_t *in, size_t n) {
+	while (in->len < n && !in->eof) {
+		size_t got;
+		if (in->len + FLAC_READ_CHUNK + 8 > in->size) {
+			size_t size = in->size ? in->size * 2 : (FLAC_READ_CHUNK * 2);
+			unsigned char *nb = (unsigned char*) realloc(in->buf, size);
+			if (!nb) return -1;
+			in->buf = nb;
+			in->size = size;
+		}
+		got = fread(in->buf + in->len, 1, FLAC_READ_CHUNK, in->f);
+		in->len += got;
+		if (got < FLAC_READ_CHUNK) in->eof = 1;
+		memset(in->buf + in->len, 0, 8);
+	}
+	return (in->len >= n) ? 1 : 0;
+}
+
+/* metadata: STREAMINFO and SEEKTABLE, returns NULL on success or an error message */
+static const char *read_metadata(FILE *f, flac_info_t *fi) {
+	unsigned char h[34];
+	int last = 0, has_info = 0;
+	long skip = 0;
+	memset(fi, 0, sizeof(flac_info_t));
+	if (fread(h, 1, 10, f) != 10)
+		return "not a FLAC file";
+	/* skip an ID3v2 tag, some tools prepend it */
+	if (!memcmp(h, "ID3", 3))
+		skip = 10 + (((long) (h[6] & 0x7f) << 21) | ((h[7] & 0x7f) << 14) | ((h[8] & 0x7f) << 7) | (h[9] & 0x7f));
+	if (fseek(f, skip, SEEK_SET) || fread(h, 1, 4, f) != 4 || memcmp(h, "fLaC", 4))
+		return "not a FLAC file";
+	while (!last) {
+		unsigned int type, len;
+		if (fread(h, 1, 4, f) != 4)
+			return "incomplete file";
+		last = h[0] & 0x80;
+		type = h[0] & 0x7f;
+		len = (h[1] << 16) | (h[2] << 8) | h[3];
+		if (type == 0 && len >= 34) {
+			if (fread(h, 1, 34, f) != 34)
+				return "incomplete file";
+			fi->min_block = (h[0] << 8) | h[1];
+			fi->max_block = (h[2] << 8) | h[3];
+			fi->rate = (h[10] << 12) | (h[11] << 4) | (h[12] >> 4);
+			fi->chs = ((h[12] >> 1) & 7) + 1;
+			fi->bps = (((h[12] & 1) << 4) | (h[13] >> 4)) + 1;
+			fi->total = ((unsigned long long) (h[13] & 15) << 32) | ((unsigned long long) h[14] << 24) |
+				(h[15] << 16) | (h[16] << 8) | h[17];
+			has_info = 1;
+			len -= 34;
+		} else if (type == 3 && !fi->seek_sample) {
+			int i, n = len / 18;
+			fi->seek_sample = (unsigned long long*) calloc(n + 1, sizeof(unsigned long long));
+			fi->seek_offset = (unsigned long long*) calloc(n + 1, sizeof(unsigned long long));
+			if (!fi->seek_sample || !fi->seek_offset)
+				return "out of memory";
+			for (i = 0; i < n; i++) {
+				unsigned char p[18];
+				if (fread(p, 1, 18, f) != 18)
+					return "incomplete file";
+				/* skip placeholders */
+				if (load_be64(p) != 0xffffffffffffffffull) {
+					fi->seek_sample[fi->seek_points] = load_be64(p);
+					fi->seek_offset[fi->seek_points++] = load_be64(p + 8);
+				}
+			}
+			len -= n * 18;
+		}
+		if (len && fseek(f, len, SEEK_CUR))
+			return "incomplete file";
+	}
+	if (!has_info)
+		return "missing STREAMINFO block";
+	if ((fi->min_block < 16 && fi->min_block != fi->max_block) || !fi->max_block || fi->min_block > fi->max_block)
+		return "invalid STREAMINFO block";
+	fi->first = ftell(f);
+	return 0;
+}
+
+/* --- frame decoding (no R API) --- */
+
+typedef struct flac_decoder {
+	const flac_info_t *fi;
+	const unsigned char *buf;
+	const flac_frame_t *frames;
+	int n_frames;
+	size_t buf_len;
+	unsigned long long start, end; /* requested range */
+	double *out;
+	double scale;
+	int next;                      /* next frame to decode (lock) */
+	int error;                     /* index of a bad frame + 1 */
+#if HAS_PTHREAD
+	pthread_mutex_t lock;
+#endif
+} flac_decoder_t;
+
+static int decode_residual(bits_t *b, long long *s, unsigned int block, unsigned int order) {
+	unsigned int method = get_bits(b, 2), po, parts, p, i = order;
+	unsigned int pbits, escape;
+	if (method > 1) return 0;
+	pbits = method ? 5 : 4;
+	escape = method ? 31 : 15;
+	po = get_bits(b, 4);
+	parts = 1u << po;
+	if ((block >> po) < order || (block & (parts - 1))) return 0;
+	for (p = 0; p < parts; p++) {
+		unsigned int k = get_bits(b, pbits), n = (block >> po) - (p ? 0 : order), j;
+		if (k == escape) {
+			unsigned int raw = get_bits(b, 5);
+			for (j = 0; j < n; j++)
+				s[i++] = get_sbits(b, raw);
+		} else {
+			for (j = 0; j < n; j++) {
+				unsigned long long u = ((unsigned long long) get_unary(b) << k) | get_bits(b, k);
+				s[i++] = (long long) (u >> 1) ^ -(long long) (u & 1);
+			}
+			if (b->pos > b->end) return 0;
+		}
+		if (b->pos > b->end) return 0;
+	}
+	return 1;
+}
+
+static int decode_subframe(bits_t *b, long long *s, unsigned int block, unsigned int bps) {
+	unsigned int type, wasted = 0, i, j, order;
+	if (get_bits(b, 1)) return 0;
+	type = get_bits(b, 6);
+	if (get_bits(b, 1))
+		wasted = get_unary(b) + 1;
+	if (wasted >= bps) return 0;
+	bps -= wasted;
+	if (type == 0) {
+		long long v = get_sbits(b, bps);
+		for (i = 0; i < block; i++) s[i] = v;
+	} else if (type == 1) {
+		for (i = 0; i < block; i++) s[i] = get_sbits(b, bps);
+	} else if (type >= 8 && type <= 12) {
+		order = type - 8;
+		if (order > block) return 0;
+		for (i = 0; i < order; i++) s[i] = get_sbits(b, bps);
+		if (!decode_residual(b, s, block, order)) return 0;
+		switch (order) {
+		case 1: for (i = 1; i < block; i++) s[i] += s[i - 1]; break;
+		case 2: for (i = 2; i < block; i++) s[i] += 2 * s[i - 1] - s[i - 2]; break;
+		case 3: for (i = 3; i < block; i++) s[i] += 3 * s[i - 1] - 3 * s[i - 2] + s[i - 3]; break;
+		case 4: for (i = 4; i < block; i++) s[i] += 4 * s[i - 1] - 6 * s[i - 2] + 4 * s[i - 3] - s[i - 4]; break;
+		}
+	} else if (type >= 32) {
+		int coef[32], shift;
+		unsigned int prec;
+		order = type - 31;
+		if (order > block) return 0;
+		for (i = 0; i < order; i++) s[i] = get_sbits(b, bps);
+		prec = get_bits(b, 4) + 1;
+		shift = get_sbits(b, 5);
+		if (prec == 16 || shift < 0) return 0;
+		for (i = 0; i < order; i++) coef[i] = get_sbits(b, prec);
+		if (!decode_residual(b, s, block, order)) return 0;
+		for (i = order; i < block; i++) {
+			long long sum = 0;
+			for (j = 0; j < order; j++)
+				sum += (long long) coef[j] * s[i - j - 1];
+			s[i] += sum >> shift;
+		}
+	} else
+		return 0;
+	if (wasted)
+		for (i = 0; i < block; i++) s[i] = (long long) ((unsigned long long) s[i] << wasted);
+	return (b->pos <= b->end);
+}
+
+/* decode one frame into the output, returns 0 if the frame is corrupt */
+static int decode_frame(flac_decoder_t *d, int index, long long *s) {
+	const flac_frame_t *fr = &d->frames[index];
+	size_t end = (index + 1 < d->n_frames) ? d->frames[index + 1].offset : d->buf_len;
+	const unsigned char *p = d->buf + fr->offset;
+	unsigned long long sample;
+	unsigned int block, chan, bps, ch, chs, i, first, last;
+	bits_t b;
+	int hl = parse_header(p, end - fr->offset, d->fi, &sample, &block, &chan, &bps);
+	if (!hl) return 0;
+	chs = (chan < 8) ? chan + 1 : 2;
+	if (chs != d->fi->chs) return 0;
+	b.buf = p;
+	b.pos = hl * 8;
+	b.end = (end - fr->offset) * 8;
+	for (ch = 0; ch < chs; ch++) {
+		/* the side channel needs one more bit */
+		unsigned int sb = bps + (((chan == 8 || chan == 10) && ch == 1) || (chan == 9 && ch == 0));
+		if (!decode_subframe(&b, s + ch * block, block, sb)) return 0;
+	}
+	/* byte alignment, then the CRC-16 of the whole frame */
+	b.pos = (b.pos + 7) & ~((size_t) 7);
+	if (b.pos + 16 > b.end) return 0;
+	i = (unsigned int) (b.pos >> 3);
+	if (flac_crc16(p, i) != ((p[i] << 8) | p[i + 1])) return 0;
+	if (chan >= 8) {
+		long long *l = s, *r = s + block;
+		for (i = 0; i < block; i++) {
+			if (chan == 8) r[i] = l[i] - r[i];
+			else if (chan == 9) l[i] += r[i];
+			else {
+				long long mid = ((unsigned long long) l[i] << 1) | (r[i] & 1), side = r[i];
+				l[i] = (mid + side) >> 1;
+				r[i] = (mid - side) >> 1;
+			}
+		}
+	}
+	/* only the requested part of the block is stored */
+	first = (fr->sample < d->start) ? (unsigned int) (d->start - fr->sample) : 0;
+	last = (fr->sample + block > d->end) ? (unsigned int) (d->end - fr->sample) : block;
+	for (i = first; i < last; i++) {
+		double *o = d->out + (fr->sample + i - d->start) * chs;
+		for (ch = 0; ch < chs; ch++)
+			o[ch] = ((double) s[ch * block + i]) * d->scale;
+	}
+	return 1;
+}
+
+static void *decode_worker(void *arg) {
+	flac_decoder_t *d = (flac_decoder_t*) arg;
+	long long *s = (long long*) malloc(sizeof(long long) * d->fi->chs * FLAC_MAX_BLOCK);
+	while (1) {
+		int i;
+#if HAS_PTHREAD
+		pthread_mutex_lock(&d->lock);
+#endif
+		i = d->error ? d->n_frames : d->next++;
+#if HAS_PTHREAD
+		pthread_mutex_unlock(&d->lock);
+#endif
+		if (i >= d->n_frames) break;
+		if (!s || !decode_frame(d, i, s)) {
+#if HAS_PTHREAD
+			pthread_mutex_lock(&d->lock);
+#endif
+			if (!d->error || d->error > i + 1) d->error = i + 1;
+#if HAS_PTHREAD
+			pthread_mutex_unlock(&d->lock);
+#endif
+			break;
+		}
+	}
+	free(s);
+	return 0;
+}
+
+/* --- encoder (no R API) --- */
+
+/* The encoder follows the usual approach of the reference encoder:
+   each block is predicted by either a fixed polynomial or an LPC
+   filter (windowed autocorrelation and Levinson-Durbin recursion),
+   the residual is Rice coded with partitions. The compression level
+   only limits how much is searched, all levels produce valid streams
+   that any decoder can read. The MD5 signature in STREAMINFO is not
+   computed (all zeros, which means "unknown"). */
+
+#define FLAC_MAX_LPC      32
+#define FLAC_MAX_PO       8
+#define FLAC_SEEK_EVERY   10   /* seconds between seek points */
+#define FLAC_SEEK_STREAM  360  /* seek points reserved for streams of unknown length */
+
+static const struct {
+	unsigned short block;
+	unsigned char lpc, po, stereo;
+} flac_levels[9] = {
+	{ 1152, 0, 3, 0 },
+	{ 1152, 0, 3, 1 },
+	{ 1152, 0, 3, 1 },
+	{ 4096, 6, 4, 0 },
+	{ 4096, 8, 4, 1 },
+	{ 4096, 8, 5, 1 },
+	{ 4096, 8, 6, 1 },
+	{ 4096, 12, 6, 1 },
+	{ 4096, 12, 6, 1 }  /* searches all LPC orders */
+};
+
+typedef struct bitw {
+	unsigned char *p;
+	size_t len;                 /* bytes */
+	unsigned long long acc;
+	unsigned int n;             /* bits in acc */
+} bitw_t;
+
+static inline void put_bits(bitw_t *w, unsigned int n, unsigned int v) {
+	if (!n) return;
+	w->acc = (w->acc << n) | (v & (0xffffffffu >> (32 - n)));
+	w->n += n;
+	while (w->n >= 8) {
+		w->n -= 8;
+		w->p[w->len++] = (unsigned char) (w->acc >> w->n);
+	}
+}
+
+/* q 0 bits followed by a 1 bit */
+static inline void put_unary(bitw_t *w, unsigned int q) {
+	while (q >= 32) {
+		put_bits(w, 32, 0);
+		q -= 32;
+	}
+	put_bits(w, q + 1, 1);
+}
+
+typedef struct rice {
+	unsigned int method, po;
+	unsigned char k[1 << FLAC_MAX_PO];
+} rice_t;
+
+typedef struct subframe {
+	int type;                   /* 0 = constant, 1 = verbatim, 2 = fixed, 3 = LPC */
+	unsigned int order, prec;
+	int shift, coef[FLAC_MAX_LPC];
+	rice_t rice;
+	int *res;
+	unsigned long long bits;
+} subframe_t;
+
+typedef struct flac_enc {
+	FILE *f;
+	unsigned int rate, chs, bps, block;
+	int max_lpc, max_po, stereo, exhaustive;
+	dither_t dth;
+	double scale, vmax;
+	unsigned int pending;       /* frames in smp not encoded yet */
+	int *smp;                   /* planar, chs x block */
+	int *mid, *side, *shifted, *res[3];
+	double *wdata, *window;
+	unsigned int window_n;
+	unsigned char *out;
+	unsigned long long total, frames, bytes;
+	unsigned int min_frame, max_frame;
+	/* seek points: every seek_blocks frames, written in the reserved slots at close */
+	unsigned int seek_blocks, seek_slots, seek_n, seek_max;
+	unsigned long long *seek_sample, *seek_offset;
+	long seek_pos;
+	int error;
+} flac_enc_t;
+
+static void put_be(unsigned char *p, unsigned long long v, int n) {
+	while (n--) {
+		p[n] = (unsigned char) v;
+		v >>= 8;
+	}
+}
+
+/* UTF-8 style coding of frame numbers */
+static int put_utf8(unsigned char *p, unsigned long long v) {
+	int n, i;
+	if (v < 0x80) {
+		p[0] = (unsigned char) v;
+		return 1;
+	}
+	n = (v < 0x800) ? 2 : (v < 0x10000) ? 3 : (v < 0x200000) ? 4 : (v < 0x4000000) ? 5 : (v < 0x80000000ull) ? 6 : 7;
+	for (i = n - 1; i > 0; i--) {
+		p[i] = (unsigned char) (0x80 | (v & 0x3f));
+		v >>= 6;
+	}
+	p[0] = (n == 7) ? 0xfe : (unsigned char) ((0xff00 >> n) | v);
+	return n;
+}
+
+static int write_streaminfo(flac_enc_t *e) {
+	unsigned char h[38];
+	memset(h, 0, sizeof(h));
+	h[0] = e->seek_slots ? 0 : 0x80; /* type 0, last block flag */
+	h[3] = 34;
+	put_be(h + 4, e->block, 2);
+	put_be(h + 6, e->block, 2);
+	put_be(h + 8, e->min_frame, 3);
+	put_be(h + 11, e->max_frame, 3);
+	/* rate (20), channels - 1 (3), bits - 1 (5), total frames (36) */
+	put_be(h + 14, ((unsigned long long) e->rate << 44) | ((unsigned long long) (e->chs - 1) << 41) |
+		   ((unsigned long long) (e->bps - 1) << 36) | (e->total & 0xfffffffffull), 8);
+	return fseek(e->f, 4, SEEK_SET) == 0 && fwrite(h, 1, 38, e->f) == 38;
+}
+
+/* the seek points recorded so far are spread over the reserved slots,
+   the remaining slots are placeholders */
+static int write_seektable(flac_enc_t *e) {
+	unsigned int i, n = (e->seek_n < e->seek_slots) ? e->seek_n : e->seek_slots;
+	unsigned char p[18];
+	if (!e->seek_slots) return 1;
+	if (fseek(e->f, e->seek_pos, SEEK_SET)) return 0;
+	p[0] = 0x83;
+	put_be(p + 1, e->seek_slots * 18, 3);
+	if (fwrite(p, 1, 4, e->f) != 4) return 0;
+	for (i = 0; i < e->seek_slots; i++) {
+		if (i < n) {
+			unsigned int j = (unsigned int) ((unsigned long long) i * e->seek_n / n);
+			put_be(p, e->seek_sample[j], 8);
+			put_be(p + 8, e->seek_offset[j], 8);
+			put_be(p + 16, (e->seek_sample[j] + e->block <= e->total) ? e->block : (e->total - e->seek_sample[j]), 2);
+		} else {
+			memset(p, 0xff, 8);
+			memset(p + 8, 0, 10);
+		}
+		if (fwrite(p, 1, 18, e->f) != 18) return 0;
+	}
+	return 1;
+}
+
+static void enc_free(flac_enc_t *e) {
+	int i;
+	if (e->f) fclose(e->f);
+	free(e->smp);
+	free(e->mid);
+	free(e->side);
+	free(e->shifted);
+	for (i = 0; i < 3; i++) free(e->res[i]);
+	free(e->wdata);
+	free(e->window);
+	free(e->out);
+	free(e->seek_sample);
+	free(e->seek_offset);
+	free(e);
+}
+
+/* total is the number of frames if known (0 otherwise), it is only used
+   to size the seek table. Returns NULL and sets err on failure. */
+static flac_enc_t *enc_open(const char *path, unsigned int rate, unsigned int chs, unsigned int bps, int level,
+							int dither, unsigned long long total, const char **err) {
+	flac_enc_t *e;
+	unsigned char h[8];
+	int i;
+	*err = "out of memory";
+	if (!(e = (flac_enc_t*) calloc(1, sizeof(flac_enc_t))))
+		return 0;
+	flac_crc_init();
+	e->rate = rate;
+	e->chs = chs;
+	e->bps = bps;
+	e->block = flac_levels[level].block;
+	e->max_lpc = flac_levels[level].lpc;
+	e->max_po = flac_levels[level].po;
+	e->stereo = (chs == 2) && flac_levels[level].stereo;
+	e->exhaustive = (level == 8);
+	e->scale = (double) (1u << (bps - 1));
+	e->vmax = (e->scale - 1.0) / e->scale;
+	dither_init(&e->dth, dither, 0);
+	e->min_frame = 0xffffff;
+	e->seek_blocks = (rate * FLAC_SEEK_EVERY) / e->block;
+	if (!e->seek_blocks) e->seek_blocks = 1;
+	e->seek_slots = total ? (unsigned int) ((total + (unsigned long long) e->seek_blocks * e->block - 1) /
+											 ((unsigned long long) e->seek_blocks * e->block)) : FLAC_SEEK_STREAM;
+	e->smp = (int*) malloc(sizeof(int) * chs * e->block);
+	e->mid = (int*) malloc(sizeof(int) * e->block);
+	e->side = (int*) malloc(sizeof(int) * e->block);
+	e->shifted = (int*) malloc(sizeof(int) * e->block);
+	for (i = 0; i < 3; i++)
+		e->res[i] = (int*) malloc(sizeof(int) * e->block);
+	e->wdata = (double*) malloc(sizeof(double) * e->block);
+	e->window = (double*) malloc(sizeof(double) * e->block);
+	/* a frame is never larger than its verbatim encoding */
+	e->out = (unsigned char*) malloc(32 + (size_t) chs * ((e->block * (bps + 1) + 7) / 8 + 16));
+	if (!e->smp || !e->mid || !e->side || !e->shifted || !e->res[0] || !e->res[1] || !e->res[2] ||
+		!e->wdata || !e->window || !e->out) {
+		enc_free(e);
+		return 0;
+	}
+	if (!(e->f = fopen(path, "wb"))) {
+		*err = "unable to create file";
+		enc_free(e);
+		return 0;
+	}
+	/* STREAMINFO and the seek table are rewritten when the stream is finished */
+	memcpy(h, "fLaC", 4);
+	*err = "write error";
+	if (fwrite(h, 1, 4, e->f) != 4 || !write_streaminfo(e)) {
+		enc_free(e);
+		return 0;
+	}
+	e->seek_pos = 42;
+	if (e->seek_slots && !write_seektable(e)) {
+		enc_free(e);
+		return 0;
+	}
+	return e;
+}
+
+/* --- residual coding --- */
+
+static inline unsigned int zigzag(int r) {
+	return ((unsigned int) r << 1) ^ (unsigned int) (r >> 31);
+}
+
+static inline unsigned int rice_k(unsigned long long sum, unsigned int n) {
+	unsigned int k = 0;
+	while (k < 30 && ((unsigned long long) n << (k + 1)) < sum) k++;
+	return k;
+}
+
+/* picks the partition order and Rice parameters for r[order..n),
+   returns the exact number of bits of the residual section */
+static unsigned long long rice_choose(const int *r, unsigned int n, unsigned int order, int max_po, rice_t *rc) {
+	unsigned long long sums[1 << FLAC_MAX_PO], best = ~0ull, bits;
+	unsigned int po = 0, p, parts, i;
+	/* the partitions must divide the block and the first one must be longer than the warm-up */
+	while ((int) po < max_po && !(n & ((2u << po) - 1)) && (n >> (po + 1)) > order) po++;
+	parts = 1u << po;
+	for (p = 0, i = order; p < parts; p++) {
+		unsigned int end = (n >> po) * (p + 1);
+		unsigned long long s = 0;
+		for (; i < end; i++)
+			s += zigzag(r[i]);
+		sums[p] = s;
+	}
+	while (1) {
+		unsigned char k[1 << FLAC_MAX_PO];
+		unsigned int maxk = 0;
+		parts = 1u << po;
+		bits = 6;
+		for (p = 0; p < parts; p++) {
+			unsigned int cnt = (n >> po) - (p ? 0 : order);
+			k[p] = (unsigned char) rice_k(sums[p], cnt);
+			if (k[p] > maxk) maxk = k[p];
+			bits += (unsigned long long) cnt * (k[p] + 1) + (sums[p] >> k[p]);
+		}
+		bits += (unsigned long long) parts * ((maxk > 14) ? 5 : 4);
+		if (bits < best) {
+			best = bits;
+			rc->po = po;
+			rc->method = (maxk > 14);
+			memcpy(rc->k, k, parts);
+		}
+		if (!po) break;
+		/* merge neighbouring partitions */
+		po--;
+		for (p = 0; p < (1u << po); p++)
+			sums[p] = sums[2 * p] + sums[2 * p + 1];
+	}
+	/* exact size of the chosen coding */
+	parts = 1u << rc->po;
+	bits = 6 + (unsigned long long) parts * (rc->method ? 5 : 4);
+	for (p = 0, i = order; p < parts; p++) {
+		unsigned int end = (n >> rc->po) * (p + 1), k = rc->k[p];
+		bits += (unsigned long long) (end - i) * (k + 1);
+		for (; i < end; i++)
+			bits += zigzag(r[i]) >> k;
+	}
+	return bits;
+}
+
+static void rice_write(bitw_t *w, const int *r, unsigned int n, unsigned int order, const rice_t *rc) {
+	unsigned int parts = 1u << rc->po, p, i = order;
+	put_bits(w, 2, rc->method);
+	put_bits(w, 4, rc->po);
+	for (p = 0; p < parts; p++) {
+		unsigned int end = (n >> rc->po) * (p + 1), k = rc->k[p];
+		put_bits(w, rc->method ? 5 : 4, k);
+		for (; i < end; i++) {
+			unsigned int u = zigzag(r[i]), q = u >> k;
+			if (q + k < 32)
+				put_bits(w, q + 1 + k, (1u << k) | (u & ((1u << k) - 1)));
+			else {
+				put_unary(w, q);
+				put_bits(w, k, u);
+			}
+		}
+	}
+}
+
+/* --- prediction --- */
+
+/* sums of the absolute residuals of the fixed predictors (orders 0 to 4) */
+static unsigned int fixed_best(const int *x, unsigned int n, unsigned long long *best_sum) {
+	unsigned long long sum[5] = { 0, 0, 0, 0, 0 };
+	long long l0 = x[3], l1 = (long long) x[3] - x[2], l2 = l1 - ((long long) x[2] - x[1]),
+		l3 = l2 - ((long long) x[2] - 2 * (long long) x[1] + x[0]);
+	unsigned int i, o = 0;
+	for (i = 4; i < n; i++) {
+		long long e0 = x[i], e1 = e0 - l0, e2 = e1 - l1, e3 = e2 - l2, e4 = e3 - l3;
+		sum[0] += (e0 < 0) ? -e0 : e0;
+		sum[1] += (e1 < 0) ? -e1 : e1;
+		sum[2] += (e2 < 0) ? -e2 : e2;
+		sum[3] += (e3 < 0) ? -e3 : e3;
+		sum[4] += (e4 < 0) ? -e4 : e4;
+		l0 = e0; l1 = e1; l2 = e2; l3 = e3;
+	}
+	for (i = 1; i < 5; i++)
+		if (sum[i] < sum[o]) o = i;
+	if (best_sum) *best_sum = sum[o];
+	return o;
+}
+
+static void fixed_residual(const int *x, int *r, unsigned int n, unsigned int order) {
+	unsigned int i;
+	switch (order) {
+	case 0: for (i = 0; i < n; i++) r[i] = x[i]; break;
+	case 1: for (i = 1; i < n; i++) r[i] = x[i] - x[i - 1]; break;
+	case 2: for (i = 2; i < n; i++) r[i] = x[i] - 2 * x[i - 1] + x[i - 2]; break;
+	case 3: for (i = 3; i < n; i++) r[i] = x[i] - 3 * x[i - 1] + 3 * x[i - 2] - x[i - 3]; break;
+	case 4: for (i = 4; i < n; i++) r[i] = x[i] - 4 * x[i - 1] + 6 * x[i - 2] - 4 * x[i - 3] + x[i - 4]; break;
+	}
+}
+
+/* Tukey(0.5) window */
+static void make_window(flac_enc_t *e, unsigned int n) {
+	unsigned int i, np = n / 4;
+	if (e->window_n == n) return;
+	for (i = 0; i < n; i++) e->window[i] = 1.0;
+	if (np > 1)
+		for (i = 0; i < np; i++) {
+			double w = 0.5 - 0.5 * cos(M_PI * (double) i / (double) (np - 1));
+			e->window[i] = w;
+			e->window[n - 1 - i] = w;
+		}
+	e->window_n = n;
+}
+
+/* LPC coefficients of all orders up to max_order from the autocorrelation
+   (Levinson-Durbin), returns the highest order computed */
+static int lpc_coefs(const double *ac, int max_order, double lp[][FLAC_MAX_LPC], double *err) {
+	double a[FLAC_MAX_LPC], e = ac[0];
+	int i, j;
+	for (i = 0; i < max_order; i++) {
+		double r = -ac[i + 1], t;
+		for (j = 0; j < i; j++) r -= a[j] * ac[i - j];
+		r /= e;
+		a[i] = r;
+		for (j = 0; j < (i >> 1); j++) {
+			t = a[j];
+			a[j] += r * a[i - 1 - j];
+			a[i - 1 - j] += r * t;
+		}
+		if (i & 1) a[j] += a[j] * r;
+		e *= 1.0 - r * r;
+		for (j = 0; j <= i; j++) lp[i][j] = -a[j];
+		err[i] = e;
+		if (e <= 0.0) return i + 1;
+	}
+	return max_order;
+}
+
+/* quantizes the coefficients to prec bits, returns the shift or -1 if
+   they cannot be represented */
+static int lpc_quantize(const double *lp, int order, unsigned int prec, int *q) {
+	double cmax = 0.0, err = 0.0;
+	int i, shift, log2c, qmax = (1 << (prec - 1)) - 1, qmin = -(1 << (prec - 1));
+	for (i = 0; i < order; i++)
+		if (fabs(lp[i]) > cmax) cmax = fabs(lp[i]);
+	if (cmax <= 0.0) return -1;
+	frexp(cmax, &log2c);
+	shift = (int) prec - 1 - log2c;
+	if (shift > 15) shift = 15;
+	if (shift < 0) return -1;
+	/* error feedback keeps the rounding errors from accumulating */
+	for (i = 0; i < order; i++) {
+		long v;
+		err += lp[i] * (double) (1 << shift);
+		v = lround(err);
+		if (v > qmax) v = qmax; else if (v < qmin) v = qmin;
+		q[i] = (int) v;
+		err -= (double) v;
+	}
+	return shift;
+}
+
+/* returns 0 if the residual doesn't fit the Rice coder */
+static int lpc_residual(const int *x, int *r, unsigned int n, int order, const int *q, int shift) {
+	unsigned int i;
+	int j;
+	for (i = order; i < n; i++) {
+		long long sum = 0, v;
+		for (j = 0; j < order; j++)
+			sum += (long long) q[j] * x[i - j - 1];
+		v = (long long) x[i] - (sum >> shift);
+		if (v >= (1ll << 30) || v <= -(1ll << 30)) return 0;
+		r[i] = (int) v;
+	}
+	return 1;
+}
+
+/* the smallest encoding of x using e->res as scratch, sf->res points to the result */
+static void choose_subframe(flac_enc_t *e, const int *x, unsigned int n, unsigned int bps, subframe_t *sf) {
+	unsigned int i, o;
+	int *cand = e->res[1], *spare = e->res[2];
+	sf->type = 1;
+	sf->res = 0;
+	sf->bits = (unsigned long long) n * bps;
+	if (n <= 4) return;
+	/* fixed predictor with the smallest residual */
+	o = fixed_best(x, n, 0);
+	fixed_residual(x, e->res[0], n, o);
+	{
+		rice_t rc;
+		unsigned long long bits = (unsigned long long) o * bps + rice_choose(e->res[0], n, o, e->max_po, &rc);
+		if (bits < sf->bits) {
+			sf->type = 2;
+			sf->order = o;
+			sf->rice = rc;
+			sf->res = e->res[0];
+			sf->bits = bits;
+		}
+	}
+	if (e->max_lpc && n > (unsigned int) e->max_lpc) {
+		double ac[FLAC_MAX_LPC + 1], lp[FLAC_MAX_LPC][FLAC_MAX_LPC], err[FLAC_MAX_LPC];
+		int max_order = e->max_lpc, order, lo, hi;
+		unsigned int prec = (n <= 1152) ? 10 : ((n <= 2304) ? 11 : 12);
+		make_window(e, n);
+		for (i = 0; i < n; i++) e->wdata[i] = (double) x[i] * e->window[i];
+		for (order = 0; order <= max_order; order++) {
+			double s = 0.0;
+			for (i = order; i < n; i++) s += e->wdata[i] * e->wdata[i - order];
+			ac[order] = s;
+		}
+		if (ac[0] > 0.0) {
+			max_order = lpc_coefs(ac, max_order, lp, err);
+			if (e->exhaustive) {
+				lo = 1;
+				hi = max_order;
+			} else {
+				/* order with the lowest expected size (as estimated by libFLAC) */
+				double best = 1e300, scale = 0.5 / (double) n;
+				lo = 1;
+				for (order = 1; order <= max_order; order++) {
+					double r = err[order - 1], bits;
+					bits = (r > 0.0) ? 0.5 * log2(scale * r) : 0.0;
+					if (bits < 0.0) bits = 0.0;
+					bits = bits * (double) (n - order) + (double) (order * (bps + prec));
+					if (bits < best) {
+						best = bits;
+						lo = order;
+					}
+				}
+				hi = lo;
+			}
+			for (order = lo; order <= hi; order++) {
+				int q[FLAC_MAX_LPC], shift = lpc_quantize(lp[order - 1], order, prec, q);
+				rice_t rc;
+				unsigned long long bits;
+				if (shift < 0 || !lpc_residual(x, cand, n, order, q, shift)) continue;
+				bits = (unsigned long long) order * (bps + prec) + 9 + rice_choose(cand, n, order, e->max_po, &rc);
+				if (bits < sf->bits) {
+					int *t = cand;
+					sf->type = 3;
+					sf->order = order;
+					sf->prec = prec;
+					sf->shift = shift;
+					memcpy(sf->coef, q, sizeof(int) * order);
+					sf->rice = rc;
+					sf->res = cand;
+					sf->bits = bits;
+					cand = spare;
+					spare = t;
+				}
+			}
+		}
+	}
+}
+
+static void encode_subframe(flac_enc_t *e, bitw_t *w, const int *x, unsigned int n, unsigned int bps) {
+	subframe_t sf;
+	unsigned int i, wasted = 0, acc = 0;
+	for (i = 1; i < n && x[i] == x[0]; i++) ;
+	if (i == n) { /* constant */
+		put_bits(w, 8, 0);
+		put_bits(w, bps, (unsigned int) x[0]);
+		return;
+	}
+	for (i = 0; i < n; i++) acc |= (unsigned int) x[i];
+	/* low bits that are always zero are not coded */
+	while (!(acc & 1)) {
+		acc >>= 1;
+		wasted++;
+	}
+	if (wasted) {
+		for (i = 0; i < n; i++) e->shifted[i] = x[i] >> wasted;
+		x = e->shifted;
+		bps -= wasted;
+	}
+	choose_subframe(e, x, n, bps, &sf);
+	put_bits(w, 1, 0);
+	put_bits(w, 6, (sf.type == 1) ? 1 : ((sf.type == 2) ? (8 + sf.order) : (31 + sf.order)));
+	if (wasted) {
+		put_bits(w, 1, 1);
+		put_unary(w, wasted - 1);
+	} else
+		put_bits(w, 1, 0);
+	if (sf.type == 1) {
+		for (i = 0; i < n; i++) put_bits(w, bps, (unsigned int) x[i]);
+		return;
+	}
+	for (i = 0; i < sf.order; i++) put_bits(w, bps, (unsigned int) x[i]);
+	if (sf.type == 3) {
+		put_bits(w, 4, sf.prec - 1);
+		put_bits(w, 5, (unsigned int) sf.shift);
+		for (i = 0; i < sf.order; i++) put_bits(w, sf.prec, (unsigned int) sf.coef[i]);
+	}
+	rice_write(w, sf.res, n, sf.order, &sf.rice);
+}
+
+/* rough size of a channel with the best Rice parameter, used to pick the stereo mode */
+static unsigned long long stereo_estimate(const int *x, unsigned int n) {
+	unsigned long long sum;
+	unsigned int k;
+	fixed_best(x, n, &sum);
+	k = rice_k(sum, n - 4);
+	return (unsigned long long) (n - 4) * (k + 1) + (sum >> k);
+}
+
+static int enc_frame(flac_enc_t *e) {
+	static const unsigned int rates[] = { 0, 88200, 176400, 192000, 8000, 16000, 22050, 24000, 32000, 44100, 48000, 96000 };
+	unsigned int n = e->pending, i, bs, sr = 0, assign = e->chs - 1, hl;
+	unsigned char *p = e->out;
+	bitw_t w;
+	if (e->error || !n) return !e->error;
+	for (i = 1; i < 12; i++)
+		if (e->rate == rates[i]) sr = i;
+	if (n == e->block) bs = (n == 4096) ? 12 : 3; /* 1152 */
+	else bs = (n <= 256) ? 6 : 7;
+	/* frame header */
+	p[0] = 0xff;
+	p[1] = 0xf8;
+	if (e->stereo && n > 4) {
+		int *l = e->smp, *r = e->smp + e->block;
+		unsigned long long el, er, em, es, best;
+		for (i = 0; i < n; i++) {
+			e->mid[i] = (l[i] + r[i]) >> 1;
+			e->side[i] = l[i] - r[i];
+		}
+		el = stereo_estimate(l, n);
+		er = stereo_estimate(r, n);
+		em = stereo_estimate(e->mid, n);
+		es = stereo_estimate(e->side, n);
+		best = el + er;
+		if (el + es < best) { best = el + es; assign = 8; }
+		if (es + er < best) { best = es + er; assign = 9; }
+		if (em + es < best) assign = 10;
+	}
+	p[2] = (unsigned char) ((bs << 4) | sr);
+	p[3] = (unsigned char) ((assign << 4) | (((e->bps == 8) ? 1 : ((e->bps == 16) ? 4 : 6)) << 1));
+	hl = 4 + put_utf8(p + 4, e->frames);
+	if (bs == 6) p[hl++] = (unsigned char) (n - 1);
+	else if (bs == 7) {
+		p[hl++] = (unsigned char) ((n - 1) >> 8);
+		p[hl++] = (unsigned char) (n - 1);
+	}
+	p[hl] = (unsigned char) flac_crc8(p, hl);
+	hl++;
+	w.p = p;
+	w.len = hl;
+	w.acc = 0;
+	w.n = 0;
+	if (assign < 8)
+		for (i = 0; i < e->chs; i++)
+			encode_subframe(e, &w, e->smp + i * e->block, n, e->bps);
+	else {
+		encode_subframe(e, &w, (assign == 9) ? e->side : ((assign == 10) ? e->mid : e->smp), n, e->bps + (assign == 9));
+		encode_subframe(e, &w, (assign == 9) ? (e->smp + e->block) : e->side, n, e->bps + (assign != 9));
+	}
+	if (w.n) put_bits(&w, 8 - w.n, 0);
+	i = flac_crc16(p, w.len);
+	p[w.len++] = (unsigned char) (i >> 8);
+	p[w.len++] = (unsigned char) i;
+	if (e->frames % e->seek_blocks == 0) {
+		if (e->seek_n == e->seek_max) {
+			unsigned int m = e->seek_max ? e->seek_max * 2 : 64;
+			unsigned long long *ns = (unsigned long long*) realloc(e->seek_sample, sizeof(unsigned long long) * m),
+				*no = ns ? (unsigned long long*) realloc(e->seek_offset, sizeof(unsigned long long) * m) : 0;
+			if (ns) e->seek_sample = ns;
+			if (no) e->seek_offset = no;
+			if (!ns || !no) return !(e->error = 1);
+			e->seek_max = m;
+		}
+		e->seek_sample[e->seek_n] = e->total;
+		e->seek_offset[e->seek_n++] = e->bytes;
+	}
+	if (fwrite(p, 1, w.len, e->f) != w.len)
+		return !(e->error = 1);
+	if (w.len < e->min_frame) e->min_frame = (unsigned int) w.len;
+	if (w.len > e->max_frame) e->max_frame = (unsigned int) w.len;
+	e->bytes += w.len;
+	e->total += n;
+	e->frames++;
+	e->pending = 0;
+	return 1;
+}
+
+/* x are interleaved frames in [-1, 1], returns 0 on error */
+static int enc_write(flac_enc_t *e, const double *x, size_t frames) {
+	unsigned int ch, chs = e->chs;
+	double lo = -e->scale, hi = e->scale - 1.0;
+	while (frames && !e->error) {
+		unsigned int n = e->block - e->pending, i;
+		if (n > frames) n = (unsigned int) frames;
+		for (i = 0; i < n; i++, x += chs)
+			for (ch = 0; ch < chs; ch++) {
+				double v = x[ch];
+				/* truncation doesn't clip, so clip here (NaNs are silence) */
+				v = (v > e->vmax) ? e->vmax : ((v < -1.0) ? -1.0 : ((v == v) ? v : 0.0));
+				e->smp[ch * e->block + e->pending + i] = dither_quantize(&e->dth, v, ch, e->scale, lo, hi);
+			}
+		e->pending += n;
+		frames -= n;
+		if (e->pending == e->block && !enc_frame(e))
+			return 0;
+	}
+	return !e->error;
+}
+
+/* encodes the last block, updates the metadata and frees the encoder */
+static int enc_close(flac_enc_t *e) {
+	int ok = enc_frame(e);
+	if (!e->frames) e->min_frame = 0;
+	ok = ok && write_streaminfo(e) && write_seektable(e);
+	if (e->f && fclose(e->f)) ok = 0;
+	e->f = 0;
+	enc_free(e);
+	return ok;
+}
+
+/* --- R interface --- */
+
+static void flac_cleanup(FILE *f, flac_info_t *fi, flac_input_t *in, flac_frame_t *frames) {
+	if (f) fclose(f);
+	free(fi->seek_sample);
+	free(fi->seek_offset);
+	free(in->buf);
+	free(frames);
+}
+
+SEXP load_flac_file(SEXP src, SEXP sStart, SEXP sEnd, SEXP sThreads) {
+	const char *fName, *err;
+	FILE *f;
+	flac_info_t fi;
+	flac_input_t in;
+	flac_decoder_t dec;
+	flac_frame_t *frames = 0;
+	unsigned long long start, end = 0, expect = 0, seek_sample = 0, seek_offset = 0;
+	int n_frames = 0, max_frames = 0, found = 0, threads, i;
+	size_t pos, limit;
+	double ds = Rf_asReal(sStart), de = Rf_asReal(sEnd);
+	SEXP res;
+
+	if (Rf_inherits(src, "connection"))
+		Rf_error("sorry, connections are not supported yet");
+	if (TYPEOF(src) != STRSXP || LENGTH(src) < 1)
+		Rf_error("invalid file name");
+	if (ISNAN(ds) || ds < 0.0)
+		Rf_error("invalid start");
+	if (!ISNAN(de) && de <= ds)
+		Rf_error("end must be past start");
+	start = (unsigned long long) ds;
+	flac_crc_init();
+	memset(&in, 0, sizeof(in));
+	fName = CHAR(STRING_ELT(src, 0));
+	if (!(f = fopen(fName, "rb")))
+		Rf_error("unable to open file '%s'", fName);
+	if ((err = read_metadata(f, &fi))) {
+		flac_cleanup(f, &fi, &in, frames);
+		Rf_error("%s", err);
+	}
+	end = ISNAN(de) ? 0 : (unsigned long long) de;
+	if (fi.total && (!end || end > fi.total)) end = fi.total;
+	if (fi.total && start >= fi.total) {
+		flac_cleanup(f, &fi, &in, frames);
+		Rf_error("start is past the end of the file (%g frames)", (double) fi.total);
+	}
+
+	/* pass 1: start at the last seek point before start and locate all
+	   frames up to end. Only the bytes needed are read. */
+	for (i = 0; i < fi.seek_points; i++)
+		if (fi.seek_sample[i] <= start && fi.seek_sample[i] >= seek_sample) {
+			seek_sample = fi.seek_sample[i];
+			seek_offset = fi.seek_offset[i];
+		}
+	if (fseek(f, fi.first + (long) seek_offset, SEEK_SET)) {
+		flac_cleanup(f, &fi, &in, frames);
+		Rf_error("invalid seek table");
+	}
+	in.f = f;
+	expect = seek_sample;
+	pos = 0;
+	while (1) {
+		unsigned long long sample;
+		unsigned int block, chan, bps;
+		const unsigned char *sync;
+		int hl;
+		if (input_need(&in, pos + 32) < 0) {
+			flac_cleanup(f, &fi, &in, frames);
+			Rf_error("out of memory");
+		}
+		if (pos + 6 > in.len) {
+			limit = in.len;
+			break;
+		}
+		if (in.buf[pos] == 0xff && (in.buf[pos + 1] & 0xfe) == 0xf8 &&
+			(hl = parse_header(in.buf + pos, in.len - pos, &fi, &sample, &block, &chan, &bps)) &&
+			sample == expect) {
+			if (end && sample >= end) {
+				limit = pos;
+				break;
+			}
+			found++;
+			expect = sample + block;
+			/* the seek point may be a few frames before start */
+			if (sample + block > start) {
+				if (n_frames == max_frames) {
+					flac_frame_t *nf;
+					max_frames = max_frames ? max_frames * 2 : 1024;
+					if (!(nf = (flac_frame_t*) realloc(frames, sizeof(flac_frame_t) * max_frames))) {
+						flac_cleanup(f, &fi, &in, frames);
+						Rf_error("out of memory");
+					}
+					frames = nf;
+				}
+				frames[n_frames].offset = pos;
+				frames[n_frames].sample = sample;
+				frames[n_frames].block = block;
+				n_frames++;
+			}
+			pos += hl + 2; /* header and CRC-16 at least */
+			continue;
+		}
+		if (!found && pos > 65536 + (size_t) fi.max_block * 32) {
+			flac_cleanup(f, &fi, &in, frames);
+			Rf_error("no valid frame found at the seek point, the file is corrupt");
+		}
+		/* next sync code candidate */
+		sync = (const unsigned char*) memchr(in.buf + pos + 1, 0xff, in.len - pos - 1);
+		pos = sync ? (size_t) (sync - in.buf) : in.len;
+	}
+	fclose(f);
+	f = 0;
+	if (!n_frames || frames[0].sample > start) {
+		flac_cleanup(f, &fi, &in, frames);
+		Rf_error(n_frames ? "the file is corrupt" : "start is past the end of the file");
+	}
+	if (!end || end > expect) end = expect;
+
+	res = Rf_protect(Rf_allocVector(REALSXP, (R_xlen_t) ((end - start) * fi.chs)));
+	memset(&dec, 0, sizeof(dec));
+	dec.fi = &fi;
+	dec.buf = in.buf;
+	dec.buf_len = limit;
+	dec.frames = frames;
+	dec.n_frames = n_frames;
+	dec.start = start;
+	dec.end = end;
+	dec.out = REAL(res);
+	dec.scale = 1.0 / ((double) (1ull << (fi.bps - 1)));
+
+	/* pass 2: decode */
+	threads = Rf_asInteger(sThreads);
+#if HAS_PTHREAD
+	if (threads == NA_INTEGER) {
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = (cores > 8) ? 8 : ((cores < 1) ? 1 : (int) cores);
+	}
+	/* each thread should have a reasonable amount of work */
+	if (threads > n_frames / 16) threads = n_frames / 16;
+	if (threads > 64) threads = 64;
+	if (threads > 1) {
+		pthread_t tid[64];
+		int started = 0;
+		pthread_mutex_init(&dec.lock, 0);
+		/* the calling thread is one of the workers */
+		for (i = 1; i < threads; i++)
+			if (!pthread_create(&tid[started], 0, decode_worker, &dec))
+				started++;
+		decode_worker(&dec);
+		for (i = 0; i < started; i++)
+			pthread_join(tid[i], 0);
+		pthread_mutex_destroy(&dec.lock);
+	} else
+#else
+	if (threads != NA_INTEGER && threads > 1)
+		Rf_warning("threads are not supported on this platform, decoding sequentially");
+#endif
+	decode_worker(&dec);
+	if (dec.error) {
+		double at = (double) frames[dec.error - 1].sample;
+		flac_cleanup(f, &fi, &in, frames);
+		Rf_error("corrupt FLAC frame at sample %.0f", at);
+	}
+
+	Rf_setAttrib(res, Rf_install("rate"), Rf_ScalarInteger(fi.rate));
+	Rf_setAttrib(res, Rf_install("bits"), Rf_ScalarInteger(fi.bps));
+	Rf_setAttrib(res, R_ClassSymbol, Rf_mkString("audioSample"));
+	if (fi.chs > 1) {
+		SEXP dim = Rf_allocVector(INTSXP, 2);
+		INTEGER(dim)[0] = fi.chs;
+		INTEGER(dim)[1] = (int) (end - start);
+		Rf_setAttrib(res, R_DimSymbol, dim);
+	}
+	flac_cleanup(f, &fi, &in, frames);
+	Rf_unprotect(1);
+	return res;
+}
+
+/* bits of the encoded samples from the "bits" attribute, FLAC decoders
+   commonly support up to 24 */
+static unsigned int flac_bits(int bits) {
+	return (bits == 8 || bits == 24) ? (unsigned int) bits : ((bits == 32) ? 24 : 16);
+}
+
+static int flac_level(SEXP sLevel) {
+	int level = Rf_asInteger(sLevel);
+	if (level == NA_INTEGER || level < 0 || level > 8)
+		Rf_error("invalid compression level, must be between 0 and 8");
+	return level;
+}
+
+SEXP save_flac_file(SEXP where, SEXP what, SEXP sLevel, SEXP sDither) {
+	const char *fName, *err;
+	flac_enc_t *enc;
+	unsigned int rate = 44100, chs = 1, bits = 16;
+	int level = flac_level(sLevel), dither = Rf_asInteger(sDither), ok;
+	SEXP dim = Rf_getAttrib(what, R_DimSymbol);
+
+	if (TYPEOF(dim) == INTSXP && LENGTH(dim) > 1) {
+		if (INTEGER(dim)[0] < 1 || INTEGER(dim)[0] > FLAC_MAX_CHANNELS)
+			Rf_error("FLAC supports only up to %d channels", FLAC_MAX_CHANNELS);
+		chs = INTEGER(dim)[0];
+	}
+	dim = Rf_getAttrib(what, Rf_install("bits"));
+	if (TYPEOF(dim) == INTSXP || TYPEOF(dim) == REALSXP)
+		bits = flac_bits(Rf_asInteger(dim));
+	dim = Rf_getAttrib(what, Rf_install("rate"));
+	if (TYPEOF(dim) == INTSXP || TYPEOF(dim) == REALSXP)
+		rate = Rf_asInteger(dim);
+	if (rate < 1 || rate > 655350)
+		Rf_error("invalid sample rate");
+	if (TYPEOF(what) != REALSXP)
+		Rf_error("saved object must be in real form");
+	if (dither < DITHER_NONE || dither > DITHER_SHAPED) dither = DITHER_NONE;
+	if (Rf_inherits(where, "connection"))
+		Rf_error("sorry, connections are not supported yet");
+	if (TYPEOF(where) != STRSXP || LENGTH(where) < 1)
+		Rf_error("invalid file name");
+
+	fName = CHAR(STRING_ELT(where, 0));
+	if (!(enc = enc_open(fName, rate, chs, bits, level, dither, XLENGTH(what) / chs, &err)))
+		Rf_error("%s '%s'", err, fName);
+	ok = enc_write(enc, REAL(what), XLENGTH(what) / chs);
+	/* the file is closed even if writing failed */
+	if (!enc_close(enc) || !ok)
+		Rf_error("write error");
+	return R_NilValue;
+}
+
+/* --- streaming sink for open-ended recordings --- */
+
+/* Chunks are handed over by R while the engine is serviced and encoded
+   on a worker thread, so neither the audio callback nor R wait for the
+   encoder. Without threads the chunks are encoded as they arrive. */
+
+typedef struct flac_sink {
+	ae_sink_t sink;             /* must be first */
+	flac_enc_t *enc;
+	unsigned int chs;
+	int error;
+#if HAS_PTHREAD
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	ae_chunk_t *head, *tail;    /* (lock) chunks waiting for the encoder */
+	int closing;                /* (lock) */
+	int threaded;
+#endif
+	char path[1];
+} flac_sink_t;
+
+static int sink_encode(flac_sink_t *fs, ae_chunk_t *ch) {
+	int ok = enc_write(fs->enc, ch->data, ch->frames);
+	free(ch);
+	return ok;
+}
+
+#if HAS_PTHREAD
+static void *sink_thread(void *arg) {
+	flac_sink_t *fs = (flac_sink_t*) arg;
+	pthread_mutex_lock(&fs->lock);
+	while (1) {
+		ae_chunk_t *ch = fs->head;
+		int ok;
+		if (!ch) {
+			if (fs->closing) break;
+			pthread_cond_wait(&fs->cond, &fs->lock);
+			continue;
+		}
+		fs->head = ch->next;
+		if (!fs->head) fs->tail = 0;
+		ok = !fs->error;
+		pthread_mutex_unlock(&fs->lock);
+		/* after an error chunks are only released */
+		if (ok) ok = sink_encode(fs, ch); else free(ch);
+		pthread_mutex_lock(&fs->lock);
+		if (!ok) fs->error = 1;
+	}
+	pthread_mutex_unlock(&fs->lock);
+	return 0;
+}
+#endif
+
+static int flac_sink_write(ae_sink_t *s, ae_chunk_t *ch) {
+	flac_sink_t *fs = (flac_sink_t*) s;
+#if HAS_PTHREAD
+	if (fs->threaded) {
+		int error;
+		ch->next = 0;
+		pthread_mutex_lock(&fs->lock);
+		if (fs->tail) fs->tail->next = ch; else fs->head = ch;
+		fs->tail = ch;
+		error = fs->error;
+		pthread_cond_signal(&fs->cond);
+		pthread_mutex_unlock(&fs->lock);
+		return !error;
+	}
+#endif
+	if (fs->error) {
+		free(ch);
+		return 0;
+	}
+	return (fs->error = !sink_encode(fs, ch)) ? 0 : 1;
+}
+
+static int flac_sink_close(ae_sink_t *s, ae_chunk_t *last) {
+	flac_sink_t *fs = (flac_sink_t*) s;
+	int ok;
+#if HAS_PTHREAD
+	if (fs->threaded) {
+		pthread_mutex_lock(&fs->lock);
+		fs->closing = 1;
+		pthread_cond_signal(&fs->cond);
+		pthread_mutex_unlock(&fs->lock);
+		pthread_join(fs->thread, 0);
+		pthread_mutex_destroy(&fs->lock);
+		pthread_cond_destroy(&fs->cond);
+	}
+#endif
+	if (last) {
+		if (fs->error) free(last);
+		else if (!sink_encode(fs, last)) fs->error = 1;
+	}
+	ok = enc_close(fs->enc) && !fs->error;
+	free(fs);
+	return ok;
+}
+
+ae_sink_t *flac_sink_new(const char *path, float rate, int chs, int level) {
+	flac_sink_t *fs;
+	const char *err;
+	if (chs < 1 || chs > FLAC_MAX_CHANNELS)
+		Rf_error("FLAC supports only up to %d channels", FLAC_MAX_CHANNELS);
+	if (level < 0 || level > 8)
+		Rf_error("invalid compression level, must be between 0 and 8");
+	if (!(fs = (flac_sink_t*) calloc(1, sizeof(flac_sink_t) + strlen(path))))
+		Rf_error("out of memory");
+	strcpy(fs->path, path);
+	fs->chs = chs;
+	fs->sink.write = flac_sink_write;
+	fs->sink.close = flac_sink_close;
+	fs->sink.name = fs->path;
+	if (!(fs->enc = enc_open(path, (unsigned int) (rate + 0.5), chs, 16, level, DITHER_NONE, 0, &err))) {
+		free(fs);
+		Rf_error("%s '%s'", err, path);
+	}
+#if HAS_PTHREAD
+	pthread_mutex_init(&fs->lock, 0);
+	pthread_cond_init(&fs->cond, 0);
+	if (!pthread_create(&fs->thread, 0, sink_thread, fs))
+		fs->threaded = 1;
+	else {
+		pthread_mutex_destroy(&fs->lock);
+		pthread_cond_destroy(&fs->cond);
+	}
+#endif
+	return &fs->sink;
+}
@@ -0,0 +1,453 @@
+/* Audio driver for R using the JACK Audio Connection Kit
+   audio R package
+   Copyright(c) 2026 Simon Urbanek
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation
+   files (the "Software"), to deal in the Software without
+   restriction, including without limitation the rights to use, copy,
+   modify, merge, publish, distribute, sublicense, and/or sell copies
+   of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   * The above copyright notice and this permission notice shall be
+     included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND ON
+   INFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR
+   ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+   CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+   WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+   The text above constitutes the entire license; however, the
+   PortAudio community also makes the following non-binding requests:
+
+   * Any person wishing to distribute modifications to the Software is
+     requested to send the modifications to the original developer so
+     that they can be incorporated into the canonical version. It is
+     also requested that these non-binding requests be included along
+     with the license above.
+
+ */
+
+#include "driver.h"
+#if HAS_JACK
+#include <string.h>
+#include <stdio.h>
+#include <sys/select.h>
+#include "engine.h"
+
+#include <jack/jack.h>
+
+/* Each instance is a JACK client with one port per channel. The
+   process callback renders directly into the (float) port buffers and
+   the instance runs at the rate and buffer size of the server. */
+
+#define BOOL int
+#ifndef YES
+#define YES 1
+#define NO  0
+#endif
+
+typedef struct jack_info {
+	/* the following entries must be present since jack_info_t inherits from audio_instance_t */
+	audio_driver_t *driver;  /* must point to the driver that created this */
+	int kind;                /* AI_PLAYER, AI_RECORDER or AI_DUPLEX */
+	SEXP source;
+	audio_engine_t *engine;
+	/* private entries */
+	jack_client_t *client;
+	jack_port_t *out[AE_MAX_CHANNELS], *in[AE_MAX_CHANNELS];
+	float sample_rate;
+	int device;              /* client to connect to, -1 for the physical ports */
+	BOOL active;             /* (R) the client has been activated */
+	BOOL done;               /* (audio) end of the source or target reached */
+	/* full-duplex instances: `source'/`engine' are the target and the
+	   capture engine, the played source has its own engine */
+	SEXP play_source;
+	audio_engine_t *play;
+} jack_info_t;
+
+/* the engine that renders the output (if any) and the capturing one */
+#define PLAY_ENGINE(P)    (((P)->kind == AI_DUPLEX) ? (P)->play : (((P)->kind == AI_PLAYER) ? (P)->engine : 0))
+#define CAPTURE_ENGINE(P) (((P)->kind == AI_PLAYER) ? 0 : (P)->engine)
+
+/* audio thread: device time at which the first frame of this cycle
+   leaves (or entered) the graph */
+static double port_time(jack_info_t *p, jack_port_t *port, int playback) {
+	jack_latency_range_t range;
+	jack_port_get_latency_range(port, playback ? JackPlaybackLatency : JackCaptureLatency, &range);
+	return audio_engine_clock() + (playback ? 1.0 : -1.0) * ((double) range.max) / p->sample_rate;
+}
+
+static int jack_process(jack_nframes_t nframes, void *arg) {
+	jack_info_t *p = (jack_info_t*) arg;
+	audio_engine_t *out = PLAY_ENGINE(p), *in = CAPTURE_ENGINE(p);
+	double start = audio_engine_clock();
+	int c;
+	if (out) {
+		float *buf[AE_MAX_CHANNELS];
+		unsigned int rem = 0;
+		for (c = 0; c < out->chs; c++)
+			buf[c] = (float*) jack_port_get_buffer(p->out[c], nframes);
+		if (!AE_LOAD(p->done)) {
+			audio_engine_timestamp(out, port_time(p, p->out[0], 1));
+			rem = audio_engine_render_planar(out, buf, nframes);
+		}
+		/* the graph expects full buffers, pad with silence */
+		if (rem < nframes)
+			for (c = 0; c < out->chs; c++)
+				memset(buf[c] + rem, 0, sizeof(float) * (nframes - rem));
+		/* players are done at the end of the source, duplex streams
+		   keep recording with silence */
+		if (rem == 0 && !in)
+			AE_STORE(p->done, YES);
+		audio_engine_callback_done(out, start, nframes);
+	}
+	if (in && !AE_LOAD(p->done)) {
+		const float *buf[AE_MAX_CHANNELS];
+		unsigned int i = 0, chs = in->chs;
+		for (c = 0; c < chs; c++)
+			buf[c] = (const float*) jack_port_get_buffer(p->in[c], nframes);
+		audio_engine_timestamp(in, port_time(p, p->in[0], 0));
+		if (out) {
+			/* a frame written now appears in the input after the
+			   playback and capture latency of the graph */
+			jack_latency_range_t play, capture;
+			jack_port_get_latency_range(p->out[0], JackPlaybackLatency, &play);
+			jack_port_get_latency_range(p->in[0], JackCaptureLatency, &capture);
+			AE_STORE(in->io_offset, (int) (play.max + capture.max));
+		}
+		/* interleave in blocks, the capture engine doesn't use its
+		   scratch buffer otherwise */
+		while (i < nframes) {
+			unsigned int n = nframes - i, j, k = 0;
+			if (n > AE_BLOCK) n = AE_BLOCK;
+			for (j = i; j < i + n; j++)
+				for (c = 0; c < chs; c++)
+					in->buf[k++] = (double) buf[c][j];
+			audio_engine_capture(in, in->buf, n);
+			i += n;
+		}
+		audio_engine_callback_done(in, start, nframes);
+		/* the recording is complete when the target is full */
+		if (AE_LOAD(in->position) >= in->length || in->stopped)
+			AE_STORE(p->done, YES);
+	}
+	return 0;
+}
+
+static int jack_xrun(void *arg) {
+	jack_info_t *p = (jack_info_t*) arg;
+	if (PLAY_ENGINE(p))
+		audio_engine_xrun(PLAY_ENGINE(p), 1, 0);
+	if (CAPTURE_ENGINE(p))
+		audio_engine_xrun(CAPTURE_ENGINE(p), 0, 1);
+	return 0;
+}
+
+/* the server went away, the client is unusable */
+static void jack_shutdown(void *arg) {
+	jack_info_t *p = (jack_info_t*) arg;
+	AE_STORE(p->done, YES);
+}
+
+/* (R) character option or the default if unset */
+static const char *string_option(const char *name, const char *def) {
+	SEXP o = Rf_GetOption1(Rf_install(name));
+	return (TYPEOF(o) == STRSXP && LENGTH(o) > 0) ? CHAR(STRING_ELT(o, 0)) : def;
+}
+
+static jack_client_t *try_client(jack_status_t *status) {
+	return jack_client_open(string_option("audio.jack.client", "R"), JackNoStartServer, status);
+}
+
+static jack_client_t *open_client(const char *what) {
+	jack_status_t status;
+	jack_client_t *client = try_client(&status);
+	if (!client)
+		Rf_error("cannot connect to the JACK server%s (status 0x%x)", what, (unsigned int) status);
+	return client;
+}
+
+/* the device list consists of the clients of the graph (the physical
+   ports are usually the "system" client), it is built by jack_devices() */
+typedef struct jack_device {
+	char *name;
+	int out, in;             /* ports we can write to / read from */
+} jack_device_t;
+
+static jack_device_t *jack_device_list;
+static int jack_ndevices;
+
+static void jack_dispose(void *usr);
+
+static audio_instance_t *jack_open(const audio_config_t *cfg) {
+	jack_info_t *p;
+	audio_engine_t *engine, *play = 0;
+	jack_status_t status;
+	jack_nframes_t rate;
+	int c, chs;
+	char name[32];
+	/* the engines raise R errors, so they are created before the client
+	   is opened. The rate is only known once we are connected, the
+	   engines merely store it. The played source is more likely to
+	   fail (e.g. a used reader), so it goes first. */
+	if (cfg->kind == AI_PLAYER)
+		engine = audio_engine_new(cfg->source, 0.0, 0, cfg->flags);
+	else {
+		if (cfg->kind == AI_DUPLEX)
+			play = audio_engine_new(cfg->source, 0.0, 0, cfg->flags & ~APFLAG_UNBOUNDED);
+		engine = audio_engine_new(cfg->target, 0.0, cfg->channels, cfg->flags & APFLAG_UNBOUNDED);
+	}
+	if (!(p = (jack_info_t*) calloc(1, sizeof(jack_info_t)))) {
+		audio_engine_free(engine);
+		audio_engine_free(play);
+		Rf_error("out of memory");
+	}
+	p->kind = cfg->kind;
+	p->device = cfg->device;
+	p->engine = engine;
+	p->source = (cfg->kind == AI_PLAYER) ? cfg->source : cfg->target;
+	R_PreserveObject(p->source);
+	if ((p->play = play)) {
+		p->play_source = cfg->source;
+		R_PreserveObject(p->play_source);
+	}
+	if (!(p->client = try_client(&status))) {
+		jack_dispose(p);
+		Rf_error("cannot connect to the JACK server (status 0x%x)", (unsigned int) status);
+	}
+	/* instances run at the server rate */
+	rate = jack_get_sample_rate(p->client);
+	p->sample_rate = (float) rate;
+	if (cfg->rate > 0.0 && (unsigned int) (cfg->rate + 0.5) != rate) {
+		jack_dispose(p);
+		Rf_error("the JACK server runs at %u Hz, the requested rate is %g Hz", (unsigned int) rate, (double) cfg->rate);
+	}
+	p->engine->rate = p->sample_rate;
+	if (p->play) p->play->rate = p->sample_rate;
+	if (PLAY_ENGINE(p))
+		for (c = 0, chs = PLAY_ENGINE(p)->chs; c < chs; c++) {
+			snprintf(name, sizeof(name), "out_%d", c + 1);
+			if (!(p->out[c] = jack_port_register(p->client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0))) {
+				jack_dispose(p);
+				Rf_error("cannot register JACK port '%s'", name);
+			}
+		}
+	if (CAPTURE_ENGINE(p))
+		for (c = 0, chs = CAPTURE_ENGINE(p)->chs; c < chs; c++) {
+			snprintf(name, sizeof(name), "in_%d", c + 1);
+			if (!(p->in[c] = jack_port_register(p->client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0))) {
+				jack_dispose(p);
+				Rf_error("cannot register JACK port '%s'", name);
+			}
+		}
+	jack_set_process_callback(p->client, jack_process, p);
+	jack_set_xrun_callback(p->client, jack_xrun, p);
+	jack_on_shutdown(p->client, jack_shutdown, p);
+	return (audio_instance_t*) p;
+}
+
+/* (R) connect our ports to the ports of the selected client (or the
+   physical ports), ports[] are our ports with n channels and flags
+   describe the ports of the other side */
+static void autoconnect(jack_info_t *p, jack_port_t **ports, int n, unsigned long flags) {
+	const char **peer;
+	const char *client = (p->device >= 0 && p->device < jack_ndevices) ? jack_device_list[p->device].name : 0;
+	size_t len = client ? strlen(client) : 0;
+	int i, c = 0;
+	if (!client && !(flags & JackPortIsPhysical))
+		return;
+	if (!(peer = jack_get_ports(p->client, 0, JACK_DEFAULT_AUDIO_TYPE, flags)))
+		return;
+	for (i = 0; peer[i] && c < n; i++)
+		if (!client || (!strncmp(peer[i], client, len) && peer[i][len] == ':')) {
+			const char *own = jack_port_name(ports[c++]);
+			if (flags & JackPortIsInput)
+				jack_connect(p->client, own, peer[i]);
+			else
+				jack_connect(p->client, peer[i], own);
+		}
+	jack_free(peer);
+}
+
+static int jack_caps(audio_caps_t *caps) {
+	caps->flags = ACAP_PLAY | ACAP_RECORD | ACAP_DUPLEX | ACAP_DEVICES | ACAP_ENGINE;
+	caps->formats = AFMT_F32;
+	caps->native_format = AFMT_F32;
+	caps->max_in = AE_MAX_CHANNELS;
+	caps->max_out = AE_MAX_CHANNELS;
+	/* rate and buffer size are set by the server (unknown until a
+	   client connects), so they are left unspecified */
+	return 1;
+}
+
+static int jack_devices(void) {
+	jack_client_t *client = open_client(" to list devices");
+	const char **ports = jack_get_ports(client, 0, JACK_DEFAULT_AUDIO_TYPE, 0);
+	int i, j, n = 0;
+	for (i = 0; i < jack_ndevices; i++)
+		free(jack_device_list[i].name);
+	free(jack_device_list);
+	jack_device_list = 0;
+	jack_ndevices = 0;
+	if (ports) {
+		while (ports[n]) n++;
+		jack_device_list = (jack_device_t*) calloc(n + 1, sizeof(jack_device_t));
+		for (i = 0; jack_device_list && i < n; i++) {
+			const char *colon = strchr(ports[i], ':');
+			jack_port_t *port = jack_port_by_name(client, ports[i]);
+			int flags = port ? jack_port_flags(port) : 0;
+			size_t len = colon ? (size_t) (colon - ports[i]) : strlen(ports[i]);
+			for (j = 0; j < jack_ndevices; j++)
+				if (strlen(jack_device_list[j].name) == len && !strncmp(jack_device_list[j].name, ports[i], len))
+					break;
+			if (j == jack_ndevices) {
+				if (!(jack_device_list[j].name = (char*) malloc(len + 1)))
+					break;
+				memcpy(jack_device_list[j].name, ports[i], len);
+				jack_device_list[j].name[len] = 0;
+				jack_ndevices++;
+			}
+			/* their inputs are our outputs */
+			if (flags & JackPortIsInput)
+				jack_device_list[j].out++;
+			if (flags & JackPortIsOutput)
+				jack_device_list[j].in++;
+		}
+		jack_free(ports);
+	}
+	jack_client_close(client);
+	return jack_ndevices;
+}
+
+static int jack_device_info(int index, audio_device_info_t *di) {
+	if (index < 0 || index >= jack_ndevices) return 0;
+	di->name = jack_device_list[index].name;
+	di->host_api = "JACK";
+	di->max_out = jack_device_list[index].out;
+	di->max_in = jack_device_list[index].in;
+	di->is_default_out = di->is_default_in = !strcmp(di->name, "system");
+	return 1;
+}
+
+static int jack_start(void *usr) {
+	jack_info_t *p = (jack_info_t*) usr;
+	SEXP sConnect = Rf_GetOption1(Rf_install("audio.jack.connect"));
+	/* physical ports unless disabled or a client was selected */
+	unsigned long phys = (p->device < 0 && (sConnect == R_NilValue || Rf_asLogical(sConnect) == 1)) ? JackPortIsPhysical : 0;
+	p->done = NO;
+	if (p->active)
+		return YES;
+	if (jack_activate(p->client))
+		Rf_error("cannot activate JACK client");
+	p->active = YES;
+	/* ports can only be connected once the client is active */
+	if (PLAY_ENGINE(p))
+		autoconnect(p, p->out, PLAY_ENGINE(p)->chs, JackPortIsInput | phys);
+	if (CAPTURE_ENGINE(p))
+		autoconnect(p, p->in, CAPTURE_ENGINE(p)->chs, JackPortIsOutput | phys);
+	return YES;
+}
+
+/* pause and resume are executed by the process callback, the client
+   stays in the graph */
+static int jack_pause(void *usr) {
+	jack_info_t *p = (jack_info_t*) usr;
+	if (p->play && !audio_engine_post(p->play, AE_CMD_PAUSE, 0, 0, 0, 0, 0.0))
+		return 0;
+	return audio_engine_post(p->engine, AE_CMD_PAUSE, 0, 0, 0, 0, 0.0);
+}
+
+static int jack_resume(void *usr) {
+	jack_info_t *p = (jack_info_t*) usr;
+	AE_STORE(p->done, NO);
+	if (p->play && !audio_engine_post(p->play, AE_CMD_RESUME, 0, 0, 0, 0, 0.0))
+		return 0;
+	return audio_engine_post(p->engine, AE_CMD_RESUME, 0, 0, 0, 0, 0.0);
+}
+
+static int jack_rewind(void *usr) {
+	jack_info_t *p = (jack_info_t*) usr;
+	audio_engine_rewind(p->engine);
+	if (p->play) audio_engine_rewind(p->play);
+	return 1;
+}
+
+/* helper function - precise sleep */
+static void millisleep(double tout) {
+	struct timeval tv;
+	tv.tv_sec  = (unsigned int) tout;
+	tv.tv_usec = (unsigned int)((tout - ((double)tv.tv_sec)) * 1000000.0);
+	select(0, 0, 0, 0, &tv);
+}
+
+static int jack_wait(void *usr, double timeout) {
+	jack_info_t *p = (jack_info_t*) usr;
+	if (timeout < 0) timeout = 9999999.0; /* really a dummy high number */
+	while (p == NULL || !AE_LOAD(p->done)) {
+		/* use 100ms slices */
+		double slice = (timeout > 0.1) ? 0.1 : timeout;
+		if (slice <= 0.0) break;
+		millisleep(slice);
+		if (p) audio_engine_service(p->engine); /* refill function sources */
+		if (p && p->play) audio_engine_service(p->play);
+		R_CheckUserInterrupt(); /* FIXME: we should adjust for time spent processing events */
+		timeout -= slice;
+	}
+	return (p && AE_LOAD(p->done)) ? WAIT_DONE : WAIT_TIMEOUT;
+}
+
+static int jack_close(void *usr) {
+	jack_info_t *p = (jack_info_t*) usr;
+	if (p->client) {
+		if (p->active)
+			jack_deactivate(p->client);
+		jack_client_close(p->client);
+		p->client = 0;
+		p->active = NO;
+	}
+	return 1;
+}
+
+static void jack_dispose(void *usr) {
+	jack_info_t *p = (jack_info_t*) usr;
+	jack_close(p);
+	audio_engine_free(p->engine);
+	R_ReleaseObject(p->source);
+	if (p->play) {
+		audio_engine_free(p->play);
+		R_ReleaseObject(p->play_source);
+	}
+	free(usr);
+}
+
+/* define the audio driver */
+audio_driver_t jack_audio_driver = {
+	sizeof(audio_driver_t),
+
+	"jack",
+	"JACK Audio Connection Kit driver",
+	"Copyright(c) 2026 Simon Urbanek",
+
+	0, /* only the v2 open entry is used */
+	0,
+	jack_start,
+	jack_pause,
+	jack_resume,
+	jack_rewind,
+	jack_wait,
+	jack_close,
+	jack_dispose,
+
+	jack_caps,
+	jack_devices,
+	jack_device_info,
+	jack_open
+};
+
+#endif
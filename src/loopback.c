@@ -0,0 +1,403 @@
+/* In-process loopback audio driver for testing and benchmarking
+   audio R package
+   Copyright(c) 2026 Simon Urbanek
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation
+   files (the "Software"), to deal in the Software without
+   restriction, including without limitation the rights to use, copy,
+   modify, merge, publish, distribute, sublicense, and/or sell copies
+   of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   * The above copyright notice and this permission notice shall be
+     included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND ON
+   INFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR
+   ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+   CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+   WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+   The text above constitutes the entire license; however, the
+   PortAudio community also makes the following non-binding requests:
+
+   * Any person wishing to distribute modifications to the Software is
+     requested to send the modifications to the original developer so
+     that they can be incorporated into the canonical version. It is
+     also requested that these non-binding requests be included along
+     with the license above.
+
+ */
+
+#include "driver.h"
+#if HAS_PTHREAD
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/select.h>
+#include "engine.h"
+
+/* All instances share one virtual stereo bus which is clocked by a
+   thread in cycles of `buffer' frames. Each cycle the output of all
+   players is mixed into the bus and every recorder captures the bus
+   delayed by `latency' frames. The recorders' clock can run faster or
+   slower than the bus (drift), the bus is then resampled by linear
+   interpolation. The bus time (frames mixed / rate) is the stream time
+   of all instances, so position() relates them exactly. In real-time
+   mode cycles are paced by the system clock, otherwise they run as
+   fast as possible (but only while an instance is active). */
+
+#define BUS_CHANNELS 2
+#define kDefaultBufferSize 512
+
+#define BOOL int
+#ifndef YES
+#define YES 1
+#define NO  0
+#endif
+
+typedef struct loop_info {
+	/* the following entries must be present since loop_info_t inherits from audio_instance_t */
+	audio_driver_t *driver;  /* must point to the driver that created this */
+	int kind;                /* must be either AI_PLAYER or AI_RECORDER */
+	SEXP source;
+	audio_engine_t *engine;
+	/* private entries */
+	float sample_rate;
+	double rpos;             /* (bus) recorders: next frame of the bus to capture */
+	BOOL attached;           /* (R) on the bus */
+	BOOL done;               /* (bus) end of the source or target reached */
+	struct loop_info *next;  /* (lock) */
+} loop_info_t;
+
+static pthread_mutex_t bus_lock = PTHREAD_MUTEX_INITIALIZER; /* held by the bus for each cycle */
+
+static struct {
+	BOOL running;            /* (lock) the bus thread exists */
+	loop_info_t *instances;  /* (lock) */
+	float rate;
+	unsigned int buffer, latency, ring_size;
+	double step;             /* bus frames per captured frame */
+	BOOL realtime;
+	unsigned long long written; /* frames mixed so far */
+	double *ring;            /* bus history, ring_size frames */
+	double *mix;             /* one buffer of the bus */
+	float *tmp;              /* player output */
+	double cap[AE_BLOCK * BUS_CHANNELS];
+} bus;
+
+/* (bus) mix the players into the bus, returns the number of active ones */
+static int bus_play(void) {
+	loop_info_t *p;
+	unsigned int i, n = bus.buffer;
+	int active = 0;
+	memset(bus.mix, 0, sizeof(double) * n * BUS_CHANNELS);
+	for (p = bus.instances; p; p = p->next) {
+		audio_engine_t *e = p->engine;
+		double start = audio_engine_clock();
+		unsigned int rem;
+		if (p->kind != AI_PLAYER || AE_LOAD(p->done)) continue;
+		active++;
+		audio_engine_timestamp(e, ((double) bus.written) / bus.rate);
+		rem = audio_engine_render_f32(e, bus.tmp, n);
+		/* mono players are heard on both channels */
+		for (i = 0; i < rem * BUS_CHANNELS; i++)
+			bus.mix[i] += (double) bus.tmp[(e->chs == 1) ? (i / BUS_CHANNELS) : i];
+		audio_engine_callback_done(e, start, n);
+		if (rem == 0)
+			AE_STORE(p->done, YES);
+	}
+	for (i = 0; i < n; i++)
+		memcpy(bus.ring + ((bus.written + i) % bus.ring_size) * BUS_CHANNELS, bus.mix + i * BUS_CHANNELS,
+			   sizeof(double) * BUS_CHANNELS);
+	bus.written += n;
+	return active;
+}
+
+/* (bus) frame of the bus at a fractional position, silence before the start */
+static void bus_frame(double pos, double *out) {
+	double f;
+	unsigned long long i;
+	const double *a, *b;
+	int c;
+	if (pos < 0.0) {
+		for (c = 0; c < BUS_CHANNELS; c++) out[c] = 0.0;
+		return;
+	}
+	i = (unsigned long long) pos;
+	f = pos - (double) i;
+	a = bus.ring + (i % bus.ring_size) * BUS_CHANNELS;
+	b = bus.ring + ((i + 1) % bus.ring_size) * BUS_CHANNELS;
+	for (c = 0; c < BUS_CHANNELS; c++)
+		out[c] = a[c] + f * (b[c] - a[c]);
+}
+
+/* (bus) feed the recorders with everything that has passed the
+   latency, returns the number of active ones */
+static int bus_record(void) {
+	loop_info_t *p;
+	int active = 0;
+	for (p = bus.instances; p; p = p->next) {
+		audio_engine_t *e = p->engine;
+		double start = audio_engine_clock();
+		unsigned int total = 0;
+		if (p->kind != AI_RECORDER || AE_LOAD(p->done)) continue;
+		active++;
+		/* a recorder that fell behind by more than the history has
+		   overrun, it continues with the current input */
+		if ((double) bus.written - p->rpos > (double) (bus.ring_size - 2)) {
+			audio_engine_xrun(e, 0, 1);
+			p->rpos = (double) bus.written - (double) bus.latency - (double) bus.buffer;
+		}
+		audio_engine_timestamp(e, (p->rpos + (double) bus.latency) / bus.rate);
+		/* the interpolation needs the following frame */
+		while (p->rpos + 1.0 < (double) bus.written) {
+			unsigned int n = 0;
+			double frame[BUS_CHANNELS], *d = bus.cap;
+			while (n < AE_BLOCK && p->rpos + 1.0 < (double) bus.written) {
+				bus_frame(p->rpos - (double) bus.latency, frame);
+				if (e->chs == 1)
+					*(d++) = 0.5 * (frame[0] + frame[1]);
+				else {
+					*(d++) = frame[0];
+					*(d++) = frame[1];
+				}
+				p->rpos += bus.step;
+				n++;
+			}
+			audio_engine_capture(e, bus.cap, n);
+			total += n;
+		}
+		audio_engine_callback_done(e, start, total);
+		/* the recording is complete when the target is full */
+		if (AE_LOAD(e->position) >= e->length || e->stopped)
+			AE_STORE(p->done, YES);
+	}
+	return active;
+}
+
+/* helper function - precise sleep */
+static void millisleep(double tout) {
+	struct timeval tv;
+	tv.tv_sec  = (unsigned int) tout;
+	tv.tv_usec = (unsigned int)((tout - ((double)tv.tv_sec)) * 1000000.0);
+	select(0, 0, 0, 0, &tv);
+}
+
+static void *bus_thread(void *arg) {
+	double t0 = audio_engine_clock(), period = ((double) bus.buffer) / bus.rate;
+	unsigned long long cycles = 0;
+	while (1) {
+		int active;
+		pthread_mutex_lock(&bus_lock);
+		if (!bus.instances) {
+			bus.running = NO;
+			pthread_mutex_unlock(&bus_lock);
+			break;
+		}
+		active = bus_play();
+		active += bus_record();
+		/* without real-time pacing the bus only advances while
+		   there is something to do */
+		if (!bus.realtime && !active)
+			bus.written -= bus.buffer;
+		pthread_mutex_unlock(&bus_lock);
+		cycles++;
+		if (bus.realtime) {
+			double wait = t0 + ((double) cycles) * period - audio_engine_clock();
+			if (wait > 0.0) millisleep(wait);
+		} else if (!active)
+			millisleep(0.01);
+	}
+	return 0;
+}
+
+/* (R) numeric option or the default if unset */
+static double real_option(const char *name, double def) {
+	SEXP o = Rf_GetOption1(Rf_install(name));
+	double v;
+	if (o == R_NilValue || LENGTH(o) < 1 || ISNAN(v = Rf_asReal(o)))
+		return def;
+	return v;
+}
+
+/* (R, lock) set up the bus from the options before its thread starts */
+static void bus_setup(float rate) {
+	double latency = real_option("audio.loopback.latency", 0.0), drift = real_option("audio.loopback.drift", 0.0);
+	double buffer = real_option("audio.buffer", kDefaultBufferSize);
+	if (latency < 0.0 || latency > 60.0 || buffer < 16.0 || buffer > 65536.0 || drift <= -1e6) {
+		pthread_mutex_unlock(&bus_lock);
+		Rf_error("invalid loopback settings (latency must be 0..60s, buffer 16..65536 frames)");
+	}
+	bus.rate = rate;
+	bus.buffer = (unsigned int) buffer;
+	bus.latency = (unsigned int) (latency * rate + 0.5);
+	/* drift is in ppm of the recorder clock relative to the bus */
+	bus.step = 1.0 / (1.0 + drift * 1e-6);
+	bus.realtime = (real_option("audio.loopback.realtime", 1.0) != 0.0);
+	bus.ring_size = bus.latency + 4 * bus.buffer + 4;
+	bus.written = 0;
+	free(bus.ring);
+	free(bus.mix);
+	free(bus.tmp);
+	bus.ring = (double*) calloc(bus.ring_size, sizeof(double) * BUS_CHANNELS);
+	bus.mix = (double*) malloc(sizeof(double) * bus.buffer * BUS_CHANNELS);
+	bus.tmp = (float*) malloc(sizeof(float) * bus.buffer * BUS_CHANNELS);
+	if (!bus.ring || !bus.mix || !bus.tmp) {
+		pthread_mutex_unlock(&bus_lock);
+		Rf_error("out of memory");
+	}
+}
+
+static loop_info_t *loopback_create(SEXP source, float rate, int chs, int kind, int flags) {
+	loop_info_t *p = (loop_info_t*) calloc(1, sizeof(loop_info_t));
+	if (!p) Rf_error("out of memory");
+	p->kind = kind;
+	p->sample_rate = (rate > 0.0) ? rate : 44100.0;
+	p->source = source;
+	p->engine = audio_engine_new(source, p->sample_rate, chs, flags);
+	R_PreserveObject(p->source);
+	return p;
+}
+
+static audio_instance_t *loopback_create_player(SEXP source, float rate, int flags) {
+	return (audio_instance_t*) loopback_create(source, rate, 0, AI_PLAYER, flags);
+}
+
+static audio_instance_t *loopback_create_recorder(SEXP source, float rate, int chs, int flags) {
+	return (audio_instance_t*) loopback_create(source, rate, chs, AI_RECORDER, flags);
+}
+
+static int loopback_caps(audio_caps_t *caps) {
+	caps->flags = ACAP_PLAY | ACAP_RECORD | ACAP_ENGINE;
+	caps->formats = AFMT_F32;
+	caps->native_format = AFMT_F32;
+	caps->max_in = BUS_CHANNELS;
+	caps->max_out = BUS_CHANNELS;
+	caps->min_rate = 1000.0;
+	caps->max_rate = 384000.0;
+	caps->default_rate = 44100.0;
+	caps->min_buffer = 16;
+	caps->max_buffer = 65536;
+	return 1;
+}
+
+static int loopback_start(void *usr) {
+	loop_info_t *p = (loop_info_t*) usr;
+	pthread_t thread;
+	AE_STORE(p->done, NO);
+	if (p->attached)
+		return YES;
+	pthread_mutex_lock(&bus_lock);
+	if (!bus.running)
+		bus_setup(p->sample_rate);
+	else if (bus.rate != p->sample_rate) {
+		pthread_mutex_unlock(&bus_lock);
+		Rf_error("the loopback bus runs at %g Hz, close all instances to change the rate", (double) bus.rate);
+	}
+	/* recorders hear the bus from now on */
+	p->rpos = (double) bus.written;
+	p->next = bus.instances;
+	bus.instances = p;
+	p->attached = YES;
+	if (!bus.running) {
+		if (pthread_create(&thread, 0, bus_thread, 0)) {
+			bus.instances = p->next;
+			p->attached = NO;
+			pthread_mutex_unlock(&bus_lock);
+			Rf_error("cannot create audio thread");
+		}
+		pthread_detach(thread);
+		bus.running = YES;
+	}
+	pthread_mutex_unlock(&bus_lock);
+	return YES;
+}
+
+static int loopback_pause(void *usr) {
+	loop_info_t *p = (loop_info_t*) usr;
+	return audio_engine_post(p->engine, AE_CMD_PAUSE, 0, 0, 0, 0, 0.0);
+}
+
+static int loopback_resume(void *usr) {
+	loop_info_t *p = (loop_info_t*) usr;
+	AE_STORE(p->done, NO);
+	return audio_engine_post(p->engine, AE_CMD_RESUME, 0, 0, 0, 0, 0.0);
+}
+
+static int loopback_rewind(void *usr) {
+	loop_info_t *p = (loop_info_t*) usr;
+	audio_engine_rewind(p->engine);
+	return 1;
+}
+
+static int loopback_wait(void *usr, double timeout) {
+	loop_info_t *p = (loop_info_t*) usr;
+	if (timeout < 0) timeout = 9999999.0; /* really a dummy high number */
+	while (p == NULL || !AE_LOAD(p->done)) {
+		/* use 100ms slices (shorter ones without real-time pacing) */
+		double slice = (timeout > 0.1) ? 0.1 : timeout;
+		if (!bus.realtime && slice > 0.005) slice = 0.005;
+		if (slice <= 0.0) break;
+		millisleep(slice);
+		if (p) audio_engine_service(p->engine); /* refill function sources */
+		R_CheckUserInterrupt(); /* FIXME: we should adjust for time spent processing events */
+		timeout -= slice;
+	}
+	return (p && AE_LOAD(p->done)) ? WAIT_DONE : WAIT_TIMEOUT;
+}
+
+/* the bus thread exits once the last instance is closed */
+static int loopback_close(void *usr) {
+	loop_info_t *p = (loop_info_t*) usr, **l;
+	if (!p->attached)
+		return 1;
+	pthread_mutex_lock(&bus_lock);
+	for (l = &bus.instances; *l; l = &(*l)->next)
+		if (*l == p) {
+			*l = p->next;
+			break;
+		}
+	p->attached = NO;
+	AE_STORE(p->done, YES);
+	pthread_mutex_unlock(&bus_lock);
+	return 1;
+}
+
+static void loopback_dispose(void *usr) {
+	loop_info_t *p = (loop_info_t*) usr;
+	loopback_close(p);
+	audio_engine_free(p->engine);
+	R_ReleaseObject(p->source);
+	free(usr);
+}
+
+/* define the audio driver */
+audio_driver_t loopback_audio_driver = {
+	sizeof(audio_driver_t),
+
+	"loopback",
+	"In-process loopback driver (players are heard by recorders)",
+	"Copyright(c) 2026 Simon Urbanek",
+
+	loopback_create_player,
+	loopback_create_recorder,
+	loopback_start,
+	loopback_pause,
+	loopback_resume,
+	loopback_rewind,
+	loopback_wait,
+	loopback_close,
+	loopback_dispose,
+
+	loopback_caps,
+	0, /* no devices */
+	0,
+	0  /* instances are created by create_player/create_recorder */
+};
+
+#endif
@@ -34,6 +34,8 @@
 
 #include "driver.h"
 #if HAS_PA
+#include <string.h>
+#include "engine.h"
 
 #include "portaudio.h"
 
@@ -49,7 +51,7 @@
 #endif
 
 #define kNumberOutputBuffers 2
-/* #define USEFLOAT 1 */
+#define kDefaultFramesPerBuffer 1024
 
 #define BOOL int
 #ifndef YES
@@ -59,16 +61,26 @@
 
 typedef signed short int SInt16;
 
+#define SAMPLE_SIZE(P) (((P)->format == AFMT_F32) ? sizeof(float) : sizeof(SInt16))
+#define PA_FORMAT(P) (((P)->format == AFMT_F32) ? paFloat32 : paInt16)
+
 typedef struct play_info {
 	/* the following entries must be present since play_info_t inherits from audio_instance_t */
 	audio_driver_t *driver;  /* must point to the driver that created this */
 	int kind;                /* must be either AI_PLAYER or AI_RECORDER */
 	SEXP source;
+	audio_engine_t *engine;
 	/* private entries */
 	PaStream *stream;
 	float sample_rate;
-	BOOL stereo, loop, done;
-	unsigned int position, length;
+	int format;              /* AFMT_S16 or AFMT_F32 */
+	int buffer;              /* frames per buffer */
+	int device;              /* device index, -1 for the default */
+	BOOL done;
+	/* full-duplex instances: `source'/`engine' are the target and the
+	   capture engine, the played source has its own engine */
+	SEXP play_source;
+	audio_engine_t *play;
 } play_info_t;
 	
 static int paPlayCallback(const void *inputBuffer, void *outputBuffer,
@@ -78,95 +90,253 @@ static int paPlayCallback(const void *inputBuffer, void *outputBuffer,
 						  void *userData )
 {
 	play_info_t *ap = (play_info_t*)userData; 
-	if (ap->done) return paAbort;
-	/* Rprintf("paPlayCallback(in=%p, out=%p, fpb=%d, usr=%p)\n", inputBuffer, outputBuffer, (int) framesPerBuffer, userData);
-	//Rprintf(" - (sample_rate=%f, stereo=%d, loop=%d, done=%d, pos=%d, len=%d)\n", ap->sample_rate, ap->stereo, ap->loop, ap->done, ap->position, ap->length); */
-	if (ap->position == ap->length && ap->loop)
-		ap->position = 0;
-	unsigned int index = ap->position;
-	unsigned int rem = ap->length - index;
-	unsigned int spf = ap->stereo ? 2 : 1;
-	if (rem > framesPerBuffer) rem = framesPerBuffer;
-	/* printf("position=%d, length=%d, (LEN=%d), rem=%d, cap=%d, spf=%d\n", ap->position, ap->length, LENGTH(ap->source), rem, framesPerBuffer, spf); */
-	index *= spf;
-	/* there is a small caveat - if a zero-size buffer comes along it will stop the playback since rem will be forced to 0 - but then that should not happen ... */
-	if (rem > 0) {
-		unsigned int samples = rem * spf; // samples (i.e. SInt16s)
-#ifdef USEFLOAT
-		float *iBuf = (float*) outputBuffer;
-		float *sentinel = iBuf + samples;
-		/* printf(" iBuf = %p, sentinel = %p, diff = %d bytes\n", iBuf, sentinel, ((char*)sentinel) - ((char*)iBuf)); */
-		if (TYPEOF(ap->source) == INTSXP) {
-			int *iSrc = INTEGER(ap->source) + index;
-			while (iBuf < sentinel)
-				*(iBuf++) = ((float) *(iSrc++)) / 32768.0;
-		} else if (TYPEOF(ap->source) == REALSXP) {
-			double *iSrc = REAL(ap->source) + index;
-			while (iBuf < sentinel)
-				*(iBuf++) = (float) *(iSrc++);
-			/* { int i = 0; while (i < framesPerBuffer) printf("%.2f ", ((float*) outputBuffer)[i++]); Rprintf("\n"); } */
-		} /* FIXME: support functions as sources... */
-#else
-		SInt16 *iBuf = (SInt16*) outputBuffer;
-		SInt16 *sentinel = iBuf + samples;
-		if (TYPEOF(ap->source) == INTSXP) {
-			int *iSrc = INTEGER(ap->source) + index;
-			while (iBuf < sentinel)
-				*(iBuf++) = (SInt16) *(iSrc++);
-		} else if (TYPEOF(ap->source) == REALSXP) {
-			double *iSrc = REAL(ap->source) + index;
-			while (iBuf < sentinel)
-				*(iBuf++) = (SInt16) (32767.0 * (*(iSrc++)));
-		} /* FIXME: support functions as sources... */
-#endif
-		ap->position += rem;
-	} else {
+	unsigned int rem;
+	double start = audio_engine_clock();
+	if (AE_LOAD(ap->done)) return paAbort;
+	/* the first frame of this buffer reaches the DAC at outputBufferDacTime */
+	audio_engine_timestamp(ap->engine, (timeInfo && timeInfo->outputBufferDacTime > 0.0) ?
+						   timeInfo->outputBufferDacTime : Pa_GetStreamTime(ap->stream));
+	/* Rprintf("paPlayCallback(in=%p, out=%p, fpb=%d, usr=%p)\n", inputBuffer, outputBuffer, (int) framesPerBuffer, userData); */
+	if (statusFlags & (paOutputUnderflow | paInputOverflow))
+		audio_engine_xrun(ap->engine, (statusFlags & paOutputUnderflow) ? 1 : 0, (statusFlags & paInputOverflow) ? 1 : 0);
+	if (ap->format == AFMT_F32)
+		rem = audio_engine_render_f32(ap->engine, (float*) outputBuffer, framesPerBuffer);
+	else
+		rem = audio_engine_render_s16(ap->engine, (SInt16*) outputBuffer, framesPerBuffer);
+	if (rem == 0) {
 		/* printf(" rem ==0 -> stop queue\n"); */
-		ap->done = YES;
+		AE_STORE(ap->done, YES);
+		audio_engine_callback_done(ap->engine, start, framesPerBuffer);
+		return paComplete;
+	}
+	/* the stream expects full buffers, pad with silence */
+	if (rem < framesPerBuffer)
+		memset(((char*) outputBuffer) + rem * ap->engine->chs * SAMPLE_SIZE(ap), 0,
+			   (framesPerBuffer - rem) * ap->engine->chs * SAMPLE_SIZE(ap));
+	audio_engine_callback_done(ap->engine, start, framesPerBuffer);
+	return 0;
+}
+
+/* both directions use the same sample format and run in one callback,
+   so the captured frames are aligned with the played ones */
+static int paDuplexCallback(const void *inputBuffer, void *outputBuffer,
+							unsigned long framesPerBuffer,
+							const PaStreamCallbackTimeInfo* timeInfo,
+							PaStreamCallbackFlags statusFlags,
+							void *userData )
+{
+	play_info_t *ap = (play_info_t*)userData;
+	audio_engine_t *in = ap->engine, *out = ap->play;
+	unsigned int rem, i = 0, n = framesPerBuffer * in->chs;
+	double start = audio_engine_clock();
+	if (AE_LOAD(ap->done)) return paAbort;
+	if (timeInfo) {
+		audio_engine_timestamp(out, timeInfo->outputBufferDacTime);
+		audio_engine_timestamp(in, timeInfo->inputBufferAdcTime);
+		/* a frame written now reaches the DAC at outputBufferDacTime, so
+		   it appears in the input that many frames after the ADC time
+		   of this buffer */
+		AE_STORE(in->io_offset, (int) ((timeInfo->outputBufferDacTime - timeInfo->inputBufferAdcTime) * ap->sample_rate + 0.5));
+	}
+	if (statusFlags & (paOutputUnderflow | paInputOverflow)) {
+		audio_engine_xrun(out, (statusFlags & paOutputUnderflow) ? 1 : 0, 0);
+		audio_engine_xrun(in, 0, (statusFlags & paInputOverflow) ? 1 : 0);
+	}
+	if (ap->format == AFMT_F32)
+		rem = audio_engine_render_f32(out, (float*) outputBuffer, framesPerBuffer);
+	else
+		rem = audio_engine_render_s16(out, (SInt16*) outputBuffer, framesPerBuffer);
+	/* once the source is exhausted we keep recording with silence */
+	if (rem < framesPerBuffer)
+		memset(((char*) outputBuffer) + rem * out->chs * SAMPLE_SIZE(ap), 0,
+			   (framesPerBuffer - rem) * out->chs * SAMPLE_SIZE(ap));
+	/* convert in blocks, the capture engine doesn't use its scratch buffer */
+	while (inputBuffer && i < n) {
+		unsigned int k = 0;
+		if (ap->format == AFMT_F32) {
+			const float *src = (const float*) inputBuffer;
+			while (k < AE_BLOCK * in->chs && i < n)
+				in->buf[k++] = (double) src[i++];
+		} else {
+			const SInt16 *src = (const SInt16*) inputBuffer;
+			while (k < AE_BLOCK * in->chs && i < n)
+				in->buf[k++] = ((double) src[i++]) / 32768.0;
+		}
+		audio_engine_capture(in, in->buf, k / in->chs);
+	}
+	audio_engine_callback_done(out, start, framesPerBuffer);
+	audio_engine_callback_done(in, start, framesPerBuffer);
+	/* the stream is complete when the target is full */
+	if (AE_LOAD(in->position) >= in->length || in->stopped) {
+		AE_STORE(ap->done, YES);
 		return paComplete;
 	}
 	return 0;
 }
 
 static audio_instance_t *portaudio_create_player(SEXP source, float rate, int flags) {
-	PaError err = Pa_Initialize();
-	if( err != paNoError ) Rf_error("cannot initialize audio system: %s\n", Pa_GetErrorText( err ) );
+	audio_engine_t *engine = audio_engine_new(source, rate, 0, flags);
 	play_info_t *ap = (play_info_t*) calloc(sizeof(play_info_t), 1);
 	ap->source = source;
+	ap->engine = engine;
 	R_PreserveObject(ap->source);
 	ap->sample_rate = rate;
+	ap->format = AFMT_S16;
+	ap->buffer = kDefaultFramesPerBuffer;
+	ap->device = -1;
 	ap->done = NO;
-	ap->position = 0;
-	ap->length = LENGTH(source);
-	ap->stereo = NO;
-	{ /* if the source is a matrix with 2 rows then we'll use stereo */
-		SEXP dim = Rf_getAttrib(source, R_DimSymbol);
-		if (TYPEOF(dim) == INTSXP && LENGTH(dim) > 0 && INTEGER(dim)[0] == 2)
-			ap->stereo = YES;
-	}
-	ap->loop = (flags & APFLAG_LOOP) ? YES : NO;
-	if (ap->stereo) ap->length /= 2;
 	return (audio_instance_t*) ap; /* play_info_t is a superset of audio_instance_t */
 }
 
+static audio_instance_t *portaudio_create_duplex(SEXP source, SEXP target, float rate, int chs, int flags) {
+	audio_engine_t *play, *capture;
+	play_info_t *ap;
+	play = audio_engine_new(source, rate, 0, flags & ~APFLAG_UNBOUNDED);
+	capture = audio_engine_new(target, rate, chs, flags & APFLAG_UNBOUNDED);
+	ap = (play_info_t*) calloc(sizeof(play_info_t), 1);
+	if (!ap) {
+		audio_engine_free(play);
+		audio_engine_free(capture);
+		Rf_error("out of memory");
+	}
+	ap->source = target;
+	ap->engine = capture;
+	ap->play_source = source;
+	ap->play = play;
+	R_PreserveObject(ap->source);
+	R_PreserveObject(ap->play_source);
+	ap->sample_rate = rate;
+	ap->format = AFMT_S16;
+	ap->buffer = kDefaultFramesPerBuffer;
+	ap->device = -1;
+	ap->done = NO;
+	return (audio_instance_t*) ap;
+}
+
+static void portaudio_dispose(void *usr);
+
+/* stream parameters for the instance, the input of duplex instances
+   uses the selected device if it has enough input channels */
+static PaError stream_params(play_info_t *p, PaStreamParameters *in, PaStreamParameters *out) {
+	const PaDeviceInfo *info;
+	int ichs = p->play ? p->engine->chs : 0, ochs = p->play ? p->play->chs : p->engine->chs;
+	memset(in, 0, sizeof(PaStreamParameters));
+	memset(out, 0, sizeof(PaStreamParameters));
+	out->device = (p->device >= 0) ? p->device : Pa_GetDefaultOutputDevice();
+	out->channelCount = ochs;
+	out->sampleFormat = PA_FORMAT(p);
+	if (out->device == paNoDevice || !(info = Pa_GetDeviceInfo(out->device)))
+		return paDeviceUnavailable;
+	out->suggestedLatency = info->defaultLowOutputLatency;
+	if (ichs) {
+		in->device = (p->device >= 0 && info->maxInputChannels >= ichs) ? p->device : Pa_GetDefaultInputDevice();
+		in->channelCount = ichs;
+		in->sampleFormat = PA_FORMAT(p);
+		if (in->device == paNoDevice || !(info = Pa_GetDeviceInfo(in->device)))
+			return paDeviceUnavailable;
+		in->suggestedLatency = info->defaultLowInputLatency;
+	}
+	return paNoError;
+}
+
+/* check whether the devices accept the instance parameters */
+static PaError portaudio_supported(play_info_t *p) {
+	PaStreamParameters in, out;
+	PaError err = stream_params(p, &in, &out);
+	if (err != paNoError)
+		return err;
+	return Pa_IsFormatSupported(p->play ? &in : 0, &out, p->sample_rate);
+}
+
+static audio_instance_t *portaudio_open(const audio_config_t *cfg) {
+	play_info_t *p;
+	PaError err;
+	if (cfg->kind == AI_DUPLEX)
+		p = (play_info_t*) portaudio_create_duplex(cfg->source, cfg->target, cfg->rate, cfg->channels, cfg->flags);
+	else
+		p = (play_info_t*) portaudio_create_player(cfg->source, cfg->rate, cfg->flags);
+	p->buffer = (cfg->buffer > 0) ? cfg->buffer : kDefaultFramesPerBuffer;
+	p->device = cfg->device;
+	/* negotiate the format now rather than failing in start: use the
+	   requested one if the device takes it, otherwise 16-bit */
+	p->format = (cfg->format == AFMT_F32) ? AFMT_F32 : AFMT_S16;
+	if ((err = portaudio_supported(p)) != paNoError && p->format != AFMT_S16) {
+		p->format = AFMT_S16;
+		err = portaudio_supported(p);
+	}
+	if (err != paNoError) {
+		portaudio_dispose(p);
+		Rf_error("the audio device doesn't support the requested parameters: %s", Pa_GetErrorText( err ) );
+	}
+	return (audio_instance_t*) p;
+}
+
+/* PortAudio converts between all sample formats, float is the native
+   format of most host APIs */
+static int portaudio_caps(audio_caps_t *caps) {
+	caps->flags = ACAP_PLAY | ACAP_DUPLEX | ACAP_DEVICES | ACAP_ENGINE;
+	caps->formats = AFMT_S16 | AFMT_F32;
+	caps->native_format = AFMT_F32;
+	caps->max_in = AE_MAX_CHANNELS;
+	caps->max_out = AE_MAX_CHANNELS;
+	caps->min_rate = 1000.0;
+	caps->max_rate = 384000.0;
+	caps->default_rate = 44100.0;
+	caps->min_buffer = 16;
+	caps->max_buffer = 16384;
+	return 1;
+}
+
+/* initializing PortAudio scans all host APIs which can take a while,
+   so it is done once on first use (not when the package is loaded) and
+   kept until the driver is released. This also keeps the device
+   indices and strings valid. A failure is reported by the caller. */
+static int portaudio_init(void) {
+	return Pa_Initialize() == paNoError;
+}
+
+static void portaudio_release(void) {
+	Pa_Terminate();
+}
+
+static int portaudio_devices(void) {
+	int n = Pa_GetDeviceCount();
+	return (n < 0) ? 0 : n;
+}
+
+static int portaudio_device_info(int index, audio_device_info_t *di) {
+	const PaDeviceInfo *info = Pa_GetDeviceInfo(index);
+	const PaHostApiInfo *api;
+	if (!info) return 0;
+	api = Pa_GetHostApiInfo(info->hostApi);
+	di->name = info->name;
+	di->host_api = api ? api->name : 0;
+	di->max_out = info->maxOutputChannels;
+	di->max_in = info->maxInputChannels;
+	di->default_rate = info->defaultSampleRate;
+	di->out_latency = info->defaultLowOutputLatency;
+	di->in_latency = info->defaultLowInputLatency;
+	di->is_default_out = (index == Pa_GetDefaultOutputDevice());
+	di->is_default_in = (index == Pa_GetDefaultInputDevice());
+	return 1;
+}
+
 static int portaudio_start(void *usr) {
 	play_info_t *p = (play_info_t*) usr;
+	PaStreamParameters in, out;
 	PaError err;
 	p->done = NO;
 	
-	err = Pa_OpenDefaultStream(&p->stream,
-							   0, /* in ch. */
-							   p->stereo ? 1 : 2, /* out ch */
-#ifdef USEFLOAT
-							   paFloat32,
-#else
-							   paInt16,
-#endif
-							   p->sample_rate,
-							   // paFramesPerBufferUnspecified,
-							   1024,
-							   paPlayCallback,
-							   p );
+	err = stream_params(p, &in, &out);
+	if (err == paNoError)
+		err = Pa_OpenStream(&p->stream,
+							p->play ? &in : 0,
+							&out,
+							p->sample_rate,
+							p->buffer,
+							paNoFlag,
+							p->play ? paDuplexCallback : paPlayCallback,
+							p );
 
 	if( err != paNoError ) Rf_error("cannot open audio for playback: %s\n", Pa_GetErrorText( err ) );
 	err = Pa_StartStream( p->stream );
@@ -174,21 +344,34 @@ static int portaudio_start(void *usr) {
 	return YES;
 }
 
+/* pause and resume are executed by the callback, the stream keeps
+   running with silence so R never has to wait for buffers to drain */
 static int portaudio_pause(void *usr) {
 	play_info_t *p = (play_info_t*) usr;
-	PaError err = Pa_StopStream( p->stream );
-	return (err == paNoError);
+	if (p->play && !audio_engine_post(p->play, AE_CMD_PAUSE, 0, 0, 0, 0, 0.0))
+		return 0;
+	return audio_engine_post(p->engine, AE_CMD_PAUSE, 0, 0, 0, 0, 0.0);
 }
 
 static int portaudio_resume(void *usr) {
 	play_info_t *p = (play_info_t*) usr;
-	PaError err = Pa_StartStream( p->stream );
-	return (err == paNoError);
+	if (AE_LOAD(p->done)) {
+		/* the stream has completed, so it must be restarted (stopping
+		   a completed stream doesn't block) */
+		PaError err = Pa_StopStream( p->stream );
+		AE_STORE(p->done, NO);
+		if (err == paNoError) err = Pa_StartStream( p->stream );
+		if (err != paNoError) return 0;
+	}
+	if (p->play && !audio_engine_post(p->play, AE_CMD_RESUME, 0, 0, 0, 0, 0.0))
+		return 0;
+	return audio_engine_post(p->engine, AE_CMD_RESUME, 0, 0, 0, 0, 0.0);
 }
 
 static int portaudio_rewind(void *usr) {
 	play_info_t *p = (play_info_t*) usr;
-	p->position = 0;
+	audio_engine_rewind(p->engine);
+	if (p->play) audio_engine_rewind(p->play);
 	return 1;
 }
 
@@ -205,7 +388,7 @@ static void millisleep(double tout) {
 static int portaudio_wait(void *usr, double timeout) {
 	play_info_t *p = (play_info_t*) usr;
 	if (timeout < 0) timeout = 9999999.0; /* really a dummy high number */
-	while (p == NULL || !p->done) {
+	while (p == NULL || !AE_LOAD(p->done)) {
 		/* use 100ms slices */
 		double slice = (timeout > 0.1) ? 0.1 : timeout;
 		if (slice <= 0.0) break;
@@ -225,19 +408,29 @@ static int portaudio_wait(void *usr, double timeout) {
 		Sleep((DWORD) (slice * 1000));
 		R_ProcessEvents();
 #endif
+		if (p) audio_engine_service(p->engine); /* refill function sources */
 		timeout -= slice;
 	}
-	return (p && p->done) ? WAIT_DONE : WAIT_TIMEOUT;
+	return (p && AE_LOAD(p->done)) ? WAIT_DONE : WAIT_TIMEOUT;
 }
 
 static int portaudio_close(void *usr) {
 	play_info_t *p = (play_info_t*) usr;
-    PaError err = Pa_CloseStream( p->stream );
+	PaError err;
+	/* let a running callback finish cleanly, closing aborts the stream */
+	audio_engine_post(p->engine, AE_CMD_STOP, 0, 0, 0, 0, 0.0);
+	err = Pa_CloseStream( p->stream );
 	return (err == paNoError);
 }
 
 static void portaudio_dispose(void *usr) {
-	Pa_Terminate();
+	play_info_t *p = (play_info_t*) usr;
+	audio_engine_free(p->engine);
+	R_ReleaseObject(p->source);
+	if (p->play) {
+		audio_engine_free(p->play);
+		R_ReleaseObject(p->play_source);
+	}
 	free(usr);
 }
 
@@ -257,7 +450,15 @@ audio_driver_t portaudio_audio_driver = {
 	portaudio_rewind,
 	portaudio_wait,
 	portaudio_close,
-	portaudio_dispose
+	portaudio_dispose,
+
+	portaudio_caps,
+	portaudio_devices,
+	portaudio_device_info,
+	portaudio_open,
+
+	portaudio_init,
+	portaudio_release
 };
 
 #endif
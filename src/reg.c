@@ -8,3 +8,11 @@ void R_init_audio_(DllInfo *dll)
     R_registerRoutines(dll, NULL, NULL, NULL, NULL);
     R_useDynamicSymbols(dll, FALSE);
 }
+
+void audio_unload_drivers(void);
+
+/* release the backends and driver modules when the package is unloaded */
+void R_unload_audio(DllInfo *dll)
+{
+    audio_unload_drivers();
+}
@@ -0,0 +1,318 @@
+/* Spectral analysis for R
+   audio R package
+   Copyright(c) 2026 Simon Urbanek
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation
+   files (the "Software"), to deal in the Software without
+   restriction, including without limitation the rights to use, copy,
+   modify, merge, publish, distribute, sublicense, and/or sell copies
+   of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   * The above copyright notice and this permission notice shall be
+     included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND ON
+   INFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR
+   ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+   CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+   WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+   The text above constitutes the entire license; however, the
+   PortAudio community also makes the following non-binding requests:
+
+   * Any person wishing to distribute modifications to the Software is
+     requested to send the modifications to the original developer so
+     that they can be incorporated into the canonical version. It is
+     also requested that these non-binding requests be included along
+     with the license above.
+
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define R_NO_REMAP      /* to not pollute the namespace */
+
+#include <R.h>
+#include <Rinternals.h>
+#include <Rversion.h>
+
+#ifdef HAS_CONFIG_H
+#include "config.h"
+#endif
+
+#include "fft.h"
+
+#if HAS_PTHREAD
+#include <pthread.h>
+#include <unistd.h> /* sysconf */
+#endif
+
+/* The short-time Fourier transform is computed in native code without
+   allocations per frame: the frames are distributed over threads which
+   write into disjoint columns of the result. The plan is read-only, so
+   all threads share one, scratch buffers are allocated once per
+   thread. Frames are real, so two frames are transformed at once as
+   the real and imaginary part of one complex transform and separated
+   using the symmetry of the spectrum. */
+
+/* frame pairs taken by a thread at once */
+#define SPEC_GRAIN 16
+/* samples fetched at once from vectors without a data pointer (ALTREP) */
+#define SPEC_REGION (1024 * 1024)
+
+#if (R_VERSION >= R_Version(3,5,0))
+#define HAS_REGIONS 1
+#endif
+
+typedef struct spec_job {
+	const fft_plan_t *plan;
+	const double *win;
+	unsigned int n, bins, chs;
+	R_xlen_t hop;
+	const double *rd;           /* source samples (real) or */
+	const int *ri;              /* (integer), starting with frame `first' */
+	R_xlen_t first, frames;     /* frames to compute in this pass */
+	double *out;                /* bins x frames result (all frames) */
+	R_xlen_t next;              /* next frame pair to compute (relative to `first') */
+#if HAS_PTHREAD
+	pthread_mutex_t lock;
+#endif
+} spec_job_t;
+
+/* windowed frame f (relative to `first'), channels are averaged */
+static void spec_frame(const spec_job_t *j, R_xlen_t f, double *d) {
+	unsigned int i, c, chs = j->chs, n = j->n;
+	R_xlen_t at = f * j->hop * chs;
+	double norm = 1.0 / (double) chs;
+	if (j->rd) {
+		const double *s = j->rd + at;
+		if (chs == 1)
+			for (i = 0; i < n; i++)
+				d[i] = s[i] * j->win[i];
+		else
+			for (i = 0; i < n; i++, s += chs) {
+				double v = 0.0;
+				for (c = 0; c < chs; c++) v += s[c];
+				d[i] = v * norm * j->win[i];
+			}
+	} else { /* integers are 16-bit samples, NAs are silence */
+		const int *s = j->ri + at;
+		norm /= 32767.0;
+		for (i = 0; i < n; i++, s += chs) {
+			double v = 0.0;
+			for (c = 0; c < chs; c++)
+				if (s[c] != NA_INTEGER) v += (double) s[c];
+			d[i] = v * norm * j->win[i];
+		}
+	}
+}
+
+/* one per thread, the scratch buffer holds 2n values */
+typedef struct spec_thread {
+	spec_job_t *job;
+	double *scratch;
+} spec_thread_t;
+
+static void *spec_worker(void *arg) {
+	spec_job_t *j = ((spec_thread_t*) arg)->job;
+	unsigned int n = j->n, bins = j->bins, k;
+	R_xlen_t pairs = (j->frames + 1) / 2;
+	double *re = ((spec_thread_t*) arg)->scratch, *im = re + n;
+	while (1) {
+		R_xlen_t p, end;
+#if HAS_PTHREAD
+		pthread_mutex_lock(&j->lock);
+#endif
+		p = j->next;
+		j->next += SPEC_GRAIN;
+#if HAS_PTHREAD
+		pthread_mutex_unlock(&j->lock);
+#endif
+		if (p >= pairs) break;
+		end = (p + SPEC_GRAIN > pairs) ? pairs : (p + SPEC_GRAIN);
+		for (; p < end; p++) {
+			R_xlen_t a = p * 2, b = a + 1;
+			double *oa = j->out + (j->first + a) * bins, *ob = oa + bins;
+			spec_frame(j, a, re);
+			if (b < j->frames)
+				spec_frame(j, b, im);
+			else
+				memset(im, 0, sizeof(double) * n);
+			fft_transform(j->plan, re, im, 0);
+			/* Z = A + iB, so A[k] = (Z[k] + conj(Z[n-k])) / 2 and B[k] = (Z[k] - conj(Z[n-k])) / 2i */
+			for (k = 0; k < bins; k++) {
+				unsigned int nk = (n - k) & (n - 1);
+				double ar = re[k] + re[nk], ai = im[k] - im[nk];
+				double br = im[k] + im[nk], bi = re[nk] - re[k];
+				oa[k] = 0.5 * sqrt(ar * ar + ai * ai);
+				if (b < j->frames)
+					ob[k] = 0.5 * sqrt(br * br + bi * bi);
+			}
+		}
+	}
+	return 0;
+}
+
+/* computes frames [first, first + frames) using up to `threads' threads,
+   returns 0 if the scratch buffers cannot be allocated */
+static int spec_run(spec_job_t *j, int threads) {
+	spec_thread_t th[64];
+	double *scratch;
+	int i;
+	j->next = 0;
+#if HAS_PTHREAD
+	/* each thread should have a reasonable amount of work */
+	if (threads > j->frames / (4 * SPEC_GRAIN)) threads = (int) (j->frames / (4 * SPEC_GRAIN));
+	if (threads > 64) threads = 64;
+#else
+	threads = 1;
+#endif
+	if (threads < 1) threads = 1;
+	if (!(scratch = (double*) malloc(sizeof(double) * 2 * j->n * threads)))
+		return 0;
+	for (i = 0; i < threads; i++) {
+		th[i].job = j;
+		th[i].scratch = scratch + (size_t) i * 2 * j->n;
+	}
+#if HAS_PTHREAD
+	if (threads > 1) {
+		pthread_t tid[64];
+		int started = 0;
+		pthread_mutex_init(&j->lock, 0);
+		/* the calling thread is one of the workers */
+		for (i = 1; i < threads; i++)
+			if (!pthread_create(&tid[started], 0, spec_worker, &th[i]))
+				started++;
+		spec_worker(&th[0]);
+		for (i = 0; i < started; i++)
+			pthread_join(tid[i], 0);
+		pthread_mutex_destroy(&j->lock);
+		free(scratch);
+		return 1;
+	}
+#endif
+	spec_worker(&th[0]);
+	free(scratch);
+	return 1;
+}
+
+SEXP audio_spectrogram(SEXP x, SEXP sN, SEXP sHop, SEXP sWindow, SEXP sThreads) {
+	int n = Rf_asInteger(sN), hop = Rf_asInteger(sHop), threads = Rf_asInteger(sThreads), chs = 1;
+	R_xlen_t len, frames, f;
+	double rate = 44100.0, *win, *out;
+	fft_plan_t *plan;
+	spec_job_t job;
+	SEXP dim, res, sFreq, sTime;
+	if (TYPEOF(x) != REALSXP && TYPEOF(x) != INTSXP)
+		Rf_error("invalid sample, must be numeric");
+	if (n == NA_INTEGER || n < 2 || (n & (n - 1)))
+		Rf_error("the frame size must be a power of two");
+	if (hop == NA_INTEGER || hop < 1)
+		Rf_error("invalid hop size");
+	if (TYPEOF(sWindow) != REALSXP || LENGTH(sWindow) != n)
+		Rf_error("the window must be a numeric vector of length n");
+	dim = Rf_getAttrib(x, R_DimSymbol);
+	if (TYPEOF(dim) == INTSXP && LENGTH(dim) > 1 && INTEGER(dim)[0] > 0)
+		chs = INTEGER(dim)[0];
+	dim = Rf_getAttrib(x, Rf_install("rate"));
+	if (TYPEOF(dim) == INTSXP || TYPEOF(dim) == REALSXP)
+		rate = Rf_asReal(dim);
+	if (ISNAN(rate) || rate <= 0.0)
+		Rf_error("invalid sample rate");
+	len = XLENGTH(x) / chs;
+	frames = (len < n) ? 0 : ((len - n) / hop + 1);
+	if (threads == NA_INTEGER) {
+#if HAS_PTHREAD
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = (cores > 8) ? 8 : ((cores < 1) ? 1 : (int) cores);
+#else
+		threads = 1;
+#endif
+	}
+#if !HAS_PTHREAD
+	if (threads > 1)
+		Rf_warning("threads are not supported on this platform, computing sequentially");
+#endif
+
+	res = Rf_protect(Rf_allocMatrix(REALSXP, n / 2 + 1, (int) frames));
+	sFreq = Rf_allocVector(REALSXP, n / 2 + 1);
+	Rf_setAttrib(res, Rf_install("freq"), sFreq);
+	for (f = 0; f <= n / 2; f++)
+		REAL(sFreq)[f] = ((double) f) * rate / (double) n;
+	sTime = Rf_allocVector(REALSXP, frames);
+	Rf_setAttrib(res, Rf_install("time"), sTime);
+	for (f = 0; f < frames; f++)
+		REAL(sTime)[f] = ((double) (f * hop)) / rate;
+	Rf_setAttrib(res, Rf_install("rate"), Rf_ScalarReal(rate));
+	if (!frames) {
+		Rf_unprotect(1);
+		return res;
+	}
+	out = REAL(res);
+	win = REAL(sWindow);
+	if (!(plan = fft_plan_new(n)))
+		Rf_error("out of memory");
+
+	memset(&job, 0, sizeof(job));
+	job.plan = plan;
+	job.win = win;
+	job.n = n;
+	job.bins = n / 2 + 1;
+	job.chs = chs;
+	job.hop = hop;
+	job.out = out;
+
+#if HAS_REGIONS
+	/* vectors without a data pointer (e.g., compact sequences) are
+	   not expanded, their samples are fetched region by region on this
+	   thread (ALTREP methods may call R), the frames of each region are
+	   then computed in parallel */
+	if (!DATAPTR_OR_NULL(x)) {
+		R_xlen_t batch = (SPEC_REGION / chs - n) / hop + 1;
+		void *buf;
+		if (batch < 1) batch = 1;
+		buf = R_alloc((size_t) (((batch - 1) * hop + n) * chs), (TYPEOF(x) == REALSXP) ? sizeof(double) : sizeof(int));
+		for (f = 0; f < frames; f += batch) {
+			R_xlen_t nf = (frames - f > batch) ? batch : (frames - f);
+			R_xlen_t start = f * hop * chs, size = ((nf - 1) * hop + n) * chs;
+			if (TYPEOF(x) == REALSXP) {
+				REAL_GET_REGION(x, start, size, (double*) buf);
+				job.rd = (const double*) buf;
+			} else {
+				INTEGER_GET_REGION(x, start, size, (int*) buf);
+				job.ri = (const int*) buf;
+			}
+			job.first = f;
+			job.frames = nf;
+			if (!spec_run(&job, threads)) {
+				fft_plan_free(plan);
+				Rf_error("out of memory");
+			}
+		}
+		fft_plan_free(plan);
+		Rf_unprotect(1);
+		return res;
+	}
+#endif
+	/* the data pointer of memory-mapped vectors is used as-is */
+	if (TYPEOF(x) == REALSXP)
+		job.rd = REAL(x);
+	else
+		job.ri = INTEGER(x);
+	job.first = 0;
+	job.frames = frames;
+	if (!spec_run(&job, threads)) {
+		fft_plan_free(plan);
+		Rf_error("out of memory");
+	}
+	fft_plan_free(plan);
+	Rf_unprotect(1);
+	return res;
+}
@@ -35,6 +35,8 @@
 #include "driver.h"
 
 #if HAS_WMM
+#include "engine.h"
+#include <math.h>
 #include <windows.h>
 
 #define kNumberOutputBuffers 3
@@ -48,15 +50,16 @@ typedef struct wmm_instance {
 	audio_driver_t *driver;  /* must point to the driver that created this */
 	int kind;                /* must be either AI_PLAYER or AI_RECORDER */
 	SEXP source;
+	audio_engine_t *engine;
 	/* private entries */
 	HWAVEOUT hout;
 	HWAVEIN hin;
 	char *bufOut[(kNumberOutputBuffers > kNumberInputBuffers) ? kNumberOutputBuffers : kNumberInputBuffers];
 	WAVEHDR bufOutHdr[(kNumberOutputBuffers > kNumberInputBuffers) ? kNumberOutputBuffers : kNumberInputBuffers];
 	float sample_rate;
-	BOOL stereo, loop, done;
-	unsigned int position, length;
+	BOOL stereo, done;
 	int dequeued; /* set to non-zero if any buffers have been dequeued (e.g. at the end of playback) */
+	UINT dev;     /* device identifier or WAVE_MAPPER */
 } wmm_instance_t;
 	
 /* legacy from OS X API .. */
@@ -69,30 +72,8 @@ typedef signed short int SInt16;
 /* fill a buffer and return the number of frames filled */
 static int primeBuffer(wmm_instance_t *ap, void *outputBuffer, unsigned int framesPerBuffer)
 {
-	if (ap->position == ap->length && ap->loop)
-		ap->position = 0;
-	unsigned int index = ap->position;
-	unsigned int rem = ap->length - index;
-	unsigned int spf = ap->stereo ? 2 : 1;
-	if (rem > framesPerBuffer) rem = framesPerBuffer;
-	/* printf("position=%d, length=%d, (LEN=%d), rem=%d, cap=%d, spf=%d\n", ap->position, ap->length, LENGTH(ap->source), rem, framesPerBuffer, spf); */
-	index *= spf;
-	/* there is a small caveat - if a zero-size buffer comes along it will stop the playback since rem will be forced to 0 - but then that should not happen ... */
-	if (rem > 0) {
-		unsigned int samples = rem * spf; /* samples (i.e. SInt16s) */
-		SInt16 *iBuf = (SInt16*) outputBuffer;
-		SInt16 *sentinel = iBuf + samples;
-		if (TYPEOF(ap->source) == INTSXP) {
-			int *iSrc = INTEGER(ap->source) + index;
-			while (iBuf < sentinel)
-				*(iBuf++) = (SInt16) *(iSrc++);
-		} else if (TYPEOF(ap->source) == REALSXP) {
-			double *iSrc = REAL(ap->source) + index;
-			while (iBuf < sentinel)
-				*(iBuf++) = (SInt16) (32767.0 * (*(iSrc++)));
-		} /* FIXME: support functions as sources... */
-		ap->position += rem;
-	} else {
+	unsigned int rem = audio_engine_render_s16(ap->engine, (SInt16*) outputBuffer, framesPerBuffer);
+	if (rem == 0) {
 		/* printf(" rem ==0 -> stop queue\n"); */
 		ap->done = YES;
 		return 0;
@@ -142,7 +123,11 @@ static void CALLBACK waveOutProc(HWAVEOUT hwo,
 		    wmm_instance_t *ap = (wmm_instance_t*) hdr->dwUser;
 		    unsigned int bufSize = hdr->dwBufferLength;
 		    unsigned int bpf = ap->stereo ? 4 : 2;
-		    int res = primeBuffer(ap, hdr->lpData, bufSize / bpf);
+		    double start = audio_engine_clock();
+		    int res;
+		    audio_engine_timestamp(ap->engine, NAN); /* no device clock */
+		    res = primeBuffer(ap, hdr->lpData, bufSize / bpf);
+		    audio_engine_callback_done(ap->engine, start, bufSize / bpf);
 		    if (res > 0) {
 			    unsigned int bufId = 0;
 			    while (bufId < kNumberOutputBuffers && &ap->bufOutHdr[bufId] != hdr) bufId++;
@@ -171,14 +156,24 @@ static void CALLBACK waveInProc(
 			wmm_instance_t *ap = (wmm_instance_t*) hdr->dwUser;
 			signed short int *si = (signed short int*) hdr->lpData;
 			unsigned int len = hdr->dwBytesRecorded / 2;
-			if (TYPEOF(ap->source) == REALSXP) {
-				double *d = REAL(ap->source);
-				unsigned int cp = ap->position, lp = LENGTH(ap->source), i = 0;
-				while (i < len && cp < lp)
-					d[cp++] = ((double)si[i++]) / 32768.0;
-				ap->position = cp;
+			audio_engine_t *e = ap->engine;
+			unsigned int chs = e->chs, i = 0;
+			double d[AE_BLOCK * 2], start = audio_engine_clock();
+			audio_engine_timestamp(e, NAN); /* no device clock */
+			/* a full target is only captured into again after a rewind */
+			audio_engine_sync(e);
+			/* convert in blocks and let the engine store them in the target */
+			while (i + chs <= len && e->position < e->length) {
+				unsigned int k = 0;
+				while (k < AE_BLOCK * chs && i + chs <= len) {
+					unsigned int c;
+					for (c = 0; c < chs; c++)
+						d[k++] = ((double)si[i++]) / 32768.0;
+				}
+				audio_engine_capture(e, d, k / chs);
 			}
-			if (ap->position >= ap->length) /* pause if we reach the end */
+			audio_engine_callback_done(e, start, len / chs);
+			if (e->position >= e->length) /* pause if we reach the end */
 				waveInStop(ap->hin);
 			hdr->dwBytesRecorded = 0;
 			hdr->dwLoops = 0;
@@ -193,36 +188,28 @@ static void CALLBACK waveInProc(
 }
 
 static wmm_instance_t *wmmaudio_create_player(SEXP source, float rate, int flags) {
+	audio_engine_t *engine = audio_engine_new(source, rate, 0, flags);
 	wmm_instance_t *ap = (wmm_instance_t*) calloc(sizeof(wmm_instance_t), 1);
 	ap->source = source;
+	ap->engine = engine;
 	R_PreserveObject(ap->source);
 	ap->sample_rate = rate;
 	ap->done = NO;
-	ap->position = 0;
-	ap->length = LENGTH(source);
-	ap->stereo = NO;
-	{ /* if the source is a matrix with 2 rows then we'll use stereo */
-		SEXP dim = Rf_getAttrib(source, R_DimSymbol);
-		if (TYPEOF(dim) == INTSXP && LENGTH(dim) > 0 && INTEGER(dim)[0] == 2)
-			ap->stereo = YES;
-	}
-	ap->loop = (flags & APFLAG_LOOP) ? YES : NO;
-	if (ap->stereo) ap->length /= 2;
+	ap->stereo = (engine->chs == 2) ? YES : NO;
+	ap->dev = WAVE_MAPPER;
 	if (!feederThread)
 		feederThread = CreateThread(0, 0, feederThreadProc, 0, 0, &feederThreadId);
 	return ap;
 }
 
-static wmm_instance_t *wmmaudio_create_recorder(SEXP source, float rate, int channels, int flags) {
+static wmm_instance_t *wmmaudio_open_recorder(SEXP source, float rate, int channels, int flags, UINT dev) {
+	audio_engine_t *engine = audio_engine_new(source, rate, (channels == 2) ? 2 : 1, flags);
 	wmm_instance_t *ap = (wmm_instance_t*) calloc(sizeof(wmm_instance_t), 1);
 	ap->source = source;
+	ap->engine = engine;
 	ap->sample_rate = rate;
 	ap->done = NO;
-	ap->position = 0;
-	ap->length = LENGTH(source);
 	ap->stereo = (channels == 2) ? YES : NO;
-	ap->loop = (flags & APFLAG_LOOP) ? YES : NO;
-	/* if (ap->stereo) ap->length /= 2; we're bad - we us eposition as a raw pointer in the samples */
 	MMRESULT res;
 	WAVEFORMATEX fmt = {
 		WAVE_FORMAT_PCM, 
@@ -234,10 +221,15 @@ static wmm_instance_t *wmmaudio_create_recorder(SEXP source, float rate, int cha
 		0
 	};
 	ap->done = NO;
+	ap->dev = dev;
 	
 	/* open audio */
-	res = waveInOpen(&ap->hin, WAVE_MAPPER, &fmt, (DWORD_PTR)waveInProc, 0, CALLBACK_FUNCTION);
-	if (res) Rf_error("unable to open WMM audio for recording (%d)", res);
+	res = waveInOpen(&ap->hin, ap->dev, &fmt, (DWORD_PTR)waveInProc, 0, CALLBACK_FUNCTION);
+	if (res) {
+		audio_engine_free(engine);
+		free(ap);
+		Rf_error("unable to open WMM audio for recording (%d)", res);
+	}
 	
 	/* allocate and prepare buffers */
 	{
@@ -281,6 +273,10 @@ static wmm_instance_t *wmmaudio_create_recorder(SEXP source, float rate, int cha
 	return ap;
 }
 
+static wmm_instance_t *wmmaudio_create_recorder(SEXP source, float rate, int channels, int flags) {
+	return wmmaudio_open_recorder(source, rate, channels, flags, WAVE_MAPPER);
+}
+
 static int wmmaudio_start(void *usr) {
 	wmm_instance_t *p = (wmm_instance_t*) usr;
 	if (p->kind == AI_RECORDER) {
@@ -300,7 +296,7 @@ static int wmmaudio_start(void *usr) {
 	};
 	p->done = NO;
 	/* open audio */
-	res = waveOutOpen(&p->hout, WAVE_MAPPER, &fmt, (DWORD_PTR)waveOutProc, 0, CALLBACK_FUNCTION | WAVE_ALLOWSYNC);
+	res = waveOutOpen(&p->hout, p->dev, &fmt, (DWORD_PTR)waveOutProc, 0, CALLBACK_FUNCTION | WAVE_ALLOWSYNC);
 	if (res) Rf_error("unable to open WMM audio for output (%d)", res);
 	{
 		/* allocate and prime buffers */
@@ -356,8 +352,12 @@ static int wmmaudio_resume(void *usr) {
 			return waveInStart(p->hin) ? NO : YES;
 		return NO;
 	}
+	/* once all buffers have been returned no callback runs, so apply a
+	   pending rewind/seek before checking whether there is more to play */
+	if (p->dequeued >= kNumberOutputBuffers)
+		audio_engine_sync(p->engine);
 	/* if buffers have been dequeued before, we need to enqueue them back */
-	if (p->dequeued && p->position < p->length) {
+	if (p->dequeued && AE_LOAD(p->engine->position) < AE_LOAD(p->engine->length)) {
 		unsigned int bufferSize = kOutputBufferSize;
 		int i = 0;
 		while (i < kNumberOutputBuffers) {
@@ -376,7 +376,7 @@ static int wmmaudio_resume(void *usr) {
 
 static int wmmaudio_rewind(void *usr) {
 	wmm_instance_t *p = (wmm_instance_t*) usr;
-	p->position = 0;
+	audio_engine_rewind(p->engine);
 	return 1;
 }
 
@@ -388,6 +388,7 @@ static int wmmaudio_wait(void *usr, double timeout) {
 		double slice = (timeout > 0.1) ? 0.1 : timeout;
 		if (slice <= 0.0) break;
 		Sleep((DWORD) (slice * 1000));
+		if (p) audio_engine_service(p->engine); /* refill function sources */
 		R_ProcessEvents(); /* FIXME: we should adjust for time spent processing events */
 		timeout -= slice;
 	}
@@ -414,9 +415,57 @@ static void wmmaudio_dispose(void *usr) {
 		if (p->bufOut[i]) { free(p->bufOut[i]); p->bufOut[i] = 0; }
 		i++;
 	}
+	audio_engine_free(p->engine);
 	free(usr);
 }
 
+/* both directions use 16-bit mono or stereo */
+static int wmmaudio_caps(audio_caps_t *caps) {
+	caps->flags = ACAP_PLAY | ACAP_RECORD | ACAP_DEVICES | ACAP_ENGINE;
+	caps->formats = caps->native_format = AFMT_S16;
+	caps->max_out = 2;
+	caps->max_in = 2;
+	caps->default_rate = 44100.0;
+	return 1;
+}
+
+/* output and input devices are numbered separately by WMM, the list
+   has all output devices first, followed by the input devices */
+static int wmmaudio_devices(void) {
+	return (int) (waveOutGetNumDevs() + waveInGetNumDevs());
+}
+
+static int wmmaudio_device_info(int index, audio_device_info_t *di) {
+	static char name[sizeof(((WAVEOUTCAPS*)0)->szPname) + 1];
+	UINT outs = waveOutGetNumDevs();
+	if (index < (int) outs) {
+		WAVEOUTCAPS caps;
+		if (waveOutGetDevCaps((UINT) index, &caps, sizeof(caps))) return 0;
+		memcpy(name, caps.szPname, sizeof(caps.szPname));
+		di->max_out = caps.wChannels;
+	} else {
+		WAVEINCAPS caps;
+		if (waveInGetDevCaps((UINT) (index - outs), &caps, sizeof(caps))) return 0;
+		memcpy(name, caps.szPname, sizeof(caps.szPname));
+		di->max_in = caps.wChannels;
+	}
+	name[sizeof(name) - 1] = 0;
+	di->name = name; /* the core copies the strings */
+	di->host_api = "MME";
+	return 1;
+}
+
+static audio_instance_t *wmmaudio_open(const audio_config_t *cfg) {
+	UINT outs = waveOutGetNumDevs();
+	if (cfg->kind == AI_RECORDER)
+		return (audio_instance_t*) wmmaudio_open_recorder(cfg->target, cfg->rate, cfg->channels, cfg->flags,
+														  (cfg->device >= (int) outs) ? (UINT) (cfg->device - outs) : WAVE_MAPPER);
+	wmm_instance_t *ap = wmmaudio_create_player(cfg->source, cfg->rate, cfg->flags);
+	if (cfg->device >= 0 && cfg->device < (int) outs)
+		ap->dev = (UINT) cfg->device;
+	return (audio_instance_t*) ap;
+}
+
 /* define the audio driver */
 audio_driver_t wmmaudio_audio_driver = {
 	sizeof(audio_driver_t),	       
@@ -433,7 +482,11 @@ audio_driver_t wmmaudio_audio_driver = {
 	wmmaudio_rewind,
 	wmmaudio_wait,
 	wmmaudio_close,
-	wmmaudio_dispose
+	wmmaudio_dispose,
+	wmmaudio_caps,
+	wmmaudio_devices,
+	wmmaudio_device_info,
+	wmmaudio_open
 };
 
 #endif